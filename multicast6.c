@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,23 +8,145 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <linux/mroute6.h>
 #include <net/if.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#ifdef SIMULATION
+#include <ucontext.h>
+#endif
 
 /*
  * IPv6 Muticast Sender & Receiver (multicast6.c)
  *
  * Sends to & Receives from multicast group address
  *
- * Usage:  ./multicast6 <send|recv|both> <mip> <port> [sip|-] [ifname]
+ * Usage:  ./multicast6 <send|recv|both|compare|load|streams|topology|querier|router> <mip> <port> [sip|-] [ifname] [options]
  *
  *          send | recv | both  : mode of operation
+ *          compare             : run same workload thru each I/O engine on this host
+ *          load                : probe latency under bulk load steps, see Latency under load
+ *          streams             : time stream table at --streams senders, see Stream table benchmark
+ *          topology            : compare receive socket layouts at --topo group counts,
+ *                                see Socket topology benchmark
+ *          querier             : send MLDv2 queries and time membership reports of hosts,
+ *                                see Querier
+ *          router              : route groups between interfaces of --vifs in kernel,
+ *                                see Multicast router
  *          mip                 : ipv6 multicast group address
  *          port                : upd port number
  *          sip (optional)      : sender address for SSM
  *          ifname (optional)   : local interface name for multi-lan connectivity system
  *
+ * Options (sender impairment emulation):
+ *
+ *          --rate pps              : sending rate in packets per second (default 1)
+ *          --send-threads n        : n sender threads on own sockets and CPUs sharing
+ *                                    rate, see Sender threads
+ *          --seed n                : seed of impairment random generator (default 1)
+ *          --loss pct              : random loss
+ *          --ge p,r[,lg,lb]        : Gilbert-Elliott burst loss, good to bad p%, bad to good r%,
+ *                                    loss in good state lg% and in bad state lb% (default 0,100)
+ *          --dup pct               : duplication
+ *          --reorder pct[,depth]   : hold packet back behind depth later packets (default 3)
+ *          --delay ms[,jitter]     : fixed delay with uniformly distributed jitter
+ *          --corrupt pct           : flip a random bit in payload
+ *          --pattern spec          : onoff,n,ms poisson diurnal,sec[,pct] or trace,file gaps
+ *                                    instead of regular rate, see Traffic patterns
+ *
+ * Options (receiver):
+ *
+ *          -q, --quiet             : no message log
+ *          --stats sec             : report stats per sender stream at interval
+ *          --pcap file             : read datagrams of group from pcap file instead
+ *                                    of socket, and report processing rate per core
+ *          --realtime              : replay pcap at captured timing, not at full speed
+ *          --burst us[,pps]        : bin arrivals in windows of us and report microbursts,
+ *                                    above pps or 4 times average, see Microburst detector
+ *          --path                  : log changes of hop limit and steps of latency per stream,
+ *                                    see Path change detection
+ *          --police pps[,burst]    : drop datagrams of source address above pps, persistent
+ *                                    offenders in kernel filter, see Receive policing
+ *          --streams n             : track n sender streams (default 512), beyond 64 report
+ *                                    top 10 of interval, see Interval aggregation
+ *          --topo n[,n]...         : group counts of topology (default 1,4,16,64,256),
+ *                                    or joined by querier in turn
+ *          --query sec[,ms[,gsec]] : general query interval (default 2), max response
+ *                                    100 to 12700 (default 1000) and group query interval
+ *          --vifs if[,if]...       : interfaces of router, first is input of route to sip
+ *          --netns prefix[,n]      : receiver or sender thread in each of namespaces prefix0
+ *                                    to prefix(n-1), or in prefix, see Network namespaces
+ *          --record file           : also write datagrams to pcap file, see Sink fan-out
+ *          --forward [addr]:port : also send datagrams to TCP gateway, 2 bytes length framed
+ *          --group [mip]:port[:cls[:q]] : also receive group, priority class 0 to 3
+ *                                    (default 1, group of command line is 0) and
+ *                                    packets per turn (default 64), see group_thread()
+ *          --workers n             : process groups on n threads, see Worker pool
+ *          --work us               : emulated processing cost per datagram of workers
+ *
+ * Options (I/O engine):
+ *
+ *          --engine name           : plain, mmsg, io_uring, sqpoll or packet (receive
+ *                                    only, needs CAP_NET_RAW), see I/O engines (default plain)
+ *          --count n               : stop sending after n packets (compare default 100000)
+ *          --stamp                 : append send time to message, receiver reports latency
+ *          --batch n               : datagrams per engine batch, 1 to 64 (default 64)
+ *          --sockbuf bytes         : socket send and receive buffer (default system)
+ *          --busypoll us           : receive busy poll spin (default 0)
+ *          --txstamp               : report sender stack latency from SO_TIMESTAMPING,
+ *                                    see Transmit timestamps
+ *          --sync port             : correct one way latency by clock offset of senders,
+ *                                    asked on unicast port, see Clock sync
+ *          --tune                  : probe kernel features and pick fastest engine, batch,
+ *                                    buffer and spin at startup, see tune()
+ *          --clock name            : tsc or vdso, clock of timestamps and pacing, see TSC
+ *                                    clock (default tsc where invariant)
+ *
+ * Options (mode load, and for senders):
+ *
+ *          --load mbps[,mbps]...   : bulk load steps in Mbit/s (default 0,50,100,200,400)
+ *          --bulk [mip]:port[:dscp] : bulk group and DSCP (default port + 1 of probe group)
+ *          --size bytes            : pad messages to bytes, up to 65527 (bulk default 1400)
+ *          --dscp n                : DSCP of sent datagrams (probes in mode load)
+ *          --udplite cov           : UDP-Lite checksum over first cov bytes, 8 header
+ *                                    only, 0 all, see UDP-Lite
+ *          --pmtu port             : probe path MTU of group before sending, answers
+ *                                    to port, see Path MTU probing
+ *
+ * Options (simulation build, mode sim):
+ *
+ *          --nodes s,r             : simulated senders and receivers, up to 4096 each
+ *                                    (default 1,1)
+ *          --duration sec          : simulated time (default 10), or seconds per step of
+ *                                    mode load (default 2)
+ *          --script file           : scenario of link impairments, see sim_script()
+ *
  * Local interface name is required to select local interface thru which multicast
  * packets are sent and received, especially on multi-lan connectivity system.
  *
@@ -41,12 +164,14 @@
  *         ./multicast6 recv ff15::1 12345 - enp0s3                  // set local i/f to receive
  *         ./multicast6 recv ff15::1 12345 2001:db8:0:1::1 enp0s3    // SSM & local i/f
  *         ./multicast6 both ff15::1 12345                           // bidir sender & receiver
+ *         ./multicast6 compare ff15::1 12345 - lo                   // engines side by side
  *
  * Compile options:
  *
  *          gcc multicast6.c -o multicast6
  *
  *                  -D NOSSM    : no SSM with IGMPv3
+ *                  -D SIMULATION : simulated network with virtual clock, mode 'sim'
  *                  -l pthread  : for older PPC platform
  *
  * Verified on AlmaLinux 9.4
@@ -61,6 +186,13 @@
 // Buffer size Ethernet MTU - IP header - UDP header
 #define BUFSIZE (1500 - 40 - 8)
 
+// Largest payload of --size, beyond BUFSIZE for jumbo frames and loopback
+#ifdef SIMULATION
+#define MAXPAYLOAD BUFSIZE             // simulated network carries BUFSIZE
+#else
+#define MAXPAYLOAD (65535 - 8)         // UDP maximum
+#endif
+
 // Local interface thru which multicast packets are sent and received
 #define IFNAMEDEFAULT "default"
 #define IFIDXDEFAULT 0
@@ -68,6 +200,58 @@
 // Hop limit
 #define HOP 64
 
+// Nanoseconds per second
+#define NSEC 1000000000ULL
+
+// Delay queue slots preallocated by sender for delayed and reordered packets
+#define DQSIZE 4096
+
+// Sender impairment emulation, probabilities are in percent
+struct impair {
+    int enabled;                       // any impairment configured
+    uint64_t seed;                     // seed for reproducible runs
+    double loss;                       // random loss
+    double ge_p;                       // Gilbert-Elliott good to bad transition
+    double ge_r;                       // Gilbert-Elliott bad to good transition
+    double ge_lg;                      // Gilbert-Elliott loss in good state
+    double ge_lb;                      // Gilbert-Elliott loss in bad state
+    double dup;                        // duplication
+    double reorder;                    // reordering
+    int depth;                         // reorder depth in packets
+    double delay;                      // fixed delay in milliseconds
+    double jitter;                     // delay jitter in milliseconds
+    double corrupt;                    // payload bit corruption
+};
+
+// Traffic pattern of sender, see Traffic patterns
+#define PAT_NONE    0                  // regular at --rate
+#define PAT_ONOFF   1
+#define PAT_POISSON 2
+#define PAT_DIURNAL 3
+#define PAT_TRACE   4
+
+struct pattern {
+    int kind;                          // PAT_*
+    int burst;                         // onoff: packets per burst
+    double gap;                        // onoff: ms idle between bursts
+    double period;                     // diurnal: seconds per cycle
+    double low;                        // diurnal: lowest percent of rate
+    uint64_t *gaps;                    // trace: gaps in ns
+    int ngaps;
+};
+
+// Extra group of multi-group receiver
+#define MAXGROUPS 64
+#define MAXLOADS 16                    // load steps of mode load
+#define MAXTOPOS 16                    // group count steps of mode topology
+
+struct group {
+    struct in6_addr mip;               // multicast group address
+    u_short port;                      // port number
+    int cls;                           // priority class, 0 first
+    int quantum;                       // packets per turn
+};
+
 // Common parameters
 struct param {
     struct in6_addr mip;               // multicast group address
@@ -78,245 +262,6602 @@ struct param {
     int ssm;                           // source specific multicast
     int loop;                          // enable loop back to local application
     int bidir;                         // bidirectional multicast
+    double rate;                       // sending rate in packets per second
+    struct impair imp;                 // sender impairment emulation
+    int quiet;                         // no message log, stats only
+    double stats;                      // receiver stats interval in seconds
+    const char *pcap;                  // offline input instead of socket
+    int realtime;                      // replay pcap at captured timing
+    int senders;                       // simulated senders
+    int receivers;                     // simulated receivers
+    double duration;                   // simulated seconds
+    const char *script;                // simulation scenario script
+    const struct engops *engine;       // I/O engine
+    long count;                        // packets to send, 0 forever
+    int stamp;                         // append send time to message
+    struct result *res;                // results of compare or tune run
+    int ttl;                           // multicast hop limit
+    int tune;                          // probe and calibrate at startup
+    int batch;                         // engine batch, 0 engine default
+    int sockbuf;                       // socket buffer bytes, 0 system default
+    int busypoll;                      // receive busy poll in us
+    const char *record;                // record sink, pcap file
+    const char *forward;               // forward sink, TCP gateway
+    struct group group[MAXGROUPS];     // extra groups of receiver
+    int ngroups;
+    int workers;                       // processing threads of groups
+    double work;                       // emulated processing per datagram in us
+    int sendthreads;                   // sender threads sharing rate
+    struct bucket *bucket;             // rate budget of sender threads
+    struct txstat *txs;                // progress of this sender thread
+    struct nshost *nsh;                // namespace of this host thread
+    int txstamp;                       // transmit timestamps of sender
+    int syncport;                      // clock sync side channel, 0 none
+    const char *clocksrc;              // tsc or vdso, NULL tsc if usable
+    int size;                          // pad messages to bytes, 0 none
+    int dscp;                          // DSCP of sent datagrams
+    struct in6_addr bulkmip;      // bulk group of mode load
+    u_short bulkport;
+    int bulkdscp;
+    double load[MAXLOADS];             // bulk Mbit/s per step
+    int nloads;
+    double burst;                      // microburst window in us, 0 off
+    double burstpps;                   // rate of hot window, 0 by average
+    int path;                          // path change detection
+    double police;                     // pps per source, 0 off
+    double policeburst;                // packets of bucket, 0 default
+    int streams;                       // streams tracked, 0 default
+    int topo[MAXTOPOS];                // group counts of topology runs
+    int ntopo;
+    double qint;                       // seconds between general queries
+    int qresp;                         // max response time in ms
+    double qgrp;                       // seconds between group queries, 0 none
+    const char *vifs;                  // interfaces of router
+    char netns[64];                    // namespace, or prefix of n
+    int nnetns;                        // host threads, 0 one in netns
+    int lite;                          // UDP-Lite instead of UDP
+    int cscov;                         // checksum coverage of UDP-Lite, 0 all
+    int pmtuport;                      // port of path MTU answers, 0 off
+    struct pattern pat;                // traffic pattern of sender
 };
 
+#ifdef SIMULATION
+#define SIM_EPOCH 1748736000           // virtual time zero, 2025/06/01 UTC
+extern uint64_t sim_now;               // virtual clock of simulation build
+void sim_sleep(uint64_t t);
+#endif
+
 /*
- * Receiver Thread
+ * TSC clock
+ *
+ * clock_gettime thru vDSO costs some 20 ns, which adds up when every packet
+ * is stamped at several stages at millions of packets per second.  Where
+ * the CPU has an invariant TSC and the kernel itself keeps time by it, clock
+ * reads are one rdtsc and a multiply instead: ticks since a calibration
+ * point are scaled by fixed point ns per tick and added to monotonic time at
+ * that point.  Calibration against CLOCK_MONOTONIC and CLOCK_REALTIME is
+ * taken at startup over TSC_WARMUP ms, then again every TSC_PERIOD ms by a
+ * thread, which corrects the rate from the last interval and follows steps
+ * of realtime.  A new calibration point is never put behind time already
+ * read, so monotonic time stays monotonic.  Readers take the calibration by
+ * seqlock.  Otherwise, and with --clock vdso, clocks are read by
+ * clock_gettime.
  */
-void *recv_thread(void *args) {
-    struct param *pp = args;
 
-    int sock;
-    char buffer[BUFSIZE];
+#if ! defined(SIMULATION) && (defined(__x86_64__) || defined(__i386__))
+#define TSC
+#endif
 
-    // Create socket
-    sock = socket(AF_INET6, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed (receiver)");
-        exit(EXIT_FAILURE);
+#ifdef TSC
+#define TSC_WARMUP 10                  // ms of first calibration
+#define TSC_PERIOD 1000                // ms between calibrations
+
+struct tscclock {
+    int on;                            // clocks read by TSC
+    uint32_t seq;                      // calibration below is written while odd
+    uint64_t tsc0;                     // ticks at calibration point
+    uint64_t mono0;                    // monotonic ns at tsc0
+    uint64_t walloff;                  // realtime minus monotonic ns
+    uint64_t mult;                     // ns per tick, 32 bits fraction
+};
+
+static struct tscclock tsc;
+
+// Monotonic ns and realtime offset by TSC
+static inline uint64_t tsc_read(uint64_t *walloff) {
+    uint32_t seq;
+    uint64_t t0, m0, mult;
+    do {
+        seq = __atomic_load_n(&tsc.seq, __ATOMIC_ACQUIRE);
+        t0 = __atomic_load_n(&tsc.tsc0, __ATOMIC_RELAXED);
+        m0 = __atomic_load_n(&tsc.mono0, __ATOMIC_RELAXED);
+        mult = __atomic_load_n(&tsc.mult, __ATOMIC_RELAXED);
+        *walloff = __atomic_load_n(&tsc.walloff, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&tsc.seq, __ATOMIC_RELAXED));
+    int64_t d = (int64_t)(__rdtsc() - t0);
+    if (d < 0) { d = 0; }                          // skew between cores
+    return m0 + (uint64_t)(((unsigned __int128)d * mult) >> 32);
+}
+
+// Ticks with monotonic and realtime ns read between, tightest of few tries
+static void tsc_sample(uint64_t *t, uint64_t *mono, uint64_t *wall) {
+    uint64_t best = UINT64_MAX;
+    int i;
+    for (i = 0; i < 5; i++) {
+        struct timespec m, w;
+        uint64_t a = __rdtsc();
+        clock_gettime(CLOCK_MONOTONIC, &m);
+        clock_gettime(CLOCK_REALTIME, &w);
+        uint64_t b = __rdtsc();
+        if (b - a >= best) { continue; }
+        best = b - a;
+        *t = a + (b - a) / 2;
+        *mono = (uint64_t)m.tv_sec * NSEC + m.tv_nsec;
+        *wall = (uint64_t)w.tv_sec * NSEC + w.tv_nsec;
     }
+}
 
-    // Enable SO_REUSEADDR to share port with other applications
-    int reuse = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed (receiver)");
-        exit(EXIT_FAILURE);
+static void tsc_publish(uint64_t t, uint64_t mono, uint64_t walloff, uint64_t mult) {
+    __atomic_store_n(&tsc.seq, tsc.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&tsc.tsc0, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc.mono0, mono, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc.walloff, walloff, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc.mult, mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&tsc.seq, tsc.seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Calibrate TSC every TSC_PERIOD ms
+ */
+void *tsc_thread(void *args) {
+    uint64_t t1 = tsc.tsc0, m1 = tsc.mono0;
+    struct timespec ts = { TSC_PERIOD / 1000, (TSC_PERIOD % 1000) * 1000000L };
+    while (1) {
+        nanosleep(&ts, NULL);
+        uint64_t t2, m2, w2;
+        tsc_sample(&t2, &m2, &w2);
+        if (t2 <= t1 || m2 <= m1) { continue; }
+        uint64_t mult = (uint64_t)(((unsigned __int128)(m2 - m1) << 32) / (t2 - t1));
+
+        // Anchor at clock read, or at TSC time if that is already ahead
+        uint64_t d = t2 - tsc.tsc0;
+        uint64_t est = tsc.mono0 + (uint64_t)(((unsigned __int128)d * tsc.mult) >> 32) + 1;
+        uint64_t mono = est > m2 ? est : m2;
+        tsc_publish(t2, mono, w2 - m2, mult);
+        t1 = t2;
+        m1 = m2;
     }
+    return NULL;
+}
 
-    // Bind to local port
-    struct sockaddr_in6 local_addr;
-    memset(&local_addr, 0, sizeof(local_addr));
-    local_addr.sin6_family = AF_INET6;
-    local_addr.sin6_addr = in6addr_any;                    // ipv6 magic!!!
-    local_addr.sin6_port = pp->port;                       // upd-port-number
+// Invariant TSC that kernel keeps time by too
+static int tsc_usable(void) {
+    unsigned a, b, c, d;
+    if (! __get_cpuid(0x80000007, &a, &b, &c, &d) || ! (d & (1 << 8))) { return 0; }
+    char src[32] = "";
+    FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if (! f) { return 0; }
+    if (! fgets(src, sizeof(src), f)) { src[0] = '\0'; }
+    fclose(f);
+    return strncmp(src, "tsc", 3) == 0;
+}
 
-    if (bind(sock, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
-        perror("Bind failed (receiver)");
+/*
+ * Use TSC clock if usable and wanted
+ */
+void tsc_init(int want) {
+    if (! want || ! tsc_usable()) { return; }
+    uint64_t t1, m1, w1, t2, m2, w2;
+    struct timespec ts = { 0, TSC_WARMUP * 1000000L };
+    tsc_sample(&t1, &m1, &w1);
+    nanosleep(&ts, NULL);
+    tsc_sample(&t2, &m2, &w2);
+    if (t2 <= t1 || m2 <= m1) { return; }
+    tsc_publish(t2, m2, w2 - m2, (uint64_t)(((unsigned __int128)(m2 - m1) << 32) / (t2 - t1)));
+    tsc.on = 1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, tsc_thread, NULL) != 0) {
+        perror("TSC calibration thread failed");
         exit(EXIT_FAILURE);
     }
+    pthread_detach(t);
+}
 
-    // Join multicast group with any source multicast (ASM)
-    if (pp->ssm == 0) {
-        struct ipv6_mreq mreq;
-        mreq.ipv6mr_multiaddr = pp->mip;                   // multicast-group
-        mreq.ipv6mr_interface = pp->ifidx;                 // local interface
-        if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP,
-                            &mreq, sizeof(mreq)) < 0) {
-            perror("setsockopt(IPV6_JOIN_GROUP) failed");
-            exit(EXIT_FAILURE);
-        }
-        char ipaddr[INET6_ADDRSTRLEN];
-        printf("Joined ASM [%s]:%d via interface index %d (%s)\n", 
-                    inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)), 
-                    ntohs(pp->port),
-                    pp->ifidx, pp->ifname);
+// Clock in use, as printed by compare
+void tsc_name(char *buf, size_t len) {
+    if (tsc.on) {
+        snprintf(buf, len, "tsc %.3f GHz", 4294967296.0 / tsc.mult);
+    } else {
+        snprintf(buf, len, "vdso");
     }
+}
+#else
+void tsc_init(int want) { (void)want; }
+void tsc_name(char *buf, size_t len) { snprintf(buf, len, "vdso"); }
+#endif
 
-#ifndef NOSSM
-    // Join multicast group with source specific multicast (SSM)
-    if (pp->ssm == 1) {
-        if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE,
-                                pp->ifname, strlen(pp->ifname)) < 0) {
-            perror("setsockopt(SO_BINDTODEVICE) failed");
-            exit(EXIT_FAILURE);
-        }
-        struct group_source_req mreq;
-        memset(&mreq, 0, sizeof(mreq));
+/*
+ * Monotonic clock in nanoseconds
+ */
+static inline uint64_t now_ns(void) {
+#ifdef SIMULATION
+    return sim_now;
+#else
+#ifdef TSC
+    uint64_t off;
+    if (tsc.on) { return tsc_read(&off); }
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+#endif
+}
 
-        struct sockaddr_in6 gaddr;
-        memset(&gaddr, 0, sizeof(gaddr));
-        gaddr.sin6_family = AF_INET6;
-        gaddr.sin6_addr = pp->mip;
-        memcpy(&mreq.gsr_group, &gaddr, sizeof(gaddr));              // multicast-group
+/*
+ * Realtime clock in nanoseconds, for timestamps compared across hosts
+ */
+static inline uint64_t wall_ns(void) {
+#ifdef SIMULATION
+    return SIM_EPOCH * NSEC + sim_now;
+#else
+#ifdef TSC
+    uint64_t off;
+    if (tsc.on) { return tsc_read(&off) + off; }
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+#endif
+}
 
-        struct sockaddr_in6 saddr;
-        memset(&saddr, 0, sizeof(saddr));
-        saddr.sin6_family = AF_INET6;
-        saddr.sin6_addr = pp->sip;
-        memcpy(&mreq.gsr_source, &saddr, sizeof(saddr));             // sender-address
+/*
+ * CPU time consumed by calling thread in nanoseconds
+ */
+static inline uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
 
-        mreq.gsr_interface = pp->ifidx;                              // local interface
-        if (setsockopt(sock, IPPROTO_IPV6, MCAST_JOIN_SOURCE_GROUP,
-                                &mreq, sizeof(mreq)) < 0) {
-            perror("setsockopt(MCAST_JOIN_SOURCE_GROUP) failed");
-            exit(EXIT_FAILURE);
-        }
-        char ipaddr[INET6_ADDRSTRLEN];
-        printf("Joined SSM [%s]:%d ", 
-                    inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)),
-                    ntohs(pp->port));
-        printf("from %s via interface %d (%s)\n", 
-                    inet_ntop(AF_INET6, &pp->sip, ipaddr, sizeof(ipaddr)),
-                    pp->ifidx, pp->ifname);
-    }
-#endif
+/*
+ * CPU time of another thread of this process in nanoseconds, 0 if unknown
+ */
+static inline uint64_t tid_cpu_ns(int tid) {
+    struct timespec ts;
+    clockid_t clk = (~(clockid_t)tid << 3) | 6;    // per thread scheduler clock
+    if (tid <= 0 || clock_gettime(clk, &ts) < 0) { return 0; }
+    return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
 
-    // Receive multicast messages
-    while (1) {
-        struct sockaddr_in6 sender_addr;
-        socklen_t sender_addr_len = sizeof(sender_addr);
-        ssize_t received_size = recvfrom(sock, buffer, sizeof(buffer), 0,
-                                        (struct sockaddr*)&sender_addr,
-                                        &sender_addr_len);
-        if (received_size < 0) {
-            perror("recvfrom failed");
-            continue;
-        }
+/*
+ * Sleep until absolute monotonic time in nanoseconds
+ */
+void sleep_until(uint64_t t) {
+#ifdef SIMULATION
+    sim_sleep(t);
+#else
+    struct timespec ts;
+    ts.tv_sec = t / NSEC;
+    ts.tv_nsec = t % NSEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#endif
+}
 
-        // Get sender's IP address and port
-        char sender_ip[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &sender_addr.sin6_addr, 
-                            sender_ip, sizeof(sender_ip));
-        u_short sender_port = ntohs(sender_addr.sin6_port);
+/*
+ * Pseudo random number generator (xorshift64*)
+ *
+ * Seeded explicitly so that impaired runs are reproducible.
+ */
+void rng_seed(uint64_t *s, uint64_t seed) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;    // splitmix64, never zero
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    *s = (z ^ (z >> 31)) | 1;
+}
 
-        int i;
-        for (i = 0; i < received_size; i++) {
-            if (! isprint(buffer[i])) { buffer[i] = '.'; }
-        }
+static inline uint64_t rng_next(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
 
-        printf("Recv fm [%s]:%d = %.*s (%d)\n",
-            sender_ip, sender_port,
-            (int)received_size, buffer, (int)received_size);
-    }
+// Uniform in [0, 1)
+static inline double rng_unit(uint64_t *s) {
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
 
-    close(sock);
-    return 0;
+// True with probability pct percent
+static inline int rng_chance(uint64_t *s, double pct) {
+    return pct > 0 && rng_unit(s) * 100.0 < pct;
 }
 
+#ifdef SIMULATION
 /*
- * Sender Thread
+ * Simulation build (-D SIMULATION)
+ *
+ * Socket calls used by send_thread and recv_thread are replaced by an
+ * in-memory network with a virtual clock, so that many senders and
+ * receivers run in one process much faster than real time, and every
+ * scenario is reproduced bit-for-bit from its seed.
+ *
+ * Threads become coroutines, run one at a time by a scheduler in order of
+ * virtual wake-up time (ties in order of scheduling), and the clock jumps to
+ * next wake-up instead of sleeping.  sendto() delivers a copy to member
+ * sockets of every other node at send time plus link delay and jitter,
+ * subject to link loss and duplication, and recvfrom() blocks the coroutine
+ * until head of its queue arrives.  Receive queue is bounded like SO_RCVBUF.
+ * Link impairments change at scripted times, and a sender can be taken down
+ * and up again to exercise failover:
+ *
+ *     # sec  link  settings
+ *     0      *     delay 2 jitter 0.5
+ *     10     r3    loss 20 dup 1
+ *     20     r3    loss 0
+ *     30     s0    down
+ *     40     s0    up
+ *
+ * where link is * (all receivers), rN (receiver N) or sN (sender N).
  */
-void *send_thread(void *args) {
-    struct param *pp = args;
 
-    int sock;
-    char message[BUFSIZE];
-    char fixstr[] = "0.....";
+#define SIM_STACK (256 * 1024)          // coroutine stack
+#define SIM_MAXNODES 4096               // senders or receivers, stacks of 1 GB
+#define SIM_QLEN 4096                   // socket receive queue in packets
+#define SIM_MAXJOIN 64                  // memberships per socket
+#define SIM_FDBASE 1000                 // first simulated socket descriptor
 
-    // Create socket
-    sock = socket(AF_INET6, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed (sender)");
-        exit(EXIT_FAILURE);
-    }
+struct simpkt {
+    struct simpkt *next;                // free list
+    uint64_t at;                        // arrival time
+    uint64_t ord;                       // delivery order on same arrival
+    struct sockaddr_in6 src;            // sender address and port
+    int len;                            // datagram length
+    char data[BUFSIZE];                 // datagram payload
+};
 
-    // Bind local interface
-    struct sockaddr_in6 local_bind; 
-    memset(&local_bind, 0, sizeof(local_bind));
-    local_bind.sin6_family = AF_INET6;
-    //local_bind.sin6_addr = in6addr_any;
-    local_bind.sin6_addr = pp->sip;                       // src address
+struct simsock {
+    int task;                           // owner task, -1 when closed
+    struct sockaddr_in6 local;          // bound address and port
+    int loop;                           // IPV6_MULTICAST_LOOP
+    int njoin;                          // memberships
+    struct in6_addr group[SIM_MAXJOIN]; // joined groups
+    struct in6_addr source[SIM_MAXJOIN];// SSM source or in6addr_any
+    uint64_t timeout;                   // SO_RCVTIMEO in ns
+    struct simpkt **q;                  // receive queue, min-heap by arrival
+    int qlen;
+    int waiter;                         // task blocked in recvfrom or -1
+    uint64_t drops;                     // receive queue overflow
+};
 
-    // Set source port number when bidir mode
-    if (pp->bidir == 1) {
-        int reuse = 1;
-        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-            perror("setsockopt(SO_REUSEADDR) failed (sender)");
+struct simlink {
+    double loss;                        // loss in percent
+    double dup;                         // duplication in percent
+    double delay;                       // delay in ms
+    double jitter;                      // jitter in ms
+    int down;                           // link is down
+};
+
+struct simtask {
+    ucontext_t ctx;                     // coroutine context
+    void *(*fn)(void *);                // send_thread or recv_thread
+    struct param p;                     // parameters of this node
+    struct in6_addr addr;               // node address
+    int sender;                         // sender or receiver
+    int index;                          // index among senders or receivers
+    uint64_t wake;                      // wake-up time, UINT64_MAX if none
+    uint64_t gen;                       // wake-up generation
+    struct rxstate *rx;                 // receive pipeline for final report
+};
+
+struct simwake {
+    uint64_t at;                        // wake-up time
+    uint64_t ord;                       // scheduling order on same time
+    int task;
+    uint64_t gen;                       // stale unless task gen matches
+};
+
+// Link settings changed by script event
+#define SIM_LOSS   0x01
+#define SIM_DUP    0x02
+#define SIM_DELAY  0x04
+#define SIM_JITTER 0x08
+#define SIM_DOWN   0x10
+
+struct simevent {
+    uint64_t at;                        // event time
+    int sender;                         // sender or receiver link
+    int index;                          // link index, -1 for all receivers
+    int mask;                           // SIM_* settings to apply
+    struct simlink set;                 // new settings
+};
+
+uint64_t sim_now;                       // virtual clock in ns
+static int sim_cur = -1;                // running task
+static ucontext_t sim_main;             // scheduler context
+static struct simtask *sim_task;
+static int sim_ntask;
+static struct simsock **sim_sock;      // sockets by descriptor
+static int sim_nsock;
+static struct simwake *sim_wq;          // wake-up queue, min-heap
+static int sim_nwq;
+static int sim_wqcap;
+static struct simevent *sim_ev;         // script events in time order
+static int sim_nev;
+static int sim_evnext;
+static struct simlink *sim_slink;       // sender links
+static struct simlink *sim_rlink;       // receiver links
+static struct simpkt *sim_free;         // free packet buffers
+static uint64_t sim_ord;
+static uint64_t sim_rng;
+static u_short sim_port = 32768;        // next ephemeral port
+static uint64_t sim_sent, sim_delivered, sim_lost, sim_dropped, sim_switches;
+static uint64_t sim_impaired;           // lost by impairment of senders
+
+static inline int sim_before(const struct simwake *a, const struct simwake *b) {
+    return a->at < b->at || (a->at == b->at && a->ord < b->ord);
+}
+
+// Schedule task to run at virtual time, superseding earlier schedule
+void sim_wakeup(int t, uint64_t at) {
+    struct simtask *tp = &sim_task[t];
+    tp->wake = at;
+    tp->gen++;
+    if (at == UINT64_MAX) { return; }
+    if (sim_nwq == sim_wqcap) {
+        sim_wqcap = sim_wqcap ? sim_wqcap * 2 : 1024;
+        sim_wq = realloc(sim_wq, sim_wqcap * sizeof(*sim_wq));
+        if (! sim_wq) {
+            perror("Simulation wake-up queue allocation failed");
             exit(EXIT_FAILURE);
         }
-        local_bind.sin6_port = pp->port;                   // src port number
     }
+    struct simwake w = { at, sim_ord++, t, tp->gen };
+    int i = sim_nwq++;
+    while (i > 0 && sim_before(&w, &sim_wq[(i - 1) / 2])) {
+        sim_wq[i] = sim_wq[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim_wq[i] = w;
+}
 
-    if (bind(sock, (struct sockaddr*)&local_bind, sizeof(local_bind)) < 0) {
-        perror("Bind for source interfce and port failed");
-        exit(EXIT_FAILURE);
+struct simwake sim_wq_pop(void) {
+    struct simwake top = sim_wq[0];
+    struct simwake w = sim_wq[--sim_nwq];
+    int i = 0;
+    while (1) {
+        int c = 2 * i + 1;
+        if (c >= sim_nwq) { break; }
+        if (c + 1 < sim_nwq && sim_before(&sim_wq[c + 1], &sim_wq[c])) { c++; }
+        if (! sim_before(&sim_wq[c], &w)) { break; }
+        sim_wq[i] = sim_wq[c];
+        i = c;
     }
+    sim_wq[i] = w;
+    return top;
+}
 
-    // Set multicast interface to send if local interface is specified
-    if (pp->ifidx != IFIDXDEFAULT) {
-        if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF,
-                &pp->ifidx, sizeof(pp->ifidx)) < 0) {
-            perror("setsockopt(IPV6_MULTICAST_IF) failed");
-            exit(EXIT_FAILURE);
-        }
+// Yield running task to scheduler until virtual time at
+void sim_block(uint64_t at) {
+    int t = sim_cur;
+    sim_wakeup(t, at);
+    swapcontext(&sim_task[t].ctx, &sim_main);
+}
+
+void sim_sleep(uint64_t t) {
+    sim_block(t > sim_now ? t : sim_now);
+}
+
+time_t sim_time(time_t *t) {
+    time_t v = SIM_EPOCH + sim_now / NSEC;
+    if (t) { *t = v; }
+    return v;
+}
+
+static inline int sim_pkt_before(const struct simpkt *a, const struct simpkt *b) {
+    return a->at < b->at || (a->at == b->at && a->ord < b->ord);
+}
+
+static inline struct simsock *sim_fd(int fd) {
+    if (fd < SIM_FDBASE || fd >= SIM_FDBASE + sim_nsock || sim_sock[fd - SIM_FDBASE]->task < 0) {
+        return NULL;
     }
+    return sim_sock[fd - SIM_FDBASE];
+}
 
-    printf("Sending via interface index %d (%s)\n", pp->ifidx, pp->ifname);
+int sim_socket(int domain, int type, int protocol) {
+    sim_sock = realloc(sim_sock, (sim_nsock + 1) * sizeof(*sim_sock));
+    if (! sim_sock) { return -1; }
+    struct simsock *s = calloc(1, sizeof(*s));
+    if (! s) { return -1; }
+    sim_sock[sim_nsock] = s;
+    s->task = sim_cur;
+    s->local.sin6_family = domain;
+    s->loop = 1;
+    s->waiter = -1;
+    s->q = malloc(SIM_QLEN * sizeof(*s->q));
+    if (! s->q) { return -1; }
+    return SIM_FDBASE + sim_nsock++;
+}
 
-    // Set hop limit value to packet to go beyond routers
-    int hop = HOP;
-    if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
-            &hop, sizeof(hop)) < 0) {
-        perror("setsockopt(IPV6_MULTICAST_HOPS) failed");
-        exit(EXIT_FAILURE);
+int sim_bind(int fd, const struct sockaddr *addr, socklen_t len) {
+    struct simsock *s = sim_fd(fd);
+    if (! s) { errno = EBADF; return -1; }
+    memcpy(&s->local, addr, sizeof(s->local));
+    if (s->local.sin6_port == 0) { s->local.sin6_port = htons(sim_port++); }
+    return 0;
+}
+
+int sim_setsockopt(int fd, int level, int opt, const void *val, socklen_t len) {
+    struct simsock *s = sim_fd(fd);
+    if (! s) { errno = EBADF; return -1; }
+    if (level == SOL_SOCKET && opt == SO_RCVTIMEO) {
+        const struct timeval *tv = val;
+        s->timeout = (uint64_t)tv->tv_sec * NSEC + (uint64_t)tv->tv_usec * 1000;
+    } else
+    if (level == IPPROTO_IPV6 && opt == IPV6_MULTICAST_LOOP) {
+        s->loop = *(const int *)val;
+    } else
+    if (level == IPPROTO_IPV6 && (opt == IPV6_JOIN_GROUP || opt == MCAST_JOIN_SOURCE_GROUP)) {
+        if (s->njoin == SIM_MAXJOIN) { errno = ENOBUFS; return -1; }
+        if (opt == IPV6_JOIN_GROUP) {
+            const struct ipv6_mreq *m = val;
+            s->group[s->njoin] = m->ipv6mr_multiaddr;
+            s->source[s->njoin] = in6addr_any;
+        } else {
+            const struct group_source_req *m = val;
+            s->group[s->njoin] = ((const struct sockaddr_in6 *)&m->gsr_group)->sin6_addr;
+            s->source[s->njoin] = ((const struct sockaddr_in6 *)&m->gsr_source)->sin6_addr;
+        }
+        s->njoin++;
     }
+    return 0;                           // others have no effect
+}
 
-    // Enable/Disable IP_MULTICAST_LOOP to local receiver
-    if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
-            &pp->loop, sizeof(pp->loop)) < 0) {
-        perror("setsockopt(IPV6_MULTICAST_LOOP) failed");
+// Queue datagram on receiving socket, and wake its reader if earlier
+void sim_enqueue(struct simsock *r, const struct sockaddr_in6 *src,
+                const char *buf, int len, uint64_t at) {
+    if (r->qlen == SIM_QLEN) {
+        r->drops++;
+        sim_dropped++;
+        return;
+    }
+    struct simpkt *pk = sim_free;
+    if (pk) {
+        sim_free = pk->next;
+    } else if (! (pk = malloc(sizeof(*pk)))) {
+        perror("Simulation packet allocation failed");
         exit(EXIT_FAILURE);
     }
+    pk->at = at;
+    pk->ord = sim_ord++;
+    pk->src = *src;
+    pk->len = len;
+    memcpy(pk->data, buf, len);
 
-    // Set up destination multicast address
-    struct sockaddr_in6 multicast_addr;
-    memset(&multicast_addr, 0, sizeof(multicast_addr));
-    multicast_addr.sin6_family = AF_INET6;
-    multicast_addr.sin6_addr = pp->mip;                    // multicast-group
-    multicast_addr.sin6_port = pp->port;                   // udp-port-number
+    int i = r->qlen++;
+    while (i > 0 && sim_pkt_before(pk, r->q[(i - 1) / 2])) {
+        r->q[i] = r->q[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    r->q[i] = pk;
 
-    // Send multicast message
-    int i = 0;
-    while (1) {
-        char timestr[7];
-        time_t now = time(NULL);
+    if (r->waiter >= 0 && at < sim_task[r->waiter].wake) {
+        sim_wakeup(r->waiter, at);
+    }
+}
 
-        // Get the current time and format message
-        strftime(timestr, sizeof(timestr), "%H%M%S", localtime(&now));
+ssize_t sim_sendto(int fd, const void *buf, size_t n, int flags,
+                const struct sockaddr *dst, socklen_t dstlen) {
+    struct simsock *s = sim_fd(fd);
+    if (! s) { errno = EBADF; return -1; }
+    if (n > BUFSIZE) { errno = EMSGSIZE; return -1; }
+    if (s->local.sin6_port == 0) { s->local.sin6_port = htons(sim_port++); }
 
-        fixstr[0] = '0' + (i / (sizeof(fixstr)-1)) % 10;
+    struct simtask *tp = &sim_task[s->task];
+    struct sockaddr_in6 src = s->local;
+    if (IN6_IS_ADDR_UNSPECIFIED(&src.sin6_addr)) { src.sin6_addr = tp->addr; }
+    const struct sockaddr_in6 *to = (const struct sockaddr_in6 *)dst;
 
-        int sending_size = snprintf(message, sizeof(message), "%s%.*s/%s/%06d",
-                    fixstr + (sizeof(fixstr)-1) - (i % (sizeof(fixstr)-1)), 
-                    (int)((sizeof(fixstr)-1) - (i % (sizeof(fixstr)-1))), fixstr,
-                    timestr, (i+1));
+    sim_sent++;
+    if (tp->sender && sim_slink[tp->index].down) {
+        sim_lost++;
+        return n;
+    }
 
-        // Send multicast message
-        if (sendto(sock, message, sending_size, 0,
-                (struct sockaddr*)&multicast_addr, 
-                sizeof(multicast_addr)) < 0) {
-            perror("Send failed");
-            exit(EXIT_FAILURE);
+    int i, j;
+    for (i = 0; i < sim_nsock; i++) {
+        struct simsock *r = sim_sock[i];
+        if (r->task < 0 || (r->task == s->task && ! s->loop)) { continue; }
+        if (r->local.sin6_port != to->sin6_port) { continue; }
+        if (! IN6_IS_ADDR_UNSPECIFIED(&r->local.sin6_addr) &&
+                ! IN6_ARE_ADDR_EQUAL(&r->local.sin6_addr, &to->sin6_addr)) { continue; }
+        for (j = 0; j < r->njoin; j++) {
+            if (IN6_ARE_ADDR_EQUAL(&r->group[j], &to->sin6_addr) &&
+                    (IN6_IS_ADDR_UNSPECIFIED(&r->source[j]) ||
+                     IN6_ARE_ADDR_EQUAL(&r->source[j], &src.sin6_addr))) { break; }
         }
+        if (j == r->njoin) { continue; }
 
-        char ipaddr[INET6_ADDRSTRLEN];
-        printf("Sent to [%s]:%d = %.*s (%d)\n",
-                    inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)), 
-                    ntohs(pp->port),
-                    sending_size, message, sending_size);
-        sleep(1);
-        i++;
+        struct simtask *rp = &sim_task[r->task];
+        struct simlink none = { 0 }, *lk = rp->sender ? &none : &sim_rlink[rp->index];
+        if (lk->down || rng_chance(&sim_rng, lk->loss)) {
+            sim_lost++;
+            continue;
+        }
+        int copies = 1 + rng_chance(&sim_rng, lk->dup);
+        while (copies-- > 0) {
+            double ms = lk->delay;
+            if (lk->jitter > 0) { ms += lk->jitter * (2.0 * rng_unit(&sim_rng) - 1.0); }
+            uint64_t at = sim_now + (ms > 0 ? (uint64_t)(ms * 1000000.0) : 0);
+            sim_enqueue(r, &src, buf, n, at);
+        }
     }
-
-    close(sock);
-    return 0;
+    return n;
 }
 
-/*
+ssize_t sim_recvfrom(int fd, void *buf, size_t n, int flags,
+                struct sockaddr *from, socklen_t *fromlen) {
+    struct simsock *s = sim_fd(fd);
+    if (! s) { errno = EBADF; return -1; }
+    uint64_t deadline = s->timeout ? sim_now + s->timeout : UINT64_MAX;
+    while (1) {
+        if (s->qlen > 0 && s->q[0]->at <= sim_now) {
+            struct simpkt *pk = s->q[0];
+            struct simpkt *last = s->q[--s->qlen];
+            int i = 0;
+            while (1) {
+                int c = 2 * i + 1;
+                if (c >= s->qlen) { break; }
+                if (c + 1 < s->qlen && sim_pkt_before(s->q[c + 1], s->q[c])) { c++; }
+                if (! sim_pkt_before(s->q[c], last)) { break; }
+                s->q[i] = s->q[c];
+                i = c;
+            }
+            s->q[i] = last;
+
+            int len = pk->len < (int)n ? pk->len : (int)n;
+            memcpy(buf, pk->data, len);
+            if (from && fromlen) {
+                memcpy(from, &pk->src, *fromlen < sizeof(pk->src) ? *fromlen : sizeof(pk->src));
+                *fromlen = sizeof(pk->src);
+            }
+            pk->next = sim_free;
+            sim_free = pk;
+            sim_delivered++;
+            return len;
+        }
+        if (sim_now >= deadline) {
+            errno = EAGAIN;
+            return -1;
+        }
+        uint64_t at = s->qlen > 0 ? s->q[0]->at : UINT64_MAX;
+        s->waiter = sim_cur;
+        sim_block(at < deadline ? at : deadline);
+        s->waiter = -1;
+    }
+}
+
+int sim_close(int fd) {
+    struct simsock *s = sim_fd(fd);
+    if (! s) { return (close)(fd); }
+    s->task = -1;
+    return 0;
+}
+
+// Keep receive pipeline of running task for final report
+void sim_rx_register(struct rxstate *rx) {
+    if (sim_cur >= 0) { sim_task[sim_cur].rx = rx; }
+}
+
+// Redirect socket and clock calls of threads to simulated network
+#define socket(d, t, p)                 sim_socket(d, t, p)
+#define bind(s, a, l)                   sim_bind(s, a, l)
+#define setsockopt(s, l, o, v, n)       sim_setsockopt(s, l, o, v, n)
+#define sendto(s, b, n, f, a, l)        sim_sendto(s, b, n, f, a, l)
+#define recvfrom(s, b, n, f, a, l)      sim_recvfrom(s, b, n, f, a, l)
+#define close(s)                        sim_close(s)
+#define time(t)                         sim_time(t)
+#endif
+
+/*
+ * Latency histogram
+ *
+ * Log-linear buckets, 8 per power of two, keep percentiles within 12.5%
+ * from nanoseconds to hours in 4 KB, with one add per sample.
+ */
+
+#define HSUB 3
+#define HBUCKETS ((64 - HSUB + 1) << HSUB)
+
+struct hist {
+    uint64_t n;                        // samples
+    uint64_t sum;                      // sum of samples
+    uint64_t max;                      // largest sample
+    uint64_t b[HBUCKETS];              // samples per bucket
+};
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < (1 << HSUB)) { return (int)v; }
+    int e = 63 - __builtin_clzll(v);
+    return ((e - HSUB + 1) << HSUB) | (int)((v >> (e - HSUB)) & ((1 << HSUB) - 1));
+}
+
+static inline void hist_add(struct hist *h, uint64_t v) {
+    h->n++;
+    h->sum += v;
+    if (v > h->max) { h->max = v; }
+    h->b[hist_bucket(v)]++;
+}
+
+// Value at percentile, as middle of its bucket
+uint64_t hist_pct(const struct hist *h, double pct) {
+    uint64_t want = (uint64_t)(h->n * pct / 100.0), seen = 0;
+    int i;
+    for (i = 0; i < HBUCKETS; i++) {
+        seen += h->b[i];
+        if (seen > want) { break; }
+    }
+    if (i < (1 << HSUB)) { return i; }
+    if (i == HBUCKETS) { return h->max; }
+    int e = (i >> HSUB) + HSUB - 1;
+    uint64_t lo = (uint64_t)((1 << HSUB) | (i & ((1 << HSUB) - 1))) << (e - HSUB);
+    uint64_t v = lo + (1ULL << (e - HSUB)) / 2;
+    return v < h->max ? v : h->max;
+}
+
+// Add samples of another histogram
+void hist_merge(struct hist *h, const struct hist *o) {
+    int i;
+    h->n += o->n;
+    h->sum += o->sum;
+    if (o->max > h->max) { h->max = o->max; }
+    for (i = 0; i < HBUCKETS; i++) { h->b[i] += o->b[i]; }
+}
+
+// Print percentiles in microseconds
+void hist_print(const char *name, const struct hist *h) {
+    if (h->n == 0) { return; }
+    printf("  %s n %llu avg %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us\n",
+                name, (unsigned long long)h->n, h->sum / 1e3 / h->n,
+                hist_pct(h, 50) / 1e3, hist_pct(h, 90) / 1e3, hist_pct(h, 99) / 1e3,
+                hist_pct(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+
+/*
+ * Packet parsing
+ *
+ * Link, IP and UDP headers of captured or packet socket frames are read by
+ * offset, never thru casts, as they are not aligned in the buffer.
+ */
+
+static inline uint32_t rd32(const u_char *p, int swap) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t rd16be(const u_char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// Skip link layer header, returns offset of network header or -1
+int pcap_link(const u_char *pkt, uint32_t caplen, uint32_t linktype,
+                uint16_t *ethertype) {
+    uint32_t off;
+    uint16_t et = 0;
+    switch (linktype) {
+    case 1:                                         // Ethernet
+        if (caplen < 14) { return -1; }
+        off = 14;
+        et = rd16be(pkt + 12);
+        while ((et == 0x8100 || et == 0x88a8) && caplen >= off + 4) {
+            et = rd16be(pkt + off + 2);             // VLAN tag
+            off += 4;
+        }
+        break;
+    case 113:                                       // Linux cooked
+        if (caplen < 16) { return -1; }
+        off = 16;
+        et = rd16be(pkt + 14);
+        break;
+    case 276:                                       // Linux cooked v2
+        if (caplen < 20) { return -1; }
+        off = 20;
+        et = rd16be(pkt);
+        break;
+    case 0:                                         // BSD loopback
+        if (caplen < 4) { return -1; }
+        off = 4;
+        break;
+    case 12: case 14: case 101: case 228: case 229: // raw IP
+        off = 0;
+        break;
+    default:
+        return -1;
+    }
+    if (et == 0 && caplen > off) {                  // tell by IP version
+        et = (pkt[off] >> 4) == 4 ? 0x0800 : (pkt[off] >> 4) == 6 ? 0x86dd : 0;
+    }
+    *ethertype = et;
+    return off;
+}
+
+// Extract UDP datagram from IPv6 packet, returns payload length or -1
+int pcap_udp(const u_char *ip, uint32_t len, struct sockaddr_in6 *src,
+                struct in6_addr *dst, u_short *dport, const u_char **payload) {
+    if (len < 40 || (ip[0] >> 4) != 6) { return -1; }
+    if (40 + rd16be(ip + 4) < len) { len = 40 + rd16be(ip + 4); }  // trim padding
+
+    // Walk extension headers, fragment header is not supported
+    uint32_t off = 40;
+    u_char nh = ip[6];
+    while (nh != IPPROTO_UDP && nh != IPPROTO_UDPLITE) {
+        if (nh != IPPROTO_HOPOPTS && nh != IPPROTO_ROUTING && nh != IPPROTO_DSTOPTS) {
+            return -1;
+        }
+        if (len < off + 8) { return -1; }
+        nh = ip[off];
+        off += (ip[off + 1] + 1) * 8;
+    }
+    if (len < off + 8) { return -1; }
+
+    const u_char *udp = ip + off;
+    uint32_t ulen = rd16be(udp + 4);
+    if (nh == IPPROTO_UDPLITE) { ulen = len - off; }        // UDP-Lite has coverage
+    if (ulen < 8) { return -1; }
+    if (ulen > len - off) { ulen = len - off; }             // snapped
+
+    memset(src, 0, sizeof(*src));
+    src->sin6_family = AF_INET6;
+    memcpy(&src->sin6_addr, ip + 8, 16);
+    memcpy(&src->sin6_port, udp, 2);
+    memcpy(dst, ip + 24, 16);
+    memcpy(dport, udp + 2, 2);
+    *payload = udp + 8;
+    return ulen - 8;
+}
+
+/*
+ * I/O engines
+ *
+ * Sender and receiver move datagrams thru an engine chosen at runtime with
+ * --engine, as each host favours a different path:
+ *
+ *   plain      sendto() and recvfrom(), a datagram per syscall
+ *   mmsg       sendmmsg() and recvmmsg(), a batch per syscall
+ *   io_uring   sendmsg and recvmsg operations on io_uring, a batch per enter
+ *   sqpoll     io_uring polled by kernel thread, sends paced by the kernel
+ *   packet     AF_PACKET TPACKET_V3 ring shared with kernel, receive only
+ *
+ * Receive returns a batch of datagrams in rx[], valid until next call, or 0
+ * after timeout.  Batch is up to --batch datagrams, 1 for plain engine.
+ * Buffers hold BUFSIZE bytes, or --size up to MAXPAYLOAD when larger, so
+ * that jumbo frames and loopback carry large datagrams whole.  Send is
+ * queued by eng_xmit() and goes out when the batch is full or on
+ * eng_flush(), which sender calls before it sleeps.  Setup fails when host
+ * does not support the engine.
+ *
+ * Packet engine takes frames of all interfaces from the ring and picks UDP
+ * of the group by itself, while UDP socket keeps the membership with a
+ * filter dropping everything, so datagrams are not queued twice.  It needs
+ * CAP_NET_RAW.  Simulation build has plain engine only.
+ */
+
+#define ENGBATCH 64                    // datagrams per batch
+#define URING_ENTRIES 256              // io_uring submission queue entries
+#define SQSLOTS (URING_ENTRIES / 2)    // sqpoll sends in flight, timeout and send each
+#define SQPOLL_IDLE 100                // ms kernel thread polls before it sleeps
+#define SQPOLL_LEAD 10000000ULL        // ns sqpoll sender may run ahead at most
+#define SQTIMER (1ULL << 32)           // completion of pacing timeout
+#define PBLOCK (1 << 20)               // packet ring block size
+#define PBLOCKS 16                     // packet ring blocks
+#define PFRAME 2048                    // packet ring frame size
+
+// Received datagram
+struct rxmsg {
+    char *buf;                         // payload
+    int len;                           // payload length
+    struct sockaddr_in6 src;            // sender address and port
+    uint64_t ts;                       // arrival, monotonic ns
+    uint64_t wall;                     // arrival, realtime ns
+    uint64_t kts;                      // arrival, kernel stamp ns, 0 if none
+    int ttl;                           // hop limit, -1 if none
+};
+
+#ifndef SIMULATION
+// io_uring rings shared with kernel
+struct uring {
+    int fd;                            // ring descriptor, -1 if none
+    unsigned *sq_head;                 // submission queue
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *sq_flags;                // IORING_SQ_NEED_WAKEUP
+    unsigned *cq_head;                 // completion queue
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;                      // mappings
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqe_size;
+    unsigned features;                 // IORING_FEAT_*
+    unsigned flags;                    // IORING_SETUP_*
+    unsigned tosubmit;                 // queued, not yet submitted
+};
+
+// Datagram of sqpoll sender in flight
+struct sqslot {
+    struct msghdr hdr;
+    struct iovec iov;
+    struct __kernel_timespec due;      // pacing timeout
+    char *data;                        // bufsize bytes in sqbuf
+};
+#endif
+
+struct eng;
+
+struct engops {
+    const char *name;
+    int batch;                         // datagrams queued before send
+    int (*setup)(struct eng *e, int tx);
+    int (*recv)(struct eng *e);
+    int (*send)(struct eng *e);        // NULL if engine cannot send
+    int paced;                         // sends at due time of datagram itself
+};
+
+struct eng {
+    const struct engops *ops;          // engine
+    struct param *pp;                  // common parameters
+    int batch;                         // datagrams per batch
+    int sock;                          // UDP socket
+    int timeout;                       // receive timeout in ms, 0 forever
+    struct sockaddr_in6 dst;            // destination of sender
+    char *buf;                         // batch buffers, bufsize each
+    int bufsize;                       // BUFSIZE, or --size when larger
+    struct rxmsg rx[ENGBATCH];         // received batch
+    int txlen[ENGBATCH];               // lengths of queued datagrams
+    int ntx;                           // queued datagrams
+    uint64_t due;                      // due time of next datagram, 0 now
+    uint64_t txdue[ENGBATCH];          // due times of queued datagrams
+    uint64_t sqcpu;                    // CPU time of kernel polling thread
+    struct txts *txts;                 // transmit timestamps, NULL if off
+#ifndef SIMULATION
+    struct mmsghdr msg[ENGBATCH];      // message headers of batch
+    struct iovec iov[ENGBATCH];
+    struct sockaddr_in6 name[ENGBATCH];
+    struct uring ring;                 // io_uring
+    int resubmit[ENGBATCH];            // buffers to post receive again
+    int nresubmit;
+    int psock;                         // packet socket, -1 if none
+    u_char *pmap;                      // packet ring
+    int pblk;                          // current block
+    uint32_t pleft;                    // packets left in current block
+    u_char *ppkt;                      // next packet in current block
+    int prelease;                      // block to hand back to kernel
+    char ctl[ENGBATCH][CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(int))];  // stamp, hop limit
+    struct sqslot *slot;               // sqpoll sends
+    char *sqbuf;                       // payloads of sqpoll sends
+    int sfree[SQSLOTS];                // free slots
+    int nsfree;
+#endif
+};
+
+// Buffer i of batch
+static inline char *eng_buf(struct eng *e, int i) {
+    return e->buf + (size_t)i * e->bufsize;
+}
+
+// Kernel receive stamp in realtime ns and hop limit of message into m
+static inline void cmsg_read(struct msghdr *h, struct rxmsg *m) {
+    struct cmsghdr *c;
+    m->kts = 0;
+    m->ttl = -1;
+    for (c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            m->kts = (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+        } else if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_HOPLIMIT) {
+            memcpy(&m->ttl, CMSG_DATA(c), sizeof(m->ttl));
+        }
+    }
+}
+
+/*
+ * plain engine
+ */
+int plain_setup(struct eng *e, int tx) {
+    return 0;
+}
+
+int plain_recv(struct eng *e) {
+    struct rxmsg *m = &e->rx[0];
+    socklen_t len = sizeof(m->src);
+    ssize_t n;
+    m->kts = 0;
+    m->ttl = -1;
+#ifndef SIMULATION
+    if (e->pp->burst > 0 || e->pp->path) {          // with kernel stamp or hop limit
+        struct iovec iov = { eng_buf(e, 0), e->bufsize };
+        struct msghdr h;
+        memset(&h, 0, sizeof(h));
+        h.msg_name = &m->src;
+        h.msg_namelen = len;
+        h.msg_iov = &iov;
+        h.msg_iovlen = 1;
+        h.msg_control = e->ctl[0];
+        h.msg_controllen = sizeof(e->ctl[0]);
+        n = recvmsg(e->sock, &h, 0);
+        if (n >= 0) { cmsg_read(&h, m); }
+    } else
+#endif
+    n = recvfrom(e->sock, eng_buf(e, 0), e->bufsize, 0, (struct sockaddr*)&m->src, &len);
+    if (n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1; }
+    m->buf = eng_buf(e, 0);
+    m->len = n;
+    m->ts = now_ns();
+    m->wall = wall_ns();
+    return 1;
+}
+
+int plain_send(struct eng *e) {
+    int i;
+    for (i = 0; i < e->ntx; i++) {
+        if (sendto(e->sock, eng_buf(e, i), e->txlen[i], 0,
+                (struct sockaddr*)&e->dst, sizeof(e->dst)) < 0) { return -1; }
+    }
+    return 0;
+}
+
+#ifndef SIMULATION
+/*
+ * mmsg engine
+ */
+int mmsg_setup(struct eng *e, int tx) {
+    int i;
+    for (i = 0; i < ENGBATCH; i++) {
+        e->iov[i].iov_base = eng_buf(e, i);
+        e->iov[i].iov_len = e->bufsize;
+        memset(&e->msg[i], 0, sizeof(e->msg[i]));
+        e->msg[i].msg_hdr.msg_iov = &e->iov[i];
+        e->msg[i].msg_hdr.msg_iovlen = 1;
+        e->msg[i].msg_hdr.msg_name = tx ? (void *)&e->dst : (void *)&e->name[i];
+        e->msg[i].msg_hdr.msg_namelen = sizeof(e->dst);
+        if (! tx && (e->pp->burst > 0 || e->pp->path)) { e->msg[i].msg_hdr.msg_control = e->ctl[i]; }
+    }
+    return 0;
+}
+
+
+int mmsg_recv(struct eng *e) {
+    int i;
+    for (i = 0; i < ENGBATCH; i++) {
+        e->msg[i].msg_hdr.msg_namelen = sizeof(e->name[i]);
+        e->msg[i].msg_hdr.msg_controllen = e->msg[i].msg_hdr.msg_control ? sizeof(e->ctl[i]) : 0;
+    }
+    int n = recvmmsg(e->sock, e->msg, e->batch, MSG_WAITFORONE, NULL);
+    if (n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1; }
+    uint64_t ts = now_ns(), wall = wall_ns();
+    for (i = 0; i < n; i++) {
+        e->rx[i].buf = eng_buf(e, i);
+        e->rx[i].len = e->msg[i].msg_len;
+        e->rx[i].src = e->name[i];
+        e->rx[i].ts = ts;
+        e->rx[i].wall = wall;
+        cmsg_read(&e->msg[i].msg_hdr, &e->rx[i]);
+    }
+    return n;
+}
+
+int mmsg_send(struct eng *e) {
+    int i, done = 0;
+    for (i = 0; i < e->ntx; i++) {
+        e->iov[i].iov_len = e->txlen[i];
+    }
+    while (done < e->ntx) {
+        int n = sendmmsg(e->sock, e->msg + done, e->ntx - done, 0);
+        if (n < 0) { return -1; }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * io_uring engine, on raw syscalls without liburing
+ */
+int uring_init(struct uring *r, unsigned entries, struct io_uring_params *p) {
+    r->fd = syscall(__NR_io_uring_setup, entries, p);
+    if (r->fd < 0) { return -1; }
+
+    r->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    r->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) { r->sq_size = r->cq_size; }
+        r->cq_size = r->sq_size;
+    }
+    r->sqe_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = p->features & IORING_FEAT_SINGLE_MMAP ? r->sq_ptr :
+                mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqe_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    u_char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p->sq_off.array);
+    r->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+    r->cq_head = (unsigned *)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    r->features = p->features;
+    r->flags = p->flags;
+    r->tosubmit = 0;
+    return 0;
+}
+
+void uring_exit(struct uring *r) {
+    if (r->fd < 0) { return; }
+    munmap(r->sqes, r->sqe_size);
+    if (r->cq_ptr != r->sq_ptr) { munmap(r->cq_ptr, r->cq_size); }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+// Next free submission entry, NULL if queue is full
+static inline struct io_uring_sqe *uring_sqe(struct uring *r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > *r->sq_mask) { return NULL; }
+    struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish entry filled after uring_sqe()
+static inline void uring_push(struct uring *r) {
+    unsigned tail = *r->sq_tail;
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->tosubmit++;
+}
+
+// Submit queued entries and wait for completions, with timeout in ms
+int uring_enter(struct uring *r, unsigned wait, int timeout) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (__atomic_load_n(r->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+        flags |= IORING_ENTER_SQ_WAKEUP;            // polling thread sleeps
+    }
+    if (wait && timeout > 0 && (r->features & IORING_FEAT_EXT_ARG)) {
+        struct __kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000LL };
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        ret = syscall(__NR_io_uring_enter, r->fd, r->tosubmit, wait,
+                        flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->tosubmit, wait, flags, NULL, 0);
+    }
+    if (ret > 0) { r->tosubmit -= ret; }
+    return ret;
+}
+
+// Head of completion queue, NULL if empty
+static inline struct io_uring_cqe *uring_cqe(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) { return NULL; }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Post receive into buffer b
+static inline void uring_post(struct eng *e, int b) {
+    struct io_uring_sqe *sqe = uring_sqe(&e->ring);
+    e->iov[b].iov_len = e->bufsize;
+    e->msg[b].msg_hdr.msg_namelen = sizeof(e->name[b]);
+    e->msg[b].msg_hdr.msg_controllen = e->msg[b].msg_hdr.msg_control ? sizeof(e->ctl[b]) : 0;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = e->sock;
+    sqe->addr = (uint64_t)(uintptr_t)&e->msg[b].msg_hdr;
+    sqe->len = 1;
+    sqe->user_data = b;
+    uring_push(&e->ring);
+}
+
+int uring_setup(struct eng *e, int tx) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (uring_init(&e->ring, URING_ENTRIES, &p) < 0) { return -1; }
+    mmsg_setup(e, tx);
+    if (! tx) {
+        int b;
+        for (b = 0; b < e->batch; b++) { uring_post(e, b); }
+    }
+    return 0;
+}
+
+int uring_recv(struct eng *e) {
+    int i, n = 0;
+    for (i = 0; i < e->nresubmit; i++) { uring_post(e, e->resubmit[i]); }
+    e->nresubmit = 0;
+
+    if (! uring_cqe(&e->ring)) {
+        if (uring_enter(&e->ring, 1, e->timeout) < 0 && errno != ETIME && errno != EINTR) {
+            return -1;
+        }
+    } else if (e->ring.tosubmit > 0) {
+        uring_enter(&e->ring, 0, 0);
+    }
+
+    struct io_uring_cqe *cqe;
+    uint64_t ts = now_ns(), wall = wall_ns();
+    while (n < e->batch && (cqe = uring_cqe(&e->ring))) {
+        int b = cqe->user_data, res = cqe->res;
+        uring_seen(&e->ring);
+        e->resubmit[e->nresubmit++] = b;
+        if (res < 0) { continue; }
+        e->rx[n].buf = eng_buf(e, b);
+        e->rx[n].len = res;
+        e->rx[n].src = e->name[b];
+        e->rx[n].ts = ts;
+        e->rx[n].wall = wall;
+        cmsg_read(&e->msg[b].msg_hdr, &e->rx[n]);
+        n++;
+    }
+    return n;
+}
+
+int uring_send(struct eng *e) {
+    int i, err = 0;
+    for (i = 0; i < e->ntx; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(&e->ring);
+        e->iov[i].iov_len = e->txlen[i];
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = e->sock;
+        sqe->addr = (uint64_t)(uintptr_t)&e->msg[i].msg_hdr;
+        sqe->len = 1;
+        sqe->user_data = i;
+        uring_push(&e->ring);
+    }
+
+    // Wait all completions, as buffers are reused by next batch
+    int done = 0;
+    while (done < e->ntx) {
+        struct io_uring_cqe *cqe = uring_cqe(&e->ring);
+        if (! cqe) {
+            if (uring_enter(&e->ring, e->ntx - done, 0) < 0 && errno != EINTR) { return -1; }
+            continue;
+        }
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            err = 1;
+        }
+        uring_seen(&e->ring);
+        done++;
+    }
+    return err ? -1 : 0;
+}
+
+/*
+ * sqpoll engine, io_uring with a kernel thread polling submission queue
+ *
+ * Sender writes sendmsg operations into the ring and a kernel thread picks
+ * them up, so sending takes no syscall, only a wakeup when the thread went
+ * to sleep after SQPOLL_IDLE ms without work.  Each datagram is linked
+ * behind a timeout at its absolute due time, so the kernel paces them and
+ * sender runs ahead by up to a batch, sleeping once per batch instead of
+ * once per datagram.  Datagrams are copied into slots kept until their send
+ * completes.  Receive is as io_uring engine, on the polled ring.
+ */
+int sqpoll_setup(struct eng *e, int tx) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = SQPOLL_IDLE;
+    if (uring_init(&e->ring, URING_ENTRIES, &p) < 0) { return -1; }
+    if (! (p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        errno = EOPNOTSUPP;                         // needs registered files
+        return -1;
+    }
+    mmsg_setup(e, tx);
+    if (! tx) {
+        int b;
+        for (b = 0; b < e->batch; b++) { uring_post(e, b); }
+        return 0;
+    }
+    if (! (p.features & IORING_FEAT_CQE_SKIP)) {
+        errno = EOPNOTSUPP;                         // paced send needs 5.17
+        return -1;
+    }
+
+    e->slot = calloc(SQSLOTS, sizeof(*e->slot));
+    e->sqbuf = malloc((size_t)SQSLOTS * e->bufsize);
+    if (! e->slot || ! e->sqbuf) { return -1; }
+    for (e->nsfree = 0; e->nsfree < SQSLOTS; e->nsfree++) {
+        struct sqslot *q = &e->slot[e->nsfree];
+        q->data = e->sqbuf + (size_t)e->nsfree * e->bufsize;
+        q->iov.iov_base = q->data;
+        q->hdr.msg_iov = &q->iov;
+        q->hdr.msg_iovlen = 1;
+        q->hdr.msg_name = &e->dst;
+        q->hdr.msg_namelen = sizeof(e->dst);
+        e->sfree[e->nsfree] = e->nsfree;
+    }
+    return 0;
+}
+
+// Take send completions, freeing their slots
+static inline int sqpoll_reap(struct eng *e) {
+    struct io_uring_cqe *cqe;
+    int err = 0;
+    while ((cqe = uring_cqe(&e->ring))) {
+        uint64_t s = cqe->user_data;
+        int res = cqe->res;
+        uring_seen(&e->ring);
+        if (s & SQTIMER) { continue; }              // failed timeout, send canceled
+        if (res < 0) {
+            errno = -res;
+            err = 1;
+        }
+        e->sfree[e->nsfree++] = (int)s;
+    }
+    return err ? -1 : 0;
+}
+
+int sqpoll_send(struct eng *e) {
+    int i, err = sqpoll_reap(e) < 0;
+    for (i = 0; i < e->ntx; i++) {
+        while (e->nsfree == 0) {                    // all in flight
+            if (uring_enter(&e->ring, 1, 0) < 0 && errno != EINTR) { return -1; }
+            if (sqpoll_reap(e) < 0) { err = 1; }
+        }
+        int s = e->sfree[--e->nsfree];
+        struct sqslot *q = &e->slot[s];
+        struct io_uring_sqe *sqe;
+        memcpy(q->data, eng_buf(e, i), e->txlen[i]);
+        q->iov.iov_len = e->txlen[i];
+        if (e->txdue[i]) {
+            q->due.tv_sec = e->txdue[i] / NSEC;
+            q->due.tv_nsec = e->txdue[i] % NSEC;
+            sqe = uring_sqe(&e->ring);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t)(uintptr_t)&q->due;
+            sqe->len = 1;
+            sqe->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+            sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+            sqe->user_data = SQTIMER | s;
+            uring_push(&e->ring);
+        }
+        sqe = uring_sqe(&e->ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = e->sock;
+        sqe->addr = (uint64_t)(uintptr_t)&q->hdr;
+        sqe->len = 1;
+        sqe->user_data = s;
+        uring_push(&e->ring);
+    }
+    e->ring.tosubmit = 0;                           // kernel thread submits
+
+    // Wake kernel thread if it went to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(e->ring.sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP) {
+        syscall(__NR_io_uring_enter, e->ring.fd, 0, 0, IORING_ENTER_SQ_WAKEUP, NULL, 0);
+    }
+    return err ? -1 : 0;
+}
+
+// Let sends in flight go out before ring goes away
+void sqpoll_drain(struct eng *e) {
+    while (e->nsfree < SQSLOTS) {
+        if (uring_enter(&e->ring, 1, 0) < 0 && errno != EINTR) { break; }
+        sqpoll_reap(e);
+    }
+}
+
+// Kernel thread polling submission queue, -1 if unknown
+int uring_sqthread(struct uring *r) {
+    char path[64], line[128];
+    int tid = -1;
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", r->fd);
+    FILE *fp = fopen(path, "r");
+    if (! fp) { return -1; }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "SqThread: %d", &tid) == 1) { break; }
+    }
+    fclose(fp);
+    return tid;
+}
+
+/*
+ * packet engine
+ */
+int packet_setup(struct eng *e, int tx) {
+    if (tx) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    int fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IPV6));
+    if (fd < 0) { return -1; }
+
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = PBLOCK;
+    req.tp_block_nr = PBLOCKS;
+    req.tp_frame_size = PFRAME;
+    req.tp_frame_nr = PBLOCK / PFRAME * PBLOCKS;
+    req.tp_retire_blk_tov = 1;         // ms to hand partial block to user
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IPV6);
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+            setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        close(fd);
+        return -1;
+    }
+    e->pmap = mmap(NULL, PBLOCK * PBLOCKS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (e->pmap == MAP_FAILED) {
+        e->pmap = NULL;
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&ll, sizeof(ll)) < 0) {
+        munmap(e->pmap, PBLOCK * PBLOCKS);
+        e->pmap = NULL;
+        close(fd);
+        return -1;
+    }
+
+    // Keep membership on UDP socket, but drop its copy of datagrams
+    struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog prog = { 1, &drop };
+    if (setsockopt(e->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        munmap(e->pmap, PBLOCK * PBLOCKS);
+        e->pmap = NULL;
+        close(fd);
+        return -1;
+    }
+    e->psock = fd;
+    return 0;
+}
+
+static inline void packet_release(struct eng *e) {
+    struct tpacket_block_desc *bd = (void *)(e->pmap + (size_t)e->pblk * PBLOCK);
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    e->pblk = (e->pblk + 1) % PBLOCKS;
+    e->prelease = 0;
+}
+
+int packet_recv(struct eng *e) {
+    struct param *pp = e->pp;
+    int n = 0, waited = 0;
+    if (e->prelease) { packet_release(e); }     // consumed by previous batch
+
+    while (n == 0) {
+        if (e->pleft == 0) {
+            struct tpacket_block_desc *bd = (void *)(e->pmap + (size_t)e->pblk * PBLOCK);
+            if (! (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+                if (waited) { return 0; }
+                struct pollfd pfd = { e->psock, POLLIN | POLLERR, 0 };
+                if (poll(&pfd, 1, e->timeout > 0 ? e->timeout : -1) < 0 && errno != EINTR) {
+                    return -1;
+                }
+                waited = 1;
+                continue;
+            }
+            e->pleft = bd->hdr.bh1.num_pkts;
+            e->ppkt = (u_char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+            if (e->pleft == 0) {
+                packet_release(e);
+                continue;
+            }
+        }
+
+        uint64_t ts = now_ns();
+        while (e->pleft > 0 && n < e->batch) {
+            struct tpacket3_hdr *h = (void *)e->ppkt;
+            struct sockaddr_ll *ll = (void *)(e->ppkt + TPACKET_ALIGN(sizeof(*h)));
+            struct in6_addr dst;
+            u_short dport;
+            const u_char *payload;
+            int len = ll->sll_pkttype == PACKET_OUTGOING ? -1 :
+                        pcap_udp(e->ppkt + h->tp_net, h->tp_snaplen, &e->rx[n].src,
+                                &dst, &dport, &payload);
+            if (len >= 0 && IN6_ARE_ADDR_EQUAL(&dst, &pp->mip) && dport == pp->port &&
+                    (! pp->ssm || IN6_ARE_ADDR_EQUAL(&e->rx[n].src.sin6_addr, &pp->sip))) {
+                e->rx[n].buf = (char *)payload;
+                e->rx[n].len = len;
+                e->rx[n].ts = ts;
+                e->rx[n].wall = (uint64_t)h->tp_sec * NSEC + h->tp_nsec;
+                e->rx[n].kts = e->rx[n].wall;
+                e->rx[n].ttl = (e->ppkt + h->tp_net)[7];
+                n++;
+            }
+            e->ppkt += h->tp_next_offset;
+            e->pleft--;
+        }
+        if (e->pleft == 0) {
+            if (n == 0) { packet_release(e); } else { e->prelease = 1; }
+        }
+    }
+    return n;
+}
+#endif
+
+const struct engops engines[] = {
+    { "plain",    1,        plain_setup,  plain_recv,  plain_send },
+#ifndef SIMULATION
+    { "mmsg",     ENGBATCH, mmsg_setup,   mmsg_recv,   mmsg_send },
+    { "io_uring", ENGBATCH, uring_setup,  uring_recv,  uring_send },
+    { "sqpoll",   ENGBATCH, sqpoll_setup, uring_recv,  sqpoll_send, 1 },
+    { "packet",   ENGBATCH, packet_setup, packet_recv, NULL },
+#endif
+};
+#define NENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+/*
+ * Transmit timestamps
+ *
+ * With --txstamp, sender socket asks kernel for SO_TIMESTAMPING stamps of
+ * every datagram when it enters the qdisc (SCHED), when the driver takes it
+ * (SND, software) and, where the NIC is set up for it, when it leaves on
+ * the wire (hardware).  Stamps come back on the socket error queue keyed by
+ * OPT_ID, the datagram count of socket, and are matched to the time the
+ * sender handed each datagram to the kernel, so that sender delay splits
+ * into app to qdisc, qdisc to driver and driver to wire.  Error queue is
+ * drained in batches without blocking while sender waits.  Hardware clock
+ * is only comparable when synced to system clock.  Simulation build has no
+ * timestamps.
+ */
+
+#define TXTS_RING 4096                 // datagrams awaiting stamps
+#define TXTS_BATCH 32                  // error queue messages per read
+#define TXTS_LINGER 10000000ULL        // ns to wait for stamps of last datagrams
+
+struct txts {
+    uint32_t id;                       // OPT_ID of next datagram
+    uint32_t key[TXTS_RING];           // OPT_ID of slot
+    uint64_t app[TXTS_RING];           // handed to kernel, realtime ns
+    uint64_t sched[TXTS_RING];         // qdisc stamp, 0 if none yet
+    uint64_t snd[TXTS_RING];           // driver stamp, 0 if none yet
+    uint64_t stamps;                   // stamps read
+    uint64_t unmatched;                // stamps of datagrams out of ring
+    struct hist qdisc;                 // app to qdisc
+    struct hist driver;                // qdisc to driver
+    struct hist wire;                  // driver to wire
+};
+
+// Datagram handed to kernel at realtime wall
+static inline void txts_sent(struct txts *t, uint64_t wall) {
+    int i = t->id % TXTS_RING;
+    t->key[i] = t->id++;
+    t->app[i] = wall;
+    t->sched[i] = t->snd[i] = 0;
+}
+
+#ifndef SIMULATION
+int txts_open(struct txts *t, int sock) {
+    memset(t, 0, sizeof(*t));
+    int flags = SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE |
+                SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                SOF_TIMESTAMPING_OPT_TSONLY;
+    int hw = flags | SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &hw, sizeof(hw)) < 0 &&
+            setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Read stamps queued on error queue, returns number read
+int txts_poll(struct txts *t, int sock) {
+    struct mmsghdr msg[TXTS_BATCH];
+    char ctrl[TXTS_BATCH][256];
+    int i, n, total = 0;
+    do {
+        memset(msg, 0, sizeof(msg));
+        for (i = 0; i < TXTS_BATCH; i++) {
+            msg[i].msg_hdr.msg_control = ctrl[i];
+            msg[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+        n = recvmmsg(sock, msg, TXTS_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        for (i = 0; i < n; i++) {
+            struct scm_timestamping *ts = NULL;
+            struct sock_extended_err *ee = NULL;
+            struct cmsghdr *c;
+            for (c = CMSG_FIRSTHDR(&msg[i].msg_hdr); c; c = CMSG_NXTHDR(&msg[i].msg_hdr, c)) {
+                if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+                    ts = (struct scm_timestamping *)CMSG_DATA(c);
+                } else if (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR) {
+                    ee = (struct sock_extended_err *)CMSG_DATA(c);
+                }
+            }
+            if (! ts || ! ee || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) { continue; }
+            t->stamps++;
+            int k = ee->ee_data % TXTS_RING;
+            if (t->key[k] != ee->ee_data || t->id - ee->ee_data > TXTS_RING) {
+                t->unmatched++;
+                continue;
+            }
+            uint64_t sw = (uint64_t)ts->ts[0].tv_sec * NSEC + ts->ts[0].tv_nsec;
+            uint64_t hw = (uint64_t)ts->ts[2].tv_sec * NSEC + ts->ts[2].tv_nsec;
+            if (hw) {
+                if (t->snd[k] && hw >= t->snd[k]) { hist_add(&t->wire, hw - t->snd[k]); }
+            } else if (ee->ee_info == SCM_TSTAMP_SCHED) {
+                t->sched[k] = sw;
+                if (sw >= t->app[k]) { hist_add(&t->qdisc, sw - t->app[k]); }
+            } else if (ee->ee_info == SCM_TSTAMP_SND) {
+                t->snd[k] = sw;
+                if (t->sched[k] && sw >= t->sched[k]) { hist_add(&t->driver, sw - t->sched[k]); }
+            }
+        }
+        total += n > 0 ? n : 0;
+    } while (n == TXTS_BATCH);
+    return total;
+}
+#else
+int txts_open(struct txts *t, int sock) {
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int txts_poll(struct txts *t, int sock) {
+    return 0;
+}
+#endif
+
+void txts_report(struct txts *t) {
+    printf("Tx timestamps: %u sent %llu stamps %llu unmatched\n", t->id,
+                (unsigned long long)t->stamps, (unsigned long long)t->unmatched);
+    hist_print("app to qdisc", &t->qdisc);
+    hist_print("qdisc to driver", &t->driver);
+    hist_print("driver to wire", &t->wire);
+    fflush(stdout);
+}
+
+// Engine by name, NULL if unknown
+const struct engops *eng_find(const char *name) {
+    int i;
+    for (i = 0; i < NENGINES; i++) {
+        if (strcmp(engines[i].name, name) == 0) { return &engines[i]; }
+    }
+    return NULL;
+}
+
+/*
+ * Open engine on socket, to send to dst or to receive if dst is NULL
+ */
+int eng_open(struct eng *e, const struct engops *ops, struct param *pp,
+                int sock, const struct sockaddr_in6 *dst, int timeout) {
+    memset(e, 0, sizeof(*e));
+    e->ops = ops;
+    e->pp = pp;
+    e->batch = ops->batch > 1 && pp->batch > 0 && pp->batch < ops->batch ? pp->batch : ops->batch;
+    e->sock = sock;
+    e->timeout = timeout;
+    if (dst) { e->dst = *dst; }
+#ifndef SIMULATION
+    e->ring.fd = -1;
+    e->psock = -1;
+#endif
+    e->bufsize = pp->size > BUFSIZE ? pp->size : BUFSIZE;
+    e->buf = malloc((size_t)ENGBATCH * e->bufsize);
+    if (! e->buf) { return -1; }
+
+    // Receive timeout of socket based engines
+    if (! dst && timeout > 0) {
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) { return -1; }
+    }
+
+    // Socket buffer beyond system limit when permitted, and busy poll spin
+    if (pp->sockbuf > 0) {
+        int opt = dst ? SO_SNDBUFFORCE : SO_RCVBUFFORCE;
+        if (setsockopt(sock, SOL_SOCKET, opt, &pp->sockbuf, sizeof(pp->sockbuf)) < 0 &&
+                setsockopt(sock, SOL_SOCKET, dst ? SO_SNDBUF : SO_RCVBUF,
+                        &pp->sockbuf, sizeof(pp->sockbuf)) < 0) { return -1; }
+    }
+    if (! dst && pp->busypoll > 0) {
+        if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                        &pp->busypoll, sizeof(pp->busypoll)) < 0) { return -1; }
+    }
+    if (dst && ! ops->send) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return ops->setup(e, dst != NULL);
+}
+
+// Socket datagrams arrive on, for socket filters
+int eng_rxsock(const struct eng *e) {
+#ifndef SIMULATION
+    if (e->psock >= 0) { return e->psock; }
+#endif
+    return e->sock;
+}
+
+void eng_close(struct eng *e) {
+#ifndef SIMULATION
+    if (e->slot) { sqpoll_drain(e); }
+    if (e->ring.fd >= 0 && (e->ring.flags & IORING_SETUP_SQPOLL)) {
+        e->sqcpu = tid_cpu_ns(uring_sqthread(&e->ring));
+    }
+    uring_exit(&e->ring);
+    free(e->slot);
+    e->slot = NULL;
+    free(e->sqbuf);
+    e->sqbuf = NULL;
+    if (e->pmap) { munmap(e->pmap, PBLOCK * PBLOCKS); }
+    if (e->psock >= 0) { close(e->psock); }
+#endif
+    free(e->buf);
+    e->buf = NULL;
+}
+
+// Send queued datagrams
+static inline void eng_flush(struct eng *e) {
+    if (e->ntx == 0) { return; }
+    if (e->txts) {                                  // handed to kernel now or when due
+        uint64_t wall = wall_ns(), now = now_ns();
+        int i;
+        for (i = 0; i < e->ntx; i++) {
+            txts_sent(e->txts, e->txdue[i] > now ? wall + e->txdue[i] - now : wall);
+        }
+    }
+    if (e->ops->send(e) < 0) {
+        perror("Send failed");
+        exit(EXIT_FAILURE);
+    }
+    e->ntx = 0;
+}
+
+// Queue datagram, sent when batch is full
+static inline void eng_xmit(struct eng *e, const char *data, int len) {
+    memcpy(eng_buf(e, e->ntx), data, len);
+    e->txdue[e->ntx] = e->due;
+    e->txlen[e->ntx++] = len;
+    if (e->ntx >= e->batch) { eng_flush(e); }
+}
+
+/*
+ * Impairment emulation
+ *
+ * Every packet of sender goes thru the stages below in this order:
+ *
+ *   loss (random and Gilbert-Elliott) -> duplication -> corruption
+ *        -> reorder hold -> delay queue -> engine
+ *
+ * Reordered packet is held until depth later packets passed, then it goes
+ * into delay queue.  Held and delayed packets occupy slots preallocated at
+ * start, so nothing is allocated nor copied twice on the way.  Delay queue
+ * is a min-heap by due time, and falls back to send at once when all slots
+ * are in use (counted as overflow).  Slots hold BUFSIZE bytes, so --size
+ * above it is refused together with impairment.
+ */
+
+// Impairment result flags
+#define IMP_LOST    0x01
+#define IMP_DUP     0x02
+#define IMP_CORRUPT 0x04
+#define IMP_REORDER 0x08
+#define IMP_DELAY   0x10
+
+struct dqslot {
+    uint64_t due;                      // release time in monotonic ns
+    uint64_t ord;                      // arrival order, FIFO on same due time
+    int len;                           // packet length
+    char data[BUFSIZE];                // packet payload
+};
+
+struct impstate {
+    struct impair *cfg;                // impairment configuration
+    uint64_t rng;                      // random generator state
+    int bad;                           // Gilbert-Elliott in bad state
+    struct dqslot *slot;               // preallocated packet slots
+    int *freel;                        // free slot stack
+    int nfree;
+    int *heap;                         // delay queue, min-heap of slots
+    int nheap;
+    int *hold;                         // reorder hold ring of slots
+    uint64_t *release;                 // pass count to release held slot
+    int hhead;
+    int hlen;
+    uint64_t ord;                      // slot arrival counter
+    uint64_t passed;                   // packets passed reorder stage
+    uint64_t sent, lost, dups, corrupted, reordered, delayed, overflow;
+};
+
+void imp_init(struct impstate *st, struct impair *cfg) {
+    memset(st, 0, sizeof(*st));
+    st->cfg = cfg;
+    rng_seed(&st->rng, cfg->seed);
+    if (! cfg->enabled) { return; }
+
+    st->slot = calloc(DQSIZE, sizeof(*st->slot));
+    st->freel = calloc(DQSIZE, sizeof(*st->freel));
+    st->heap = calloc(DQSIZE, sizeof(*st->heap));
+    st->hold = calloc(DQSIZE, sizeof(*st->hold));
+    st->release = calloc(DQSIZE, sizeof(*st->release));
+    if (! st->slot || ! st->freel || ! st->heap || ! st->hold || ! st->release) {
+        perror("Delay queue allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (st->nfree = 0; st->nfree < DQSIZE; st->nfree++) {
+        st->freel[st->nfree] = DQSIZE - 1 - st->nfree;
+    }
+}
+
+// Probabilities within 0 to 100 percent, and a way back from bad state
+int imp_valid(const struct impair *cfg) {
+    const double pct[] = { cfg->loss, cfg->ge_p, cfg->ge_r, cfg->ge_lg, cfg->ge_lb,
+                           cfg->dup, cfg->reorder, cfg->corrupt };
+    int i;
+    for (i = 0; i < (int)(sizeof(pct) / sizeof(pct[0])); i++) {
+        if (pct[i] < 0 || pct[i] > 100) { return 0; }
+    }
+    return (cfg->ge_p == 0 || cfg->ge_r > 0) && cfg->depth >= 1 &&
+           cfg->delay >= 0 && cfg->jitter >= 0;
+}
+
+void imp_exit(struct impstate *st) {
+    free(st->slot);
+    free(st->freel);
+    free(st->heap);
+    free(st->hold);
+    free(st->release);
+}
+
+// Put packet on the wire
+static inline void imp_wire(struct impstate *st, struct eng *e,
+                        const char *data, int len) {
+    eng_xmit(e, data, len);
+    st->sent++;
+}
+
+static inline int dq_before(struct impstate *st, int a, int b) {
+    struct dqslot *x = &st->slot[a], *y = &st->slot[b];
+    return x->due < y->due || (x->due == y->due && x->ord < y->ord);
+}
+
+void dq_push(struct impstate *st, int s) {
+    int i = st->nheap++;
+    while (i > 0) {
+        int up = (i - 1) / 2;
+        if (! dq_before(st, s, st->heap[up])) { break; }
+        st->heap[i] = st->heap[up];
+        i = up;
+    }
+    st->heap[i] = s;
+}
+
+int dq_pop(struct impstate *st) {
+    int top = st->heap[0];
+    int s = st->heap[--st->nheap];
+    int i = 0;
+    while (1) {
+        int c = 2 * i + 1;
+        if (c >= st->nheap) { break; }
+        if (c + 1 < st->nheap && dq_before(st, st->heap[c + 1], st->heap[c])) { c++; }
+        if (! dq_before(st, st->heap[c], s)) { break; }
+        st->heap[i] = st->heap[c];
+        i = c;
+    }
+    st->heap[i] = s;
+    return top;
+}
+
+// Queue packet (already in slot s, or copied if s < 0) with delay and jitter
+void imp_delay(struct impstate *st, struct eng *e, int s, const char *data, int len, uint64_t now) {
+    double ms = st->cfg->delay;
+    if (st->cfg->jitter > 0) {
+        ms += st->cfg->jitter * (2.0 * rng_unit(&st->rng) - 1.0);
+    }
+    if (ms <= 0 || (s < 0 && st->nfree == 0)) {
+        if (ms > 0) { st->overflow++; }
+        if (s >= 0) {
+            imp_wire(st, e, st->slot[s].data, st->slot[s].len);
+            st->freel[st->nfree++] = s;
+        } else {
+            imp_wire(st, e, data, len);
+        }
+        return;
+    }
+    if (s < 0) {
+        s = st->freel[--st->nfree];
+        memcpy(st->slot[s].data, data, len);
+        st->slot[s].len = len;
+    }
+    st->slot[s].due = now + (uint64_t)(ms * 1000000.0);
+    st->slot[s].ord = st->ord++;
+    dq_push(st, s);
+    st->delayed++;
+}
+
+/*
+ * Pass a packet thru impairments, returns IMP_* flags of what happened
+ */
+int imp_send(struct impstate *st, struct eng *e, const char *data, int len, uint64_t now) {
+    struct impair *cfg = st->cfg;
+    if (! cfg->enabled) {
+        imp_wire(st, e, data, len);
+        return 0;
+    }
+
+    // Random loss, and Gilbert-Elliott loss by state then state transition
+    int flags = 0;
+    int lost = rng_chance(&st->rng, cfg->loss);
+    if (cfg->ge_p > 0) {
+        lost |= rng_chance(&st->rng, st->bad ? cfg->ge_lb : cfg->ge_lg);
+        if (rng_chance(&st->rng, st->bad ? cfg->ge_r : cfg->ge_p)) {
+            st->bad = ! st->bad;
+        }
+    }
+    if (lost) {
+        st->lost++;
+#ifdef SIMULATION
+        sim_impaired++;
+#endif
+        return IMP_LOST;
+    }
+
+    int copies = 1;
+    if (rng_chance(&st->rng, cfg->dup)) {
+        copies = 2;
+        st->dups++;
+        flags |= IMP_DUP;
+    }
+
+    while (copies-- > 0) {
+        char tmp[BUFSIZE];
+        const char *p = data;
+        if (len > 0 && rng_chance(&st->rng, cfg->corrupt)) {
+            uint64_t bit = rng_next(&st->rng) % ((uint64_t)len * 8);
+            memcpy(tmp, data, len);
+            tmp[bit / 8] ^= 1 << (bit % 8);
+            p = tmp;
+            st->corrupted++;
+            flags |= IMP_CORRUPT;
+        }
+
+        // Hold back behind depth later packets
+        if (st->nfree > 0 && rng_chance(&st->rng, cfg->reorder)) {
+            int s = st->freel[--st->nfree];
+            memcpy(st->slot[s].data, p, len);
+            st->slot[s].len = len;
+            int tail = (st->hhead + st->hlen++) % DQSIZE;
+            st->hold[tail] = s;
+            st->release[tail] = st->passed + cfg->depth;
+            st->reordered++;
+            flags |= IMP_REORDER;
+            continue;
+        }
+
+        if (cfg->delay > 0 || cfg->jitter > 0) { flags |= IMP_DELAY; }
+        imp_delay(st, e, -1, p, len, now);
+        st->passed++;
+
+        // Release held packets which have been overtaken enough
+        while (st->hlen > 0 && st->release[st->hhead] <= st->passed) {
+            int s = st->hold[st->hhead];
+            st->hhead = (st->hhead + 1) % DQSIZE;
+            st->hlen--;
+            imp_delay(st, e, s, NULL, 0, now);
+        }
+    }
+    return flags;
+}
+
+/*
+ * Send delayed packets fallen due, returns due time of next one
+ */
+uint64_t imp_flush(struct impstate *st, struct eng *e, uint64_t now) {
+    while (st->nheap > 0 && st->slot[st->heap[0]].due <= now) {
+        int s = dq_pop(st);
+        imp_wire(st, e, st->slot[s].data, st->slot[s].len);
+        st->freel[st->nfree++] = s;
+    }
+    return st->nheap > 0 ? st->slot[st->heap[0]].due : UINT64_MAX;
+}
+
+/*
+ * Release held packets at end of sending, returns due time of next one
+ */
+uint64_t imp_drain(struct impstate *st, struct eng *e, uint64_t now) {
+    while (st->hlen > 0) {
+        int s = st->hold[st->hhead];
+        st->hhead = (st->hhead + 1) % DQSIZE;
+        st->hlen--;
+        imp_delay(st, e, s, NULL, 0, now);
+    }
+    return imp_flush(st, e, now);
+}
+
+/*
+ * Format impairment flags for message log
+ */
+void imp_tag(int flags, char *tag, size_t size) {
+    snprintf(tag, size, "%s%s%s%s%s",
+                flags & IMP_LOST ? " lost" : "",
+                flags & IMP_DUP ? " dup" : "",
+                flags & IMP_CORRUPT ? " corrupt" : "",
+                flags & IMP_REORDER ? " reorder" : "",
+                flags & IMP_DELAY ? " delay" : "");
+}
+
+/*
+ * Sink fan-out
+ *
+ * Besides stats, a received datagram can go to more outputs at once:
+ * --record writes it to a pcap file and --forward sends it to a TCP
+ * gateway.  Datagram is copied out of the engine once into a reference
+ * counted buffer from a preallocated pool, and the same buffer is queued to
+ * each sink by reference.  Every sink runs in its own thread, and the
+ * buffer goes back to pool when the last sink released it.  A live sink
+ * with full queue drops its reference so that receiver never waits, while
+ * offline input waits for it, and backlog counters show slow sinks.  Pool
+ * buffers hold --size bytes but at least BUFSIZE, as engine buffers do, and
+ * a longer datagram from packet engine or --pcap replay is cut to that and
+ * counted.  Simulation build has no sinks.
+ */
+
+#define POOLSIZE 8192                  // packet buffers
+#define SINKQ 4096                     // buffers queued per sink
+#define MAXSINKS 4                     // sinks besides stats
+
+// Reference counted packet buffer
+struct pbuf {
+    struct pbuf *next;                 // free list
+    int refs;                          // sinks still holding buffer
+    struct rxmsg m;                    // datagram, m.buf points to data
+    char *data;                        // bufsize bytes in pool data
+};
+
+// Buffer pool shared by receiver and sink threads
+struct pool {
+    struct pbuf *bufs;                 // preallocated buffers
+    struct pbuf *free;                 // free list
+    char *data;                        // data of all buffers
+    int bufsize;                       // bytes per buffer
+    int nfree;
+    pthread_mutex_t lock;
+    uint64_t empty;                    // datagrams not fanned out, no buffer
+    uint64_t truncated;                // datagrams cut to bufsize
+};
+
+struct sink {
+    const char *name;                  // sink name in report
+    void (*write)(struct sink *k, const struct rxmsg *m);
+    struct param *pp;                  // common parameters
+    struct pool *pool;                 // where buffers go back
+    FILE *fp;                          // recorder output
+    int fd;                            // gateway connection, -1 if none
+    struct pbuf *q[SINKQ];             // queued buffers
+    uint64_t head;                     // next to take, by sink thread
+    uint64_t tail;                     // next to put, by receiver
+    uint64_t dropped;                  // queue full, by receiver
+    uint64_t maxbacklog;               // deepest queue, by receiver
+    uint64_t failed;                   // write errors, by sink thread
+    int waiting;                       // sink thread sleeps on cond
+    int stop;                          // no more buffers, finish queue
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+struct fanout {
+    struct pool pool;                  // buffers
+    struct sink *sink[MAXSINKS];       // registered sinks
+    int nsinks;
+    int wait;                          // wait for sinks instead of dropping
+};
+
+void pool_init(struct pool *pl, int bufsize) {
+    pl->bufs = calloc(POOLSIZE, sizeof(*pl->bufs));
+    pl->data = malloc((size_t)POOLSIZE * bufsize);
+    pl->bufsize = bufsize;
+    if (! pl->bufs || ! pl->data) {
+        perror("Buffer pool allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (pl->nfree = 0; pl->nfree < POOLSIZE; pl->nfree++) {
+        pl->bufs[pl->nfree].data = pl->data + (size_t)pl->nfree * bufsize;
+        pl->bufs[pl->nfree].next = pl->free;
+        pl->free = &pl->bufs[pl->nfree];
+    }
+    pthread_mutex_init(&pl->lock, NULL);
+}
+
+static inline struct pbuf *pbuf_get(struct pool *pl) {
+    pthread_mutex_lock(&pl->lock);
+    struct pbuf *b = pl->free;
+    if (b) {
+        pl->free = b->next;
+        pl->nfree--;
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return b;
+}
+
+// Copy datagram into buffer, returns 1 if cut to pool buffer size
+static inline int pbuf_fill(struct pool *pl, struct pbuf *b, const struct rxmsg *m) {
+    b->m = *m;
+    b->m.buf = b->data;
+    if (b->m.len > pl->bufsize) { b->m.len = pl->bufsize; }
+    memcpy(b->data, m->buf, b->m.len);
+    return b->m.len < m->len;
+}
+
+// Release reference, buffer goes back to pool with the last one
+static inline void pbuf_put(struct pool *pl, struct pbuf *b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    pthread_mutex_lock(&pl->lock);
+    b->next = pl->free;
+    pl->free = b;
+    pl->nfree++;
+    pthread_mutex_unlock(&pl->lock);
+}
+
+#ifndef SIMULATION
+void *sink_thread(void *args) {
+    struct sink *k = args;
+    while (1) {
+        uint64_t h = k->head;
+        if (h == __atomic_load_n(&k->tail, __ATOMIC_SEQ_CST)) {
+            if (k->fp) { fflush(k->fp); }           // on disk while idle
+            pthread_mutex_lock(&k->lock);
+            __atomic_store_n(&k->waiting, 1, __ATOMIC_SEQ_CST);
+            while (h == __atomic_load_n(&k->tail, __ATOMIC_SEQ_CST) && ! k->stop) {
+                pthread_cond_wait(&k->cond, &k->lock);
+            }
+            __atomic_store_n(&k->waiting, 0, __ATOMIC_SEQ_CST);
+            int stop = k->stop && h == __atomic_load_n(&k->tail, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&k->lock);
+            if (stop) { break; }
+            continue;
+        }
+        struct pbuf *b = k->q[h % SINKQ];
+        k->write(k, &b->m);
+        __atomic_store_n(&k->head, h + 1, __ATOMIC_RELEASE);
+        pbuf_put(k->pool, b);
+    }
+    return NULL;
+}
+
+struct sink *sink_new(const char *name, struct param *pp, struct pool *pool,
+                        void (*write)(struct sink *, const struct rxmsg *)) {
+    struct sink *k = calloc(1, sizeof(*k));
+    if (! k) {
+        perror("Sink allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    k->name = name;
+    k->write = write;
+    k->pp = pp;
+    k->pool = pool;
+    k->fd = -1;
+    pthread_mutex_init(&k->lock, NULL);
+    pthread_cond_init(&k->cond, NULL);
+    return k;
+}
+
+// Write datagram as IPv6 UDP packet from sender to group
+void record_write(struct sink *k, const struct rxmsg *m) {
+    struct param *pp = k->pp;
+    uint32_t caplen = 40 + 8 + m->len;
+    uint32_t rec[4] = { m->wall / NSEC, m->wall % NSEC, caplen, caplen };
+    u_char ip[40 + 8];
+    memset(ip, 0, sizeof(ip));
+    ip[0] = 0x60;
+    ip[4] = (8 + m->len) >> 8;
+    ip[5] = 8 + m->len;
+    ip[6] = IPPROTO_UDP;
+    ip[7] = m->ttl >= 0 ? m->ttl : HOP;
+    memcpy(ip + 8, &m->src.sin6_addr, 16);
+    memcpy(ip + 24, &pp->mip, 16);
+    u_char *udp = ip + 40;
+    memcpy(udp, &m->src.sin6_port, 2);
+    memcpy(udp + 2, &pp->port, 2);
+    udp[4] = (8 + m->len) >> 8;
+    udp[5] = 8 + m->len;
+
+    // Checksum is mandatory over IPv6, pseudo header then UDP
+    uint32_t sum = IPPROTO_UDP + 8 + m->len;
+    int i;
+    for (i = 8; i < 48; i += 2) { sum += ip[i] << 8 | ip[i + 1]; }
+    const u_char *p = (const u_char *)m->buf;
+    for (i = 0; i + 1 < m->len; i += 2) { sum += p[i] << 8 | p[i + 1]; }
+    if (m->len & 1) { sum += p[m->len - 1] << 8; }
+    while (sum >> 16) { sum = (sum & 0xffff) + (sum >> 16); }
+    sum = ~sum & 0xffff;
+    if (sum == 0) { sum = 0xffff; }
+    udp[6] = sum >> 8;
+    udp[7] = sum;
+    if (fwrite(rec, sizeof(rec), 1, k->fp) != 1 || fwrite(ip, sizeof(ip), 1, k->fp) != 1 ||
+            (m->len > 0 && fwrite(m->buf, m->len, 1, k->fp) != 1)) {
+        k->failed++;
+    }
+}
+
+// Record datagrams into pcap file, nanosecond raw IP readable by --pcap
+struct sink *record_open(struct param *pp, struct pool *pool) {
+    struct sink *k = sink_new("record", pp, pool, record_write);
+    k->fp = fopen(pp->record, "wb");
+    if (! k->fp) {
+        perror("Open record file failed");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(k->fp, NULL, _IOFBF, 1 << 20);
+    uint32_t hdr[6] = { 0xa1b23c4d, 2 | 4 << 16, 0, 0, 65535, 101 };
+    if (fwrite(hdr, sizeof(hdr), 1, k->fp) != 1) {
+        perror("Write record file failed");
+        exit(EXIT_FAILURE);
+    }
+    return k;
+}
+
+// Send datagram to gateway framed by its length in 2 bytes network order
+void forward_write(struct sink *k, const struct rxmsg *m) {
+    if (k->fd < 0) {
+        k->failed++;
+        return;
+    }
+    u_char len[2] = { (u_char)(m->len >> 8), (u_char)m->len };
+    struct iovec iov[2] = { { len, 2 }, { m->buf, m->len } };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(k->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) {
+            perror("Forward failed");
+            close(k->fd);
+            k->fd = -1;
+            k->failed++;
+            return;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+}
+
+// Connect to TCP gateway at [addr]:port
+struct sink *forward_open(struct param *pp, struct pool *pool) {
+    struct sink *k = sink_new("forward", pp, pool, forward_write);
+    char host[INET6_ADDRSTRLEN];
+    int port;
+    struct sockaddr_in6 gw;
+    memset(&gw, 0, sizeof(gw));
+    gw.sin6_family = AF_INET6;
+    if (sscanf(pp->forward, "[%45[^]]]:%d", host, &port) != 2 ||
+            inet_pton(AF_INET6, host, &gw.sin6_addr) != 1) {
+        fprintf(stderr, "Bad forward address, [addr]:port expected: %s\n", pp->forward);
+        exit(EXIT_FAILURE);
+    }
+    gw.sin6_port = htons(port);
+    k->fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (k->fd < 0 || connect(k->fd, (struct sockaddr*)&gw, sizeof(gw)) < 0) {
+        perror("Connect to forward gateway failed");
+        exit(EXIT_FAILURE);
+    }
+    return k;
+}
+#endif
+
+void fan_init(struct fanout *fo, struct param *pp) {
+    memset(fo, 0, sizeof(*fo));
+#ifndef SIMULATION
+    if (! pp->record && ! pp->forward) { return; }
+    struct pool *pl = &fo->pool;
+    pool_init(pl, pp->size > BUFSIZE ? pp->size : BUFSIZE);
+
+    if (pp->record) { fo->sink[fo->nsinks++] = record_open(pp, pl); }
+    if (pp->forward) { fo->sink[fo->nsinks++] = forward_open(pp, pl); }
+    fo->wait = pp->pcap != NULL;
+
+    int i;
+    for (i = 0; i < fo->nsinks; i++) {
+        pthread_create(&fo->sink[i]->thread, NULL, sink_thread, fo->sink[i]);
+    }
+#endif
+}
+
+/*
+ * Hand datagram to every sink by reference
+ */
+void fan_out(struct fanout *fo, const struct rxmsg *m) {
+    struct pbuf *b;
+    while (! (b = pbuf_get(&fo->pool))) {
+        if (! fo->wait) {
+            fo->pool.empty++;
+            return;
+        }
+        sched_yield();
+    }
+    if (pbuf_fill(&fo->pool, b, m)) { fo->pool.truncated++; }
+    b->refs = fo->nsinks;
+
+    int i;
+    for (i = 0; i < fo->nsinks; i++) {
+        struct sink *k = fo->sink[i];
+        uint64_t t = k->tail, backlog;
+        while ((backlog = t - __atomic_load_n(&k->head, __ATOMIC_ACQUIRE)) >= SINKQ && fo->wait) {
+            sched_yield();
+        }
+        if (backlog >= SINKQ) {
+            k->dropped++;
+            pbuf_put(&fo->pool, b);
+            continue;
+        }
+        k->q[t % SINKQ] = b;
+        __atomic_store_n(&k->tail, t + 1, __ATOMIC_SEQ_CST);
+        if (backlog + 1 > k->maxbacklog) { k->maxbacklog = backlog + 1; }
+        if (__atomic_load_n(&k->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&k->lock);
+            pthread_cond_signal(&k->cond);
+            pthread_mutex_unlock(&k->lock);
+        }
+    }
+}
+
+// Let sinks finish their queue and close outputs
+void fan_close(struct fanout *fo) {
+    int i;
+    for (i = 0; i < fo->nsinks; i++) {
+        struct sink *k = fo->sink[i];
+        if (k->stop) { continue; }
+        pthread_mutex_lock(&k->lock);
+        k->stop = 1;
+        pthread_cond_signal(&k->cond);
+        pthread_mutex_unlock(&k->lock);
+        pthread_join(k->thread, NULL);
+        if (k->fp) { fclose(k->fp); }
+        if (k->fd >= 0) { close(k->fd); }
+        k->fp = NULL;
+        k->fd = -1;
+    }
+}
+
+void fan_report(struct fanout *fo) {
+    if (fo->nsinks == 0) { return; }
+    printf("  pool free %d empty %llu truncated %llu\n", fo->pool.nfree,
+            (unsigned long long)fo->pool.empty, (unsigned long long)fo->pool.truncated);
+    int i;
+    for (i = 0; i < fo->nsinks; i++) {
+        struct sink *k = fo->sink[i];
+        uint64_t head = __atomic_load_n(&k->head, __ATOMIC_ACQUIRE);
+        printf("  sink %s done %llu backlog %llu max %llu dropped %llu failed %llu\n",
+                k->name, (unsigned long long)head, (unsigned long long)(k->tail - head),
+                (unsigned long long)k->maxbacklog, (unsigned long long)k->dropped,
+                (unsigned long long)k->failed);
+    }
+}
+
+void fan_exit(struct fanout *fo) {
+    fan_close(fo);
+    int i;
+    for (i = 0; i < fo->nsinks; i++) { free(fo->sink[i]); }
+    free(fo->pool.bufs);
+    free(fo->pool.data);
+    fo->nsinks = 0;
+}
+
+/*
+ * Clock sync
+ *
+ * One way latency from send time in message is only as good as the clock
+ * sync of sender and receiver hosts.  With --sync port, sender answers time
+ * requests on that unicast UDP port, and receiver asks each sender host it
+ * hears from, NTP style, every SYNC_INTERVAL ms:
+ *
+ *   receiver t1 -> sender t2, t3 -> receiver t4
+ *   offset = ((t2 - t1) + (t3 - t4)) / 2      sender clock minus receiver's
+ *   delay  = (t4 - t1) - (t3 - t2)            round trip outside sender
+ *
+ * Of the last SYNC_WINDOW samples the one of minimum delay is kept, since
+ * queueing only adds delay and asymmetry, and a line fitted thru the last
+ * SYNC_POINTS kept samples gives offset and drift at any time.  Latency of
+ * stamped packets is corrected by offset of their sender at arrival, and
+ * reported with error bound: half the round trip of kept sample plus the
+ * largest residual of fit; drift is fitted from 4 kept samples on.
+ * Stamped packets of senders not synced yet are left out of latency.  Not in
+ * simulation, which has one clock.
+ */
+
+#define MAXPEERS 16                    // sender hosts tracked
+#define SYNC_INTERVAL 250              // ms between requests to a sender
+#define SYNC_TIMEOUT 100               // ms to wait for answer
+#define SYNC_WINDOW 8                  // samples of minimum delay filter
+#define SYNC_POINTS 16                 // kept samples of drift fit
+#define SYNC_MAGIC 0x4d53594eU         // "MSYN"
+
+// Time request and answer, network byte order
+struct syncmsg {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t t1;                       // request sent, receiver clock
+    uint64_t t2;                       // request received, sender clock
+    uint64_t t3;                       // answer sent, sender clock
+};
+
+// Sender host whose clock is tracked
+struct peer {
+    struct sockaddr_in6 addr;          // sender host, with scope
+    double off[SYNC_WINDOW];           // offset samples in ns
+    double delay[SYNC_WINDOW];         // round trip of samples in ns
+    uint64_t at[SYNC_WINDOW];          // sample time, receiver clock
+    int nsamples;
+    double poff[SYNC_POINTS];          // kept samples
+    double pdelay[SYNC_POINTS];
+    uint64_t pat[SYNC_POINTS];
+    int npoints;
+    uint64_t asked;                    // requests sent
+    uint64_t answered;                 // answers received
+    uint32_t seq;                      // estimate below is written while odd
+    uint64_t t0;                       // fit origin, receiver clock
+    int64_t off0;                      // offset at t0 in ns
+    int64_t drift;                     // drift in ns per second
+    int64_t bound;                     // error bound in ns, 0 until synced
+};
+
+struct clock {
+    struct peer peer[MAXPEERS];
+    int npeers;                        // peers in use, published with release
+    pthread_mutex_t lock;              // adding peers
+};
+
+static struct clock clk = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Peer of sender host, added when new, -1 if table is full
+int clk_peer(const struct sockaddr_in6 *src) {
+    int i;
+    pthread_mutex_lock(&clk.lock);
+    for (i = 0; i < clk.npeers; i++) {
+        if (memcmp(&clk.peer[i].addr.sin6_addr, &src->sin6_addr, sizeof(src->sin6_addr)) == 0 &&
+                clk.peer[i].addr.sin6_scope_id == src->sin6_scope_id) { break; }
+    }
+    if (i == clk.npeers) {
+        if (i < MAXPEERS) {
+            clk.peer[i].addr = *src;
+            __atomic_store_n(&clk.npeers, i + 1, __ATOMIC_RELEASE);
+        } else {
+            i = -1;
+        }
+    }
+    pthread_mutex_unlock(&clk.lock);
+    return i;
+}
+
+// One way latency corrected by clock offset of sender, -1 if not synced
+static inline int64_t clk_latency(int i, uint64_t wall, uint64_t stamp) {
+    if (i < 0) { return -1; }
+    struct peer *p = &clk.peer[i];
+    uint32_t seq;
+    uint64_t t0;
+    int64_t off0, drift, bound;
+    do {
+        seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        t0 = __atomic_load_n(&p->t0, __ATOMIC_RELAXED);
+        off0 = __atomic_load_n(&p->off0, __ATOMIC_RELAXED);
+        drift = __atomic_load_n(&p->drift, __ATOMIC_RELAXED);
+        bound = __atomic_load_n(&p->bound, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&p->seq, __ATOMIC_RELAXED));
+    if (bound == 0) { return -1; }
+    double off = off0 + drift * ((double)(int64_t)(wall - t0) / NSEC);
+    int64_t lat = (int64_t)(wall - stamp) + (int64_t)off;
+    return lat > 0 ? lat : 0;          // below zero is within error bound
+}
+
+// Add sample of exchange, and fit offset and drift to kept samples
+void clk_sample(struct peer *p, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+    int i, k = p->nsamples++ % SYNC_WINDOW;
+    p->off[k] = ((double)(int64_t)(t2 - t1) + (double)(int64_t)(t3 - t4)) / 2;
+    p->delay[k] = (double)(int64_t)(t4 - t1) - (double)(int64_t)(t3 - t2);
+    p->at[k] = t4;
+
+    // Keep sample of minimum delay in window, once
+    int n = p->nsamples < SYNC_WINDOW ? p->nsamples : SYNC_WINDOW, best = 0;
+    for (i = 1; i < n; i++) {
+        if (p->delay[i] < p->delay[best]) { best = i; }
+    }
+    if (p->npoints > 0 && p->pat[(p->npoints - 1) % SYNC_POINTS] >= p->at[best]) { return; }
+    k = p->npoints++ % SYNC_POINTS;
+    p->poff[k] = p->off[best];
+    p->pdelay[k] = p->delay[best];
+    p->pat[k] = p->at[best];
+
+    // Least squares line thru kept samples, origin at newest
+    uint64_t t0 = p->pat[k];
+    n = p->npoints < SYNC_POINTS ? p->npoints : SYNC_POINTS;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (i = 0; i < n; i++) {
+        double x = (double)(int64_t)(p->pat[i] - t0) / NSEC;
+        sx += x;
+        sy += p->poff[i];
+        sxx += x * x;
+        sxy += x * p->poff[i];
+    }
+    double den = n * sxx - sx * sx;
+    double b = n >= 4 && den > 0 ? (n * sxy - sx * sy) / den : 0;
+    double a = (sy - b * sx) / n, resid = 0;
+    for (i = 0; i < n; i++) {
+        double r = p->poff[i] - (a + b * (double)(int64_t)(p->pat[i] - t0) / NSEC);
+        if (r < 0) { r = -r; }
+        if (r > resid) { resid = r; }
+    }
+    double bound = (p->pdelay[k] > 0 ? p->pdelay[k] : 0) / 2 + resid;
+
+    __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&p->t0, t0, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->off0, (int64_t)a, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->drift, (int64_t)b, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->bound, bound >= 1 ? (int64_t)bound : 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+}
+
+void clk_report(uint64_t unsynced) {
+    int i, n = __atomic_load_n(&clk.npeers, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+        struct peer *p = &clk.peer[i];
+        char name[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &p->addr.sin6_addr, name, sizeof(name));
+        int64_t bound = __atomic_load_n(&p->bound, __ATOMIC_RELAXED);
+        if (bound == 0) {
+            printf("  sync %s not synced, %llu of %llu answered\n", name,
+                (unsigned long long)p->answered, (unsigned long long)p->asked);
+            continue;
+        }
+        printf("  sync %s offset %.1f us drift %.3f ppm bound +-%.1f us\n", name,
+                __atomic_load_n(&p->off0, __ATOMIC_RELAXED) / 1e3,
+                __atomic_load_n(&p->drift, __ATOMIC_RELAXED) / 1e3, bound / 1e3);
+    }
+    if (unsynced > 0) {
+        printf("  sync %llu stamped packets before sync left out\n", (unsigned long long)unsynced);
+    }
+}
+
+// Largest error bound of synced senders in ns
+int64_t clk_bound(void) {
+    int i, n = __atomic_load_n(&clk.npeers, __ATOMIC_ACQUIRE);
+    int64_t max = 0;
+    for (i = 0; i < n; i++) {
+        int64_t b = __atomic_load_n(&clk.peer[i].bound, __ATOMIC_RELAXED);
+        if (b > max) { max = b; }
+    }
+    return max;
+}
+
+/*
+ * Answer time requests of receivers
+ */
+void *clk_server(void *args) {
+    struct param *pp = args;
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed (sync)");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_in6 local;
+    memset(&local, 0, sizeof(local));
+    local.sin6_family = AF_INET6;
+    local.sin6_addr = in6addr_any;
+    local.sin6_port = htons(pp->syncport);
+    if (bind(sock, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        perror("Bind failed (sync)");
+        exit(EXIT_FAILURE);
+    }
+    while (1) {
+        struct syncmsg msg;
+        struct sockaddr_in6 from;
+        socklen_t len = sizeof(from);
+        ssize_t n = recvfrom(sock, &msg, sizeof(msg), 0, (struct sockaddr*)&from, &len);
+        uint64_t t2 = wall_ns();
+        if (n != sizeof(msg) || ntohl(msg.magic) != SYNC_MAGIC) { continue; }
+        msg.t2 = htobe64(t2);
+        msg.t3 = htobe64(wall_ns());
+        sendto(sock, &msg, sizeof(msg), 0, (struct sockaddr*)&from, len);
+    }
+    return NULL;
+}
+
+/*
+ * Ask each sender host heard from for its time
+ */
+void *clk_client(void *args) {
+    struct param *pp = args;
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed (sync)");
+        exit(EXIT_FAILURE);
+    }
+    struct timeval tv = { 0, SYNC_TIMEOUT * 1000 };
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO) failed (sync)");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t seq = 0;
+    while (1) {
+        uint64_t next = now_ns() + SYNC_INTERVAL * 1000000ULL;
+        int i, n = __atomic_load_n(&clk.npeers, __ATOMIC_ACQUIRE);
+        for (i = 0; i < n; i++) {
+            struct peer *p = &clk.peer[i];
+            struct sockaddr_in6 dst = p->addr;
+            dst.sin6_port = htons(pp->syncport);
+            struct syncmsg msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.magic = htonl(SYNC_MAGIC);
+            msg.seq = htonl(++seq);
+            uint64_t t1 = wall_ns();
+            msg.t1 = htobe64(t1);
+            if (sendto(sock, &msg, sizeof(msg), 0, (struct sockaddr*)&dst, sizeof(dst)) < 0) {
+                continue;
+            }
+            p->asked++;
+
+            // Wait for answer to this request, dropping late answers of earlier ones
+            while (recv(sock, &msg, sizeof(msg), 0) == sizeof(msg)) {
+                uint64_t t4 = wall_ns();
+                if (ntohl(msg.magic) != SYNC_MAGIC || ntohl(msg.seq) != seq) { continue; }
+                p->answered++;
+                clk_sample(p, t1, be64toh(msg.t2), be64toh(msg.t3), t4);
+                break;
+            }
+        }
+        sleep_until(next);
+    }
+    return NULL;
+}
+
+/*
+ * Microburst detector
+ *
+ * Average rates look fine while bursts of a millisecond or less overflow
+ * switch buffers.  With --burst us, receiver bins arrivals of each group by
+ * kernel receive stamp (SO_TIMESTAMPNS, packet ring or pcap record, else
+ * time of engine batch) into windows of us microseconds.  Packet counts of
+ * the last BURST_RING windows are kept in a ring whose sum gives the moving
+ * average, so memory is constant at any rate.  A window is hot when it has
+ * at least BURST_MIN packets and more than BURST_FACTOR times the moving
+ * average, or than the rate of --burst us,pps when given; a run of hot
+ * windows is one burst.  Reported per group are peak window rate, burst
+ * size distribution in packets and bursts per second.
+ */
+
+#define BURST_RING 1024                // windows of moving average
+#define BURST_FACTOR 4                 // hot above this times average
+#define BURST_MIN 2                    // packets at least in hot window
+
+struct burst {
+    uint64_t width;                    // window in ns
+    double thresh;                     // packets of hot window, 0 by average
+    uint64_t win;                      // current window number
+    uint32_t pkts;                     // packets in current window
+    uint32_t bytes;                    // bytes in current window
+    uint32_t ring[BURST_RING];         // packets of last windows
+    uint64_t sum;                      // packets in ring
+    uint64_t windows;                  // windows closed
+    uint32_t peak;                     // most packets in a window
+    uint32_t peakbytes;                // most bytes in a window
+    uint64_t run;                      // packets of burst going on, 0 none
+    uint64_t bursts;                   // bursts ended
+    uint64_t first;                    // first arrival, 0 none yet
+    uint64_t last;                     // last arrival
+    struct hist size;                  // packets per burst
+};
+
+void burst_init(struct burst *b, double us, double pps) {
+    memset(b, 0, sizeof(*b));
+    b->width = (uint64_t)(us * 1e3);
+    b->thresh = pps * us / 1e6;
+}
+
+// Close current window, and idle windows before window w
+static void burst_close(struct burst *b, uint64_t w) {
+    while (b->win < w) {
+        uint32_t c = b->pkts;
+        uint64_t filled = b->windows < BURST_RING ? b->windows : BURST_RING;
+        int hot = c >= BURST_MIN && (b->thresh > 0 ? c > b->thresh :
+                        (uint64_t)c * filled > BURST_FACTOR * b->sum);
+        if (hot) {
+            b->run += c;
+        } else if (b->run > 0) {
+            hist_add(&b->size, b->run);
+            b->bursts++;
+            b->run = 0;
+        }
+        if (c > b->peak) { b->peak = c; }
+        if (b->bytes > b->peakbytes) { b->peakbytes = b->bytes; }
+        int k = b->windows++ % BURST_RING;
+        b->sum = b->sum - b->ring[k] + c;
+        b->ring[k] = c;
+        b->pkts = b->bytes = 0;
+        b->win++;
+
+        // Idle longer than the ring leaves it empty
+        if (w - b->win > BURST_RING) {
+            memset(b->ring, 0, sizeof(b->ring));
+            b->sum = 0;
+            b->windows += w - b->win;
+            b->win = w;
+        }
+    }
+}
+
+static inline void burst_add(struct burst *b, uint64_t t, int len) {
+    uint64_t w = t / b->width;
+    if (b->first == 0) {
+        b->first = t;
+        b->win = w;
+    } else if (w > b->win) {
+        burst_close(b, w);
+    }
+    b->pkts++;                                      // stamps out of order count here
+    b->bytes += len;
+    b->last = t;
+}
+
+void burst_report(const struct burst *b) {
+    if (b->windows == 0) { return; }
+    double w = b->width / 1e9, sec = (b->last - b->first) / 1e9;
+    uint64_t filled = b->windows < BURST_RING ? b->windows : BURST_RING;
+    printf("  bursts in %.0f us windows: peak %u pkts %.0f pps %.1f Mbit/s, avg %.2f pkts,"
+                " %llu bursts %.2f/s\n", b->width / 1e3, b->peak, b->peak / w,
+                b->peakbytes * 8 / w / 1e6, (double)b->sum / filled,
+                (unsigned long long)b->bursts, sec > 0 ? b->bursts / sec : 0.0);
+    if (b->size.n == 0) { return; }
+    printf("  burst size p50 %llu p90 %llu p99 %llu max %llu pkts\n",
+                (unsigned long long)hist_pct(&b->size, 50),
+                (unsigned long long)hist_pct(&b->size, 90),
+                (unsigned long long)hist_pct(&b->size, 99),
+                (unsigned long long)b->size.max);
+}
+
+/*
+ * Path change detection
+ *
+ * Routing changes (RPF change, switchover to shortest path tree) move a
+ * stream to another path silently.  With --path, receiver asks the kernel
+ * for the hop limit of each datagram (IPV6_RECVHOPLIMIT, packet ring or pcap record), so a
+ * change of hop count is seen at once, and runs a change point detector on
+ * one way latency of stamped packets (--stamp at sender) to catch shifts of
+ * path without a change of hops.  Detector is a two-sided CUSUM of latency
+ * against a slowly moving baseline, in units of its mean absolute deviation
+ * (at least PATH_FLOOR): each packet adds its deviation, clipped to
+ * PATH_CLIP units, less PATH_SLACK units, and a sum above PATH_ALARM units is a
+ * step, so a step takes some packets while single outliers never do.
+ * Baseline is then learned again from the next PATH_WARM packets.  Events
+ * are printed as they happen and counted per stream.
+ */
+
+#define PATH_WARM 32                   // packets to learn baseline
+#define PATH_SLOW 256                  // baseline moving average packets
+#define PATH_FAST 4                    // recent level moving average packets
+#define PATH_FLOOR 20000               // least deviation unit in ns
+#define PATH_SLACK 1                   // units of deviation taken as noise
+#define PATH_CLIP 3                    // units at most per packet
+#define PATH_ALARM 20                  // units of step
+
+struct path {
+    int ttl;                           // hop limit of last packet, -1 if none
+    uint32_t hops;                     // hop count changes
+    uint32_t steps;                    // latency steps
+    uint32_t n;                        // latency samples since baseline reset
+    int64_t base;                      // baseline latency in ns
+    int64_t dev;                       // mean absolute deviation from baseline
+    int64_t fast;                      // recent latency
+    int64_t up;                        // cusum of rises
+    int64_t down;                      // cusum of falls
+};
+
+static inline void path_init(struct path *pt) {
+    memset(pt, 0, sizeof(*pt));
+    pt->ttl = -1;
+}
+
+static void path_event(const struct sockaddr_in6 *src, uint64_t pkt, const char *what,
+                        double from, double to, const char *unit) {
+    char sender_ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &src->sin6_addr, sender_ip, sizeof(sender_ip));
+    printf("Path fm [%s]:%d %s %.*f -> %.*f%s at pkt %llu\n", sender_ip, ntohs(src->sin6_port),
+                what, *unit ? 1 : 0, from, *unit ? 1 : 0, to, unit, (unsigned long long)pkt);
+}
+
+// Track hop limit of packet, -1 if unknown
+static inline void path_ttl(struct path *pt, int ttl, const struct sockaddr_in6 *src, uint64_t pkt) {
+    if (ttl < 0 || ttl == pt->ttl) { return; }
+    if (pt->ttl >= 0) {
+        pt->hops++;
+        path_event(src, pkt, "hop limit", pt->ttl, ttl, "");
+    }
+    pt->ttl = ttl;
+}
+
+// Feed latency in ns to change point detector
+static inline void path_lat(struct path *pt, int64_t x, const struct sockaddr_in6 *src, uint64_t pkt) {
+    pt->fast += (x - pt->fast) / PATH_FAST;
+    if (pt->n < PATH_WARM) {                        // running mean and deviation
+        pt->n++;
+        if (pt->n == 1) { pt->base = pt->fast = x; pt->dev = 0; }
+        pt->base += (x - pt->base) / pt->n;
+        pt->dev += ((x > pt->base ? x - pt->base : pt->base - x) - pt->dev) / pt->n;
+        return;
+    }
+    int64_t d = x - pt->base;
+    pt->base += d / PATH_SLOW;
+    pt->dev += ((d > 0 ? d : -d) - pt->dev) / PATH_SLOW;
+    int64_t unit = pt->dev > PATH_FLOOR ? pt->dev : PATH_FLOOR;
+    if (d > PATH_CLIP * unit) { d = PATH_CLIP * unit; }
+    if (d < -PATH_CLIP * unit) { d = -PATH_CLIP * unit; }
+    pt->up = pt->up + d - PATH_SLACK * unit > 0 ? pt->up + d - PATH_SLACK * unit : 0;
+    pt->down = pt->down - d - PATH_SLACK * unit > 0 ? pt->down - d - PATH_SLACK * unit : 0;
+    if (pt->up > PATH_ALARM * unit || pt->down > PATH_ALARM * unit) {
+        pt->steps++;
+        path_event(src, pkt, "latency", pt->base / 1e3, pt->fast / 1e3, " us");
+        pt->n = 0;
+        pt->up = pt->down = 0;
+    }
+}
+
+// Print hop limit and latency baseline of stream
+void path_report(const struct path *pt) {
+    printf("    path");
+    if (pt->ttl >= 0) { printf(" hop limit %d", pt->ttl); }
+    printf(" hop changes %u latency steps %u", pt->hops, pt->steps);
+    if (pt->n > 0) { printf(" baseline %.1f us", pt->base / 1e3); }
+    printf("\n");
+}
+
+/*
+ * Receive policing
+ *
+ * On an ASM group one flooding publisher can starve the others at the
+ * receiver.  With --police pps[,burst], each source address gets a token
+ * bucket of pps packets per second, burst packets deep (default a tenth of
+ * a second); datagrams above it are dropped first thing in rx_process,
+ * before stream tracking and sinks.  A source dropping more than it passes
+ * for POLICE_STRIKES seconds in a row is a persistent offender and is put
+ * into a classic BPF filter on the receiving socket (packet socket with
+ * packet engine), so the kernel drops its datagrams before they are queued;
+ * after POLICE_HOLD seconds it is let back in and policed again.  Sources
+ * live in a table of POLICE_SLOTS entries probed at most POLICE_PROBE deep,
+ * where a new source evicts the one idle longest, so memory is bounded
+ * however many sources send.
+ */
+
+#define POLICE_SLOTS 256               // sources tracked
+#define POLICE_PROBE 8                 // slots looked at per source
+#define POLICE_STRIKES 3               // seconds over limit to block
+#define POLICE_HOLD 10                 // seconds blocked in kernel filter
+#define POLICE_MAXBLOCK 32             // sources in kernel filter
+
+struct source {
+    struct in6_addr addr;              // source address
+    int used;                          // slot in use
+    int strikes;                       // seconds in a row over limit
+    uint64_t credit;                   // tokens in ns of rate
+    uint64_t last;                     // arrival time of last packet
+    uint64_t sec;                      // second of window counters
+    uint32_t wpass;                    // packets passed in this second
+    uint32_t wdrop;                    // packets dropped in this second
+    uint64_t until;                    // end of block, 0 if not blocked
+    uint64_t pass;                     // packets passed
+    uint64_t drop;                     // packets dropped
+    uint64_t blocks;                   // times blocked in kernel
+};
+
+struct police {
+    uint64_t interval;                 // ns per packet of rate
+    uint64_t depth;                    // ns of full bucket
+    int sock;                          // socket of kernel filter, -1 none
+    int nblocked;                      // sources in kernel filter
+    uint64_t next;                     // earliest end of block, 0 none
+    uint64_t pass;                     // packets passed
+    uint64_t drop;                     // packets dropped
+    uint64_t evicted;                  // sources evicted from table
+    uint64_t untracked;                // packets of sources not in table
+    struct source src[POLICE_SLOTS];
+};
+
+void police_init(struct police *pl, double pps, double burst) {
+    memset(pl, 0, sizeof(*pl));
+    pl->interval = (uint64_t)(NSEC / pps);
+    if (burst <= 0) { burst = pps / 10 > 1 ? pps / 10 : 1; }
+    pl->depth = (uint64_t)(burst * pl->interval);
+    pl->sock = -1;
+}
+
+// Load kernel filter dropping blocked sources
+void police_filter(struct police *pl) {
+    if (pl->sock < 0) { return; }
+    struct sock_filter code[8 * POLICE_MAXBLOCK + 2];
+    int i, k = 0, n = pl->nblocked;
+    for (i = 0; i < POLICE_SLOTS && n > 0; i++) {
+        if (! pl->src[i].until) { continue; }
+        n--;
+        uint32_t w[4];
+        memcpy(w, &pl->src[i].addr, sizeof(w));
+        int j;
+        for (j = 0; j < 4; j++) {                   // source address word by word
+            code[k++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8 + 4 * j);
+            code[k++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                ntohl(w[j]), j < 3 ? 0 : 8 * n + 1, 6 - 2 * j);
+        }
+    }
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog prog = { k, code };
+    if (setsockopt(pl->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt(SO_ATTACH_FILTER) failed (police)");
+        pl->sock = -1;                              // drop in user space only
+    }
+}
+
+// Let blocked sources back in when their time is up
+void police_release(struct police *pl, uint64_t now) {
+    int i;
+    pl->next = 0;
+    for (i = 0; i < POLICE_SLOTS; i++) {
+        struct source *s = &pl->src[i];
+        if (! s->until) { continue; }
+        if (s->until <= now) {
+            s->until = 0;
+            s->strikes = 0;
+            s->credit = pl->depth;
+            s->last = now;
+            pl->nblocked--;
+        } else if (! pl->next || s->until < pl->next) {
+            pl->next = s->until;
+        }
+    }
+    police_filter(pl);
+}
+
+// Close counting second of source, blocking a persistent offender
+void police_second(struct police *pl, struct source *s, uint64_t now) {
+    uint64_t sec = now / NSEC;
+    s->strikes = s->sec + 1 == sec && s->wdrop > s->wpass ? s->strikes + 1 : 0;
+    s->sec = sec;
+    s->wpass = s->wdrop = 0;
+    if (s->strikes >= POLICE_STRIKES && ! s->until && pl->nblocked < POLICE_MAXBLOCK) {
+        s->until = now + POLICE_HOLD * NSEC;
+        s->blocks++;
+        pl->nblocked++;
+        if (! pl->next || s->until < pl->next) { pl->next = s->until; }
+        police_filter(pl);
+    }
+}
+
+// Find or add source, evicting the one idle longest, NULL if all are blocked
+static inline struct source *police_source(struct police *pl, const struct in6_addr *a,
+                                            uint64_t now) {
+    uint32_t h = (a->s6_addr32[0] ^ a->s6_addr32[1] ^ a->s6_addr32[2] ^ a->s6_addr32[3]) * 0x9E3779B1U;
+    struct source *old = NULL;
+    int i;
+    for (i = 0; i < POLICE_PROBE; i++) {
+        struct source *s = &pl->src[((h >> 16) + i) % POLICE_SLOTS];
+        if (! s->used) {
+            old = s;
+            break;
+        }
+        if (memcmp(&s->addr, a, sizeof(*a)) == 0) { return s; }
+        if (! s->until && (! old || s->last < old->last)) { old = s; }
+    }
+    if (! old) { return NULL; }
+    if (old->used) { pl->evicted++; }
+    memset(old, 0, sizeof(*old));
+    old->used = 1;
+    old->addr = *a;
+    old->credit = pl->depth;
+    old->last = now;
+    old->sec = now / NSEC;
+    return old;
+}
+
+// True if datagram is within rate of its source
+static inline int police_pass(struct police *pl, const struct rxmsg *m) {
+    if (pl->next && m->ts >= pl->next) { police_release(pl, m->ts); }
+    struct source *s = police_source(pl, &m->src.sin6_addr, m->ts);
+    if (! s) {
+        pl->untracked++;
+        return 1;
+    }
+    if (m->ts / NSEC != s->sec) { police_second(pl, s, m->ts); }
+    uint64_t credit = s->credit;
+    if (m->ts > s->last) {
+        credit += m->ts - s->last;
+        s->last = m->ts;
+    }
+    if (credit > pl->depth) { credit = pl->depth; }
+    if (! s->until && credit >= pl->interval) {     // blocked until filter is in
+        s->credit = credit - pl->interval;
+        s->pass++;
+        s->wpass++;
+        pl->pass++;
+        return 1;
+    }
+    s->credit = credit;
+    s->drop++;
+    s->wdrop++;
+    pl->drop++;
+    return 0;
+}
+
+// Print policing counters, per source only for sources over limit
+void police_report(const struct police *pl) {
+    printf("  police pass %llu drop %llu, %d blocked in %s, %llu evicted %llu untracked\n",
+                (unsigned long long)pl->pass, (unsigned long long)pl->drop, pl->nblocked,
+                pl->sock >= 0 ? "kernel" : "user space",
+                (unsigned long long)pl->evicted, (unsigned long long)pl->untracked);
+    int i;
+    for (i = 0; i < POLICE_SLOTS; i++) {
+        const struct source *s = &pl->src[i];
+        if (! s->used || s->drop == 0) { continue; }
+        char ip[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &s->addr, ip, sizeof(ip));
+        printf("    src %s pass %llu drop %llu blocks %llu%s\n", ip,
+                (unsigned long long)s->pass, (unsigned long long)s->drop,
+                (unsigned long long)s->blocks, s->until ? " blocked" : "");
+    }
+}
+
+/*
+ * Path MTU probing
+ *
+ * Each receiver of a group sits behind a path of its own MTU, and datagrams
+ * above it are dropped with Packet Too Big, as IPv6 routers do not
+ * fragment, which seldom reaches a multicast sender.  With --pmtu port, a
+ * sender first probes the group with PMTU_REPS datagrams "pmtu/round/size"
+ * per size, from the plateaus of common MTUs as in RFC 1191 above 1280 up
+ * to MAXPAYLOAD, or BUFSIZE with impairment, paced PMTU_GAP us apart so
+ * that loss of a burst is not taken for size, with IPV6_DONTFRAG and local
+ * fragmentation off, then PMTU_REPS "pmtu/round/end".  A receiver with
+ * --pmtu port keeps the largest probe of the round that arrived, as much as
+ * its buffers of --size hold, instead of counting probes as messages, and
+ * at end answers "pmtu/round/size" to port at the address the probes came
+ * from.  The sender collects answers for PMTU_WAIT ms, pads its messages to
+ * the smallest size reported, as --size would, and keeps fragmentation off,
+ * so that a path that shrinks later drops datagrams rather than fragments
+ * them.  Without answers, size and fragmentation are left as they were.
+ */
+
+#define PMTU_REPS 3                    // probes per size
+#define PMTU_GAP 200                   // us between probes
+#define PMTU_WAIT 500                  // ms waiting for answers
+#define PMTU_HOSTS 256                 // receivers told apart
+#define PMTU_HDR 48                    // IP and UDP headers
+
+static const int pmtu_mtus[] = { 576, 1006, 1280, 1400, 1420, 1440, 1460, 1480, 1492,
+                                 1500, 4352, 8166, 9000, 9216, 17914, 65535 };
+
+// Probes received from a sender
+struct pmtu {
+    int sock;                          // answers to sender
+    u_short port;
+    uint32_t round;                    // round of probes being received
+    int largest;                       // largest probe of round
+    int answered;
+};
+
+void pmtu_init(struct pmtu *p, int port) {
+    memset(p, 0, sizeof(*p));
+    p->port = htons(port);
+    p->sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (p->sock < 0) {
+        perror("Socket creation failed (pmtu)");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Probe of sender, answered at end of its round
+void pmtu_seen(struct pmtu *p, const struct rxmsg *m) {
+    char head[32], what[8];
+    unsigned round;
+    int n = m->len < (int)sizeof(head) - 1 ? m->len : (int)sizeof(head) - 1;
+    memcpy(head, m->buf, n);
+    head[n] = '\0';
+    if (sscanf(head, "pmtu/%u/%7[^/]", &round, what) != 2) { return; }
+    if (round != p->round) {
+        p->round = round;
+        p->largest = 0;
+        p->answered = 0;
+    }
+    if (strcmp(what, "end") != 0) {
+        if (m->len > p->largest) { p->largest = m->len; }
+        return;
+    }
+    if (p->answered || p->largest == 0) { return; }
+    p->answered = 1;
+    char msg[32];
+    int len = snprintf(msg, sizeof(msg), "pmtu/%u/%d", round, p->largest);
+    struct sockaddr_in6 dst = m->src;
+    dst.sin6_port = p->port;
+    char addr[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &m->src.sin6_addr, addr, sizeof(addr));
+    if (sendto(p->sock, msg, len, 0, (struct sockaddr*)&dst, sizeof(dst)) < 0) {
+        perror("Answer to pmtu probe failed");
+    }
+    printf("PMTU probes of %s: largest %d bytes\n", addr, p->largest);
+    fflush(stdout);
+}
+
+// Probe group from sender socket and pad messages to smallest size reported
+void pmtu_probe(struct param *pp, int sock, const struct sockaddr_in6 *group) {
+    int ans = socket(AF_INET6, SOCK_DGRAM, 0), reuse = 1;
+    struct sockaddr_in6 local;
+    memset(&local, 0, sizeof(local));
+    local.sin6_family = AF_INET6;
+    local.sin6_addr = in6addr_any;
+    local.sin6_port = htons(pp->pmtuport);
+    if (ans < 0 || setsockopt(ans, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+            bind(ans, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        perror("Answer socket failed (pmtu)");
+        exit(EXIT_FAILURE);
+    }
+    int mode, probe = IPV6_PMTUDISC_PROBE;
+    socklen_t optlen = sizeof(mode);
+    if (getsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, &optlen) < 0 ||
+            setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &probe, sizeof(probe)) < 0 ||
+            setsockopt(sock, IPPROTO_IPV6, IPV6_DONTFRAG, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt(IPV6_MTU_DISCOVER) failed (pmtu)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Probes of increasing size, then end of round
+    uint32_t round = (uint32_t)(wall_ns() / 1000000);
+    int max = pp->imp.enabled ? BUFSIZE : MAXPAYLOAD;     // impairment slots hold BUFSIZE
+    char *msg = malloc(max);
+    char head[32];
+    int i, r, sizes = 0;
+    if (! msg) {
+        perror("Probe allocation failed (pmtu)");
+        exit(EXIT_FAILURE);
+    }
+    memset(msg, '.', max);
+    for (i = 0; i < (int)(sizeof(pmtu_mtus) / sizeof(pmtu_mtus[0])); i++) {
+        int size = pmtu_mtus[i] - PMTU_HDR;
+        if (pmtu_mtus[i] < 1280 || size > max) { continue; }
+        int n = snprintf(head, sizeof(head), "pmtu/%u/%d/", round, size);
+        memcpy(msg, head, n);
+        for (r = 0; r < PMTU_REPS; r++) {
+            if (sendto(sock, msg, size, 0, (struct sockaddr*)group, sizeof(*group)) < 0) { break; }
+            sleep_until(now_ns() + PMTU_GAP * 1000);
+        }
+        if (r < PMTU_REPS) {               // beyond MTU of interface
+            if (errno != EMSGSIZE) { perror("Probe send failed (pmtu)"); }
+            break;
+        }
+        sizes++;
+    }
+    int n = snprintf(msg, max, "pmtu/%u/end", round);
+    for (r = 0; r < PMTU_REPS; r++) {
+        sendto(sock, msg, n, 0, (struct sockaddr*)group, sizeof(*group));
+        sleep_until(now_ns() + PMTU_GAP * 1000);
+    }
+
+    // Answers of receivers, smallest of largest sizes
+    struct in6_addr host[PMTU_HOSTS];
+    int nhost = 0, least = 0;
+    uint64_t stop = now_ns() + PMTU_WAIT * 1000000ULL, now;
+    while ((now = now_ns()) < stop) {
+        struct pollfd pfd = { ans, POLLIN, 0 };
+        if (poll(&pfd, 1, (stop - now + 999999) / 1000000) <= 0) { continue; }
+        struct sockaddr_in6 src;
+        socklen_t slen = sizeof(src);
+        int len = recvfrom(ans, msg, max - 1, 0, (struct sockaddr*)&src, &slen);
+        unsigned got;
+        int size;
+        if (len <= 0) { continue; }
+        msg[len] = '\0';
+        if (sscanf(msg, "pmtu/%u/%d", &got, &size) != 2 || got != round || size <= 0) { continue; }
+        for (i = 0; i < nhost && memcmp(&host[i], &src.sin6_addr, sizeof(host[i])) != 0; i++) { }
+        if (i < nhost || nhost == PMTU_HOSTS) { continue; }
+        host[nhost++] = src.sin6_addr;
+        if (least == 0 || size < least) { least = size; }
+        if (! pp->quiet) {
+            char addr[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, &src.sin6_addr, addr, sizeof(addr));
+            printf("PMTU of %s: %d bytes\n", addr, size);
+        }
+    }
+    close(ans);
+    free(msg);
+    if (nhost == 0) {
+        setsockopt(sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode));
+        reuse = 0;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_DONTFRAG, &reuse, sizeof(reuse));
+        printf("PMTU: %d sizes probed, no receiver answered, size %d kept\n", sizes, pp->size);
+    } else {
+        pp->size = least;
+        printf("PMTU: %d sizes probed, %d receivers answered, size %d\n", sizes, nhost, least);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Receive pipeline
+ *
+ * Everything done to a datagram after the engine lives here, so that live
+ * socket and offline pcap input go thru exactly the same processing:
+ *
+ *   decode sequence -> track per sender stream -> update stats -> print
+ *        -> sinks by reference
+ *
+ * Message is "<marker>/<hhmmss>/<seq>" as formatted by send_thread, and
+ * "<marker>/<hhmmss>/<seq>/<ns>" with realtime send time by --stamp, which
+ * gives one way latency when clocks of sender and receiver are in sync, or
+ * corrected by their offset with --sync (see Clock sync).
+ * Sequence tracking keeps a 64 packets bitmap below next expected number,
+ * which tells duplicates from late (reordered) packets filling a gap.
+ */
+
+// Streams tracked by receiver, one per sender address and port
+#define MAXSTREAMS 512                 // default of --streams
+#define REPORT_STREAMS 64              // streams reported one by one, else top
+#define STREAM_TOP 10                  // streams of most packets in interval
+
+// Stream state besides counters, by slot of stream table
+struct stream {
+    struct sockaddr_in6 src;            // sender address and port
+    int used;                          // slot in use
+    uint64_t window;                   // bitmap of sequences seen below next
+    uint64_t dups;                     // duplicated packets
+    uint64_t late;                     // reordered packets filled gap
+    uint64_t first;                    // arrival time of first packet
+    int peer;                          // clock of sender host, -1 none
+    struct path path;                  // path change detection
+};
+
+// Counters updated per datagram, structure of arrays by slot of stream table
+struct counters {
+    uint64_t *pkts;                    // received packets
+    uint64_t *bytes;                   // received bytes
+    uint64_t *lost;                    // missing sequences
+    uint64_t *last;                    // arrival time of last packet
+    uint32_t *next;                    // next expected sequence number
+    uint64_t *ipkts;                   // packets at last report
+    uint64_t *ibytes;                  // bytes at last report
+    uint64_t *ilost;                   // lost at last report
+};
+
+struct rxstate {
+    struct param *pp;                  // common parameters
+    struct stream *stream;             // stream table, open addressing
+    struct counters cnt;               // counters of stream table
+    int slots;                         // size of stream table, power of two
+    int bits;                          // log2 of slots
+    int nstreams;                      // streams in use
+    uint64_t ilast;                    // arrival time of last packet at last report
+    uint64_t pkts;                     // all received packets
+    uint64_t bytes;                    // all received bytes
+    uint64_t undecoded;                // packets without sequence number
+    uint64_t overflow;                 // packets of streams beyond table
+    uint64_t first;                    // arrival time of first packet
+    uint64_t last;                     // arrival time of last packet
+    struct hist lat;                   // one way latency of stamped packets
+    uint64_t unsynced;                 // stamped packets before clock sync
+    struct burst *burst;               // microburst detector, NULL if off
+    struct police *police;             // receive policing, NULL if off
+    struct pmtu *pmtu;                 // path MTU probes, NULL if off
+    struct fanout fan;                 // sinks besides stats
+};
+
+// Zeroed array of stream table, exits if out of memory
+static void *rx_calloc(int n, size_t size) {
+    void *p = calloc(n, size);
+    if (! p) {
+        perror("Stream table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void rx_init(struct rxstate *rx, struct param *pp) {
+    memset(rx, 0, sizeof(*rx));
+    rx->pp = pp;
+    int want = pp->streams > 0 ? pp->streams : MAXSTREAMS;
+    for (rx->bits = 2; (1 << rx->bits) < 2 * want; rx->bits++) { }   // half full at most
+    rx->slots = 1 << rx->bits;
+    rx->stream = rx_calloc(rx->slots, sizeof(*rx->stream));
+    struct counters *c = &rx->cnt;
+    c->pkts = rx_calloc(rx->slots, sizeof(*c->pkts));
+    c->bytes = rx_calloc(rx->slots, sizeof(*c->bytes));
+    c->lost = rx_calloc(rx->slots, sizeof(*c->lost));
+    c->last = rx_calloc(rx->slots, sizeof(*c->last));
+    c->next = rx_calloc(rx->slots, sizeof(*c->next));
+    c->ipkts = rx_calloc(rx->slots, sizeof(*c->ipkts));
+    c->ibytes = rx_calloc(rx->slots, sizeof(*c->ibytes));
+    c->ilost = rx_calloc(rx->slots, sizeof(*c->ilost));
+    if (pp->burst > 0) {
+        rx->burst = malloc(sizeof(*rx->burst));
+        if (! rx->burst) {
+            perror("Burst detector allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        burst_init(rx->burst, pp->burst, pp->burstpps);
+    }
+    if (pp->police > 0) {
+        rx->police = malloc(sizeof(*rx->police));
+        if (! rx->police) {
+            perror("Police table allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        police_init(rx->police, pp->police, pp->policeburst);
+    }
+    if (pp->pmtuport > 0) {
+        rx->pmtu = malloc(sizeof(*rx->pmtu));
+        if (! rx->pmtu) {
+            perror("PMTU state allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        pmtu_init(rx->pmtu, pp->pmtuport);
+    }
+    fan_init(&rx->fan, pp);
+#ifdef SIMULATION
+    sim_rx_register(rx);
+#endif
+}
+
+void rx_exit(struct rxstate *rx) {
+    fan_exit(&rx->fan);
+    free(rx->burst);
+    free(rx->police);
+    if (rx->pmtu) { close(rx->pmtu->sock); }
+    free(rx->pmtu);
+    free(rx->stream);
+    struct counters *c = &rx->cnt;
+    free(c->pkts);
+    free(c->bytes);
+    free(c->lost);
+    free(c->last);
+    free(c->next);
+    free(c->ipkts);
+    free(c->ibytes);
+    free(c->ilost);
+}
+
+// Decode sequence number and send time (0 if absent) of message,
+// returns 0 if not from send_thread
+static inline int msg_decode(const char *buf, int len, uint32_t *seq,
+                                uint64_t *stamp) {
+    int i = 0, slash = 0;
+    while (i < len && slash < 2) {
+        if (buf[i++] == '/') { slash++; }
+    }
+    uint32_t v = 0;
+    int digits = 0;
+    while (i < len && buf[i] >= '0' && buf[i] <= '9') {
+        v = v * 10 + (buf[i++] - '0');
+        digits++;
+    }
+    if (slash < 2 || digits == 0) { return 0; }
+    *seq = v;
+    uint64_t t = 0;
+    if (i < len && buf[i] == '/') {
+        while (++i < len && buf[i] >= '0' && buf[i] <= '9') {
+            t = t * 10 + (buf[i] - '0');
+        }
+    }
+    *stamp = t;
+    return 1;
+}
+
+// Find or add stream of sender, its slot or -1 if table is full
+static inline int rx_stream(struct rxstate *rx, const struct sockaddr_in6 *src) {
+    uint32_t w[4];
+    memcpy(w, &src->sin6_addr, sizeof(w));
+    uint32_t h = (w[0] ^ w[1] ^ w[2] ^ w[3] ^ ((uint32_t)src->sin6_port << 16))
+                        * 0x9E3779B1U;
+    int i, n;
+    for (i = h >> (32 - rx->bits), n = 0; n < rx->slots; i = (i + 1) & (rx->slots - 1), n++) {
+        struct stream *s = &rx->stream[i];
+        if (! s->used) {
+            if (rx->nstreams >= rx->slots / 2) { break; }
+            s->used = 1;
+            s->src = *src;
+            rx->nstreams++;
+            return i;
+        }
+        if (memcmp(&s->src.sin6_addr, &src->sin6_addr, sizeof(src->sin6_addr)) == 0 &&
+                s->src.sin6_port == src->sin6_port) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Track sequence number, counting gaps, duplicates and reordering
+static inline void seq_track(struct stream *s, struct counters *c, int i, uint32_t seq) {
+    int32_t d = (int32_t)(seq - c->next[i]);
+    if (s->window == 0 || d >= 0) {
+        if (s->window != 0) { c->lost[i] += d; }
+        s->window = (s->window == 0 || d >= 63) ? 1 : (s->window << (d + 1)) | 1;
+        c->next[i] = seq + 1;
+        return;
+    }
+    uint32_t back = (uint32_t)(-d) - 1;             // bit of this sequence
+    if (back < 64 && (s->window & (1ULL << back))) {
+        s->dups++;
+        return;
+    }
+    s->late++;
+    if (back < 64) {
+        s->window |= 1ULL << back;
+        if (c->lost[i] > 0) { c->lost[i]--; }
+    }
+}
+
+// Print received message, non printable characters are shown as '.'
+void rx_print(const struct sockaddr_in6 *src, const char *buf, int len) {
+    char text[BUFSIZE];
+    int i, n = len < (int)sizeof(text) ? len : (int)sizeof(text);
+    for (i = 0; i < n; i++) {
+        text[i] = isprint((unsigned char)buf[i]) ? buf[i] : '.';
+    }
+
+    // Get sender's IP address and port
+    char sender_ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &src->sin6_addr,
+                        sender_ip, sizeof(sender_ip));
+    u_short sender_port = ntohs(src->sin6_port);
+
+    printf("Recv fm [%s]:%d = %.*s (%d)\n",
+        sender_ip, sender_port, n, text, len);
+}
+
+/*
+ * Process a received datagram
+ */
+void rx_process(struct rxstate *rx, const struct rxmsg *m) {
+    if (rx->police && ! police_pass(rx->police, m)) { return; }
+    if (rx->pmtu && m->len >= 5 && memcmp(m->buf, "pmtu/", 5) == 0) {
+        pmtu_seen(rx->pmtu, m);
+        return;
+    }
+    if (rx->pkts++ == 0) { rx->first = m->ts; }
+    rx->bytes += m->len;
+    rx->last = m->ts;
+    if (rx->burst) { burst_add(rx->burst, m->kts ? m->kts : m->ts, m->len); }
+
+    int i = rx_stream(rx, &m->src);
+    if (i >= 0) {
+        struct stream *s = &rx->stream[i];
+        struct counters *c = &rx->cnt;
+        if (c->pkts[i]++ == 0) {
+            s->first = m->ts;
+            s->peer = rx->pp->syncport ? clk_peer(&m->src) : -1;
+            path_init(&s->path);
+        }
+        c->bytes[i] += m->len;
+        c->last[i] = m->ts;
+        if (rx->pp->path) { path_ttl(&s->path, m->ttl, &m->src, c->pkts[i]); }
+        uint32_t seq;
+        uint64_t stamp;
+        if (msg_decode(m->buf, m->len, &seq, &stamp)) {
+            seq_track(s, c, i, seq);
+            int64_t lat = -1;
+            if (stamp > 0 && ! rx->pp->syncport) {
+                if (m->wall >= stamp) { lat = m->wall - stamp; }
+            } else if (stamp > 0) {
+                lat = clk_latency(s->peer, m->wall, stamp);
+                if (lat < 0) { rx->unsynced++; }
+            }
+            if (lat >= 0) {
+                hist_add(&rx->lat, lat);
+                if (rx->pp->path) { path_lat(&s->path, lat, &m->src, c->pkts[i]); }
+            }
+        } else {
+            rx->undecoded++;
+        }
+    } else {
+        rx->overflow++;
+    }
+
+    if (! rx->pp->quiet) { rx_print(&m->src, m->buf, m->len); }
+    if (rx->fan.nsinks > 0) { fan_out(&rx->fan, m); }
+}
+
+/*
+ * Interval aggregation
+ *
+ * Counters the hot path updates per datagram are kept apart from the rest
+ * of stream state, as arrays by slot (struct counters), so a report over
+ * tens of thousands of streams reads them sequentially.  One pass over the
+ * table takes STREAM_LANES slots at a time in vector registers (vector
+ * extension of the compiler, SSE or AVX on x86 and NEON on ARM as built):
+ * it sums interval deltas, counts active streams, saves counters as base
+ * of the next interval, and only looks at single slots when a lane beats
+ * the least packets of the top list.
+ */
+
+#define STREAM_LANES 4
+
+typedef uint64_t lanes __attribute__((vector_size(STREAM_LANES * sizeof(uint64_t))));
+
+struct interval {
+    uint64_t since;                    // arrival time of last packet at last report
+    uint64_t pkts;                     // packets in interval
+    uint64_t bytes;                    // bytes in interval
+    int64_t lost;                      // change of missing sequences
+    int active;                        // streams with packets in interval
+    int ntop;                          // streams in top list
+    int top[STREAM_TOP];               // slots of most packets in interval
+    uint64_t toppkts[STREAM_TOP];      // their packets in interval
+};
+
+// Insert slot into top list, kept in descending order of packets
+static void top_insert(struct interval *iv, int slot, uint64_t pkts) {
+    int i = iv->ntop < STREAM_TOP ? iv->ntop++ : STREAM_TOP - 1;
+    while (i > 0 && iv->toppkts[i - 1] < pkts) {
+        iv->top[i] = iv->top[i - 1];
+        iv->toppkts[i] = iv->toppkts[i - 1];
+        i--;
+    }
+    iv->top[i] = slot;
+    iv->toppkts[i] = pkts;
+}
+
+// Deltas and top streams since last call, which starts next interval
+void rx_interval(struct rxstate *rx, struct interval *iv) {
+    struct counters *c = &rx->cnt;
+    lanes pkts = { 0 }, bytes = { 0 }, lost = { 0 }, active = { 0 };
+    uint64_t least = 0;                             // packets to enter top list
+    int i, k;
+    memset(iv, 0, sizeof(*iv));
+    iv->since = rx->ilast ? rx->ilast : rx->first;
+    for (i = 0; i < rx->slots; i += STREAM_LANES) {
+        lanes p, b, l, ip, ib, il;
+        memcpy(&p, c->pkts + i, sizeof(p));
+        memcpy(&b, c->bytes + i, sizeof(b));
+        memcpy(&l, c->lost + i, sizeof(l));
+        memcpy(&ip, c->ipkts + i, sizeof(ip));
+        memcpy(&ib, c->ibytes + i, sizeof(ib));
+        memcpy(&il, c->ilost + i, sizeof(il));
+        lanes dp = p - ip;
+        pkts += dp;
+        bytes += b - ib;
+        lost += l - il;
+        active -= (lanes)(dp != 0);                 // true lanes are all ones
+        lanes hot = (lanes)(dp > least);
+        uint64_t any = 0;
+        for (k = 0; k < STREAM_LANES; k++) { any |= hot[k]; }
+        if (any) {
+            for (k = 0; k < STREAM_LANES; k++) {
+                if (dp[k] > least) {
+                    top_insert(iv, i + k, dp[k]);
+                    if (iv->ntop == STREAM_TOP) { least = iv->toppkts[STREAM_TOP - 1]; }
+                }
+            }
+        }
+        memcpy(c->ipkts + i, &p, sizeof(p));
+        memcpy(c->ibytes + i, &b, sizeof(b));
+        memcpy(c->ilost + i, &l, sizeof(l));
+    }
+    for (k = 0; k < STREAM_LANES; k++) {
+        iv->pkts += pkts[k];
+        iv->bytes += bytes[k];
+        iv->lost += (int64_t)lost[k];
+        iv->active += active[k];
+    }
+    rx->ilast = rx->last;
+}
+
+// Print counters of stream in slot, with extra text after address
+void rx_stream_print(struct rxstate *rx, int i, const char *extra) {
+    struct stream *s = &rx->stream[i];
+    struct counters *c = &rx->cnt;
+    char sender_ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &s->src.sin6_addr, sender_ip, sizeof(sender_ip));
+    printf("  fm [%s]:%d%s pkts %llu bytes %llu lost %llu dup %llu late %llu next %u\n",
+            sender_ip, ntohs(s->src.sin6_port), extra,
+            (unsigned long long)c->pkts[i], (unsigned long long)c->bytes[i],
+            (unsigned long long)c->lost[i], (unsigned long long)s->dups,
+            (unsigned long long)s->late, c->next[i]);
+    if (rx->pp->path) { path_report(&s->path); }
+}
+
+/*
+ * Report receiver stats per stream
+ */
+void rx_report(struct rxstate *rx) {
+    printf("Stats: %llu packets %llu bytes %d streams, %llu undecoded %llu overflow\n",
+                (unsigned long long)rx->pkts, (unsigned long long)rx->bytes,
+                rx->nstreams, (unsigned long long)rx->undecoded,
+                (unsigned long long)rx->overflow);
+    struct interval iv;
+    rx_interval(rx, &iv);
+    int i;
+    if (rx->nstreams <= REPORT_STREAMS) {
+        for (i = 0; i < rx->slots; i++) {
+            if (rx->stream[i].used) { rx_stream_print(rx, i, ""); }
+        }
+    } else {
+        double sec = (rx->last - iv.since) / 1e9;
+        printf("  interval %.1f s: %llu pkts %.0f pps %.1f Mbit/s lost %lld, %d of %d streams active\n",
+                sec, (unsigned long long)iv.pkts, sec > 0 ? iv.pkts / sec : 0.0,
+                sec > 0 ? iv.bytes * 8 / sec / 1e6 : 0.0, (long long)iv.lost,
+                iv.active, rx->nstreams);
+        for (i = 0; i < iv.ntop; i++) {
+            char rate[32];
+            snprintf(rate, sizeof(rate), " %.0f pps", sec > 0 ? iv.toppkts[i] / sec : 0.0);
+            rx_stream_print(rx, iv.top[i], rate);
+        }
+    }
+    hist_print("latency", &rx->lat);
+    if (rx->pp->syncport && (rx->lat.n > 0 || rx->unsynced > 0)) { clk_report(rx->unsynced); }
+    if (rx->burst) { burst_report(rx->burst); }
+    if (rx->police) {
+        struct police *pl = rx->police;
+        if (pl->next && pl->sock >= 0 && now_ns() >= pl->next) {
+            police_release(pl, now_ns());           // blocked sources are not seen
+        }
+        police_report(pl);
+    }
+    fan_report(&rx->fan);
+    fflush(stdout);
+}
+
+/*
+ * Stream table benchmark
+ *
+ * Mode streams feeds --streams senders (default STREAMS_BENCH) thru the
+ * receive pipeline in memory, STREAMS_ROUNDS packets each and ten times as
+ * many for every STREAMS_HOT-th sender, prints one interval report, then
+ * times the interval pass over counters and, for reference, a walk of the
+ * same stream table reading two counters of each stream struct.
+ */
+
+#define STREAMS_BENCH 100000           // default senders
+#define STREAMS_ROUNDS 10              // packets per sender
+#define STREAMS_HOT 1000               // every this sender sends ten times more
+#define STREAMS_REPS 20                // timed interval passes
+
+void streams_bench(struct param *pp) {
+    pp->quiet = 1;
+    struct rxstate rx;
+    rx_init(&rx, pp);
+    char msg[STREAMS_ROUNDS * 10][32];
+    int i, r, n = pp->streams;
+    for (i = 0; i < STREAMS_ROUNDS * 10; i++) { snprintf(msg[i], sizeof(msg[i]), "s/000000/%d", i); }
+
+    struct rxmsg m;
+    memset(&m, 0, sizeof(m));
+    m.ttl = -1;
+    m.src.sin6_family = AF_INET6;
+    m.src.sin6_addr.s6_addr[0] = 0xfd;
+    uint64_t pkts = 0, t0 = now_ns();
+    for (r = 0; r < STREAMS_ROUNDS; r++) {
+        for (i = 0; i < n; i++) {
+            m.src.sin6_addr.s6_addr32[3] = htonl(i / 1000 + 1);
+            m.src.sin6_port = htons(10000 + i % 1000);
+            int k, times = i % STREAMS_HOT == 0 ? 10 : 1;
+            for (k = 0; k < times; k++) {
+                m.buf = msg[r * times + k];
+                m.len = strlen(m.buf);
+                m.ts = m.wall = t0 + pkts * 1000;   // 1 Mpps
+                rx_process(&rx, &m);
+                pkts++;
+            }
+        }
+    }
+    uint64_t hot = now_ns() - t0;
+    rx_report(&rx);
+
+    struct interval iv;
+    t0 = now_ns();
+    for (r = 0; r < STREAMS_REPS; r++) { rx_interval(&rx, &iv); }
+    uint64_t pass = (now_ns() - t0) / STREAMS_REPS;
+    uint64_t sum = 0;
+    t0 = now_ns();
+    for (r = 0; r < STREAMS_REPS; r++) {
+        for (i = 0; i < rx.slots; i++) {
+            const struct stream *s = &rx.stream[i];
+            if (s->used) { sum += s->dups + s->late; }
+        }
+    }
+    uint64_t walk = (now_ns() - t0) / STREAMS_REPS;
+    __asm__ volatile ("" : : "r" (sum));          // keep walk
+
+    size_t cnt = 7 * sizeof(uint64_t) + sizeof(uint32_t);     // arrays of struct counters
+    printf("Streams %d in %d slots: counters %zu bytes, stream state %zu bytes per slot,"
+                " %.0f bytes per stream\n", rx.nstreams, rx.slots, cnt, sizeof(struct stream),
+                rx.nstreams ? (double)rx.slots * (cnt + sizeof(struct stream)) / rx.nstreams : 0.0);
+    printf("Hot path %.1f ns per packet, %llu packets\n", (double)hot / pkts, (unsigned long long)pkts);
+    printf("Interval pass %.3f ms, %.2f ns per stream (walk of stream structs %.3f ms)\n",
+                pass / 1e6, rx.nstreams ? (double)pass / rx.nstreams : 0.0, walk / 1e6);
+    rx_exit(&rx);
+}
+
+/*
+ * UDP-Lite
+ *
+ * With --udplite cov, sockets of sender and receiver threads, so of modes
+ * send, recv, both, compare and load, are UDP-Lite (RFC 3828) instead of
+ * UDP.  Its checksum covers the first cov bytes of a datagram, 8 for the
+ * header only or 0 for all, so that large payload with a few bit errors is
+ * still delivered rather than dropped, and payload is not summed in
+ * software where the NIC would not offload it.  Receivers drop datagrams
+ * covered less than cov.  Packet engine and pcap input take UDP-Lite too.
+ * Mode compare with --udplite runs each engine over UDP and then UDP-Lite,
+ * showing CPU per packet of both at --size.  Over loopback UDP is never
+ * summed, so only the cost of UDP-Lite shows there, while on an interface
+ * with jumbo frames --size up to its MTU less headers, 8952 bytes for MTU
+ * 9000, shows what coverage saves where payload is large.
+ */
+
+#ifndef UDPLITE_SEND_CSCOV
+#define UDPLITE_SEND_CSCOV 10          // from linux/udp.h
+#define UDPLITE_RECV_CSCOV 11
+#endif
+
+// Datagram socket of sender or receiver, UDP-Lite with coverage if asked
+int udp_socket(struct param *pp, int rx) {
+    int sock = socket(AF_INET6, SOCK_DGRAM, pp->lite ? IPPROTO_UDPLITE : 0);
+    if (sock >= 0 && pp->lite && setsockopt(sock, IPPROTO_UDPLITE,
+            rx ? UDPLITE_RECV_CSCOV : UDPLITE_SEND_CSCOV, &pp->cscov, sizeof(pp->cscov)) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Compare engines
+ *
+ * Sends the same workload, count stamped datagrams at rate, from a sender
+ * to a receiver thread on this host over multicast loopback thru each engine
+ * in turn, and tabulates rate, CPU per packet and latency side by side.
+ * Engines the host cannot run are shown as n/a with the reason.  Packet
+ * engine receives only, and its sender uses plain.  Latency counts from the
+ * time a datagram was due, so that it includes pacing error of the sender,
+ * and CPU of kernel threads polling for sqpoll is shown apart.
+ */
+
+#define COMPARE_RATE 50000             // default packets per second
+#define COMPARE_COUNT 100000           // default packets per engine
+#define COMPARE_IDLE 200               // ms without packets ending a run
+
+struct result {
+    const char *engine;                // engine name
+    int lite;                          // over UDP-Lite
+    int err;                           // errno if engine unavailable
+    int rxready;                       // receiver joined, sender may start
+    int txdone;                        // sender finished
+    int idle;                          // ms without packets ending a run
+    uint64_t txpkts;                   // packets sent
+    uint64_t txns;                     // sending time
+    uint64_t txcpu;                    // sender CPU time
+    uint64_t rxpkts;                   // packets received
+    uint64_t rxns;                     // first to last arrival
+    uint64_t rxcpu;                    // receiver CPU time
+    uint64_t txsq;                     // sender kernel polling thread CPU time
+    uint64_t rxsq;                     // receiver kernel polling thread CPU time
+    struct hist lat;                   // one way latency
+    struct hist txqdisc;               // sender app to qdisc, with txstamp
+    struct hist txdriver;              // sender qdisc to driver, with txstamp
+};
+
+/*
+ * Receiver socket bound to port and joined to group
+ */
+int recv_socket(struct param *pp) {
+    int sock;
+
+    // Create socket
+    sock = udp_socket(pp, 1);
+    if (sock < 0) {
+        perror("Socket creation failed (receiver)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Enable SO_REUSEADDR to share port with other applications
+    int reuse = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt(SO_REUSEADDR) failed (receiver)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Kernel receive stamps for microburst detector
+    int stamp = 1;
+    if (pp->burst > 0 && setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &stamp, sizeof(stamp)) < 0) {
+        perror("setsockopt(SO_TIMESTAMPNS) failed (receiver)");
+        exit(EXIT_FAILURE);
+    }
+    // Hop limit of datagrams for path change detection
+    if (pp->path && setsockopt(sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &stamp, sizeof(stamp)) < 0) {
+        perror("setsockopt(IPV6_RECVHOPLIMIT) failed (receiver)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind to local port
+    struct sockaddr_in6 local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin6_family = AF_INET6;
+    local_addr.sin6_addr = in6addr_any;                    // ipv6 magic!!!
+    local_addr.sin6_port = pp->port;                       // upd-port-number
+
+    if (bind(sock, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+        perror("Bind failed (receiver)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Join multicast group with any source multicast (ASM)
+    if (pp->ssm == 0) {
+        struct ipv6_mreq mreq;
+        mreq.ipv6mr_multiaddr = pp->mip;                   // multicast-group
+        mreq.ipv6mr_interface = pp->ifidx;                 // local interface
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+                            &mreq, sizeof(mreq)) < 0) {
+            perror("setsockopt(IPV6_JOIN_GROUP) failed");
+            exit(EXIT_FAILURE);
+        }
+        char ipaddr[INET6_ADDRSTRLEN];
+        if (! pp->res) {
+            printf("Joined ASM [%s]:%d via interface index %d (%s)\n", 
+                        inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)), 
+                        ntohs(pp->port),
+                        pp->ifidx, pp->ifname);
+        }
+    }
+
+#ifndef NOSSM
+    // Join multicast group with source specific multicast (SSM)
+    if (pp->ssm == 1) {
+        if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE,
+                                pp->ifname, strlen(pp->ifname)) < 0) {
+            perror("setsockopt(SO_BINDTODEVICE) failed");
+            exit(EXIT_FAILURE);
+        }
+        struct group_source_req mreq;
+        memset(&mreq, 0, sizeof(mreq));
+
+        struct sockaddr_in6 gaddr;
+        memset(&gaddr, 0, sizeof(gaddr));
+        gaddr.sin6_family = AF_INET6;
+        gaddr.sin6_addr = pp->mip;
+        memcpy(&mreq.gsr_group, &gaddr, sizeof(gaddr));              // multicast-group
+
+        struct sockaddr_in6 saddr;
+        memset(&saddr, 0, sizeof(saddr));
+        saddr.sin6_family = AF_INET6;
+        saddr.sin6_addr = pp->sip;
+        memcpy(&mreq.gsr_source, &saddr, sizeof(saddr));             // sender-address
+
+        mreq.gsr_interface = pp->ifidx;                              // local interface
+        if (setsockopt(sock, IPPROTO_IPV6, MCAST_JOIN_SOURCE_GROUP,
+                                &mreq, sizeof(mreq)) < 0) {
+            perror("setsockopt(MCAST_JOIN_SOURCE_GROUP) failed");
+            exit(EXIT_FAILURE);
+        }
+        char ipaddr[INET6_ADDRSTRLEN];
+        if (! pp->res) {
+            printf("Joined SSM [%s]:%d ", 
+                        inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)),
+                        ntohs(pp->port));
+            printf("from %s via interface %d (%s)\n", 
+                        inet_ntop(AF_INET6, &pp->sip, ipaddr, sizeof(ipaddr)),
+                        pp->ifidx, pp->ifname);
+        }
+    }
+#endif
+
+    return sock;
+}
+
+void ns_publish(struct nshost *h, const struct rxstate *rx);  // see Network namespaces
+
+/*
+ * Receiver Thread
+ */
+void *recv_thread(void *args) {
+    struct param *pp = args;
+    int sock = recv_socket(pp);
+
+    // Open engine, waking up at stats interval even when nothing is received
+    int timeout = pp->stats > 0 ? (int)(pp->stats * 1000 + 0.999) : 0;
+    if (pp->res) { timeout = pp->res->idle; }
+    struct eng eng;
+    if (eng_open(&eng, pp->engine, pp, sock, NULL, timeout) < 0) {
+        perror("Engine setup failed (receiver)");
+        exit(EXIT_FAILURE);
+    }
+
+    struct rxstate rx;
+    rx_init(&rx, pp);
+    if (rx.police) { rx.police->sock = eng_rxsock(&eng); }
+    uint64_t report = now_ns() + (uint64_t)(pp->stats * NSEC);
+    uint64_t cpu0 = cpu_ns();
+    if (pp->res) { __atomic_store_n(&pp->res->rxready, 1, __ATOMIC_RELEASE); }
+
+    // Receive multicast messages
+    while (1) {
+        int i, n = eng.ops->recv(&eng);
+        if (n < 0) { perror("Receive failed"); }
+        for (i = 0; i < n; i++) {
+            rx_process(&rx, &eng.rx[i]);
+        }
+
+        uint64_t now = now_ns();
+        if (pp->stats > 0 && now >= report) {
+            if (pp->nsh) {                      // summed by ns_report()
+                ns_publish(pp->nsh, &rx);
+            } else {
+                rx_report(&rx);
+            }
+            report = now + (uint64_t)(pp->stats * NSEC);
+        }
+
+        // Compare run ends when sender finished and all or nothing more arrived
+        if (pp->res && __atomic_load_n(&pp->res->txdone, __ATOMIC_ACQUIRE) &&
+                (n <= 0 || rx.pkts >= pp->res->txpkts)) {
+            break;
+        }
+    }
+
+    eng_close(&eng);
+    if (pp->res) {
+        pp->res->rxpkts = rx.pkts;
+        pp->res->rxns = rx.last - rx.first;
+        pp->res->rxcpu = cpu_ns() - cpu0;
+        pp->res->rxsq = eng.sqcpu;
+        pp->res->lat = rx.lat;
+    }
+    rx_exit(&rx);
+    close(sock);
+    return 0;
+}
+
+/*
+ * Multi-group receive scheduling
+ *
+ * With --group, one receiver thread serves the group of command line and
+ * more groups, each on its own non-blocking socket and engine, so that a
+ * bulk group cannot starve a latency critical one in the same loop.  Each
+ * group has a priority class, 0 first, and a quantum in packets:
+ *
+ *   - the highest class with a readable group is always served next
+ *   - groups of one class take turns by deficit round robin, receiving
+ *     up to quantum packets (plus deficit left from last turn) per turn
+ *     in batches of at most quantum, then readiness is polled again
+ *
+ * So critical groups are drained first and a bulk group is never served
+ * longer than its quantum before critical ones are looked at.  Latency of
+ * stamped messages is reported per class.  Socket engines only.
+ */
+
+#define NCLASSES 4                     // priority classes, 0 first
+#define QUANTUM 64                     // default packets per turn
+
+struct rxgroup {
+    struct param p;                    // parameters with group and port
+    int cls;                           // priority class
+    int quantum;                       // packets per turn
+    int deficit;                       // packets allowed this turn
+    int ready;                         // may have packets queued
+    int sock;
+    struct eng eng;
+    struct rxstate rx;
+    struct pbuf **wq;                  // datagrams for worker pool, ring
+    uint64_t whead;                    // next to process, by worker
+    uint64_t wtail;                    // next to queue, by receiver
+    int queued;                        // in a deque or running on a worker
+    int home;                          // worker whose deque takes group
+    uint64_t wdrops;                   // no buffer or queue full
+    uint64_t wtrunc;                   // cut to pool buffer size
+    pthread_mutex_t lock;              // rx, between worker and report
+};
+
+// Parse --group [mip]:port[:class[:quantum]], returns 0 if malformed
+int grp_parse(const char *arg, struct group *g) {
+    char host[INET6_ADDRSTRLEN];
+    int port, cls = 1, quantum = QUANTUM;
+    if (sscanf(arg, "[%45[^]]]:%d:%d:%d", host, &port, &cls, &quantum) < 2 ||
+            inet_pton(AF_INET6, host, &g->mip) != 1) { return 0; }
+    g->port = htons(port);
+    g->cls = cls;
+    g->quantum = quantum;
+    return port > 0 && port < 65536 && cls >= 0 && cls < NCLASSES && quantum > 0;
+}
+
+// Highest class with a ready group, -1 if none
+static inline int grp_class(struct rxgroup *g, int n) {
+    int i, c = NCLASSES;
+    for (i = 0; i < n; i++) {
+        if (g[i].ready && g[i].cls < c) { c = g[i].cls; }
+    }
+    return c < NCLASSES ? c : -1;
+}
+
+// Mark groups readable
+static inline void grp_poll(struct rxgroup *g, int ep, struct epoll_event *ev,
+                                int n, int timeout) {
+    int i, nev = epoll_wait(ep, ev, n, timeout);
+    for (i = 0; i < nev; i++) { g[ev[i].data.u32].ready = 1; }
+}
+
+/*
+ * Worker pool
+ *
+ * With --workers n, receiver thread of groups only moves datagrams: each
+ * is copied into a pool buffer and queued to its group, and the group is
+ * handed to a worker when it becomes runnable.  Workers run the receive
+ * pipeline, plus --work us of emulated decode cost per datagram, so that
+ * expensive processing of uneven groups spreads over cores:
+ *
+ *   - a runnable group is pushed to bottom of the deque of its home worker
+ *   - a worker takes groups from top of own deque, and when that is empty
+ *     steals from bottom of deques of other workers
+ *   - a group is in at most one deque or on one worker at a time, so that
+ *     datagrams of a group are processed in order, one at a time
+ *   - a group runs up to its quantum, then goes back to bottom of deque
+ *
+ * Idle workers sleep at most 1 ms.  A worker holds the lock of a group
+ * while it runs the group, and stats of the group are taken under the same
+ * lock, so that reports never see the receive pipeline halfway.  Stats
+ * show per worker utilization, groups run and steals since last report.
+ */
+
+#define MAXWORKERS 64
+#define WORKQ 4096                     // datagrams queued per group
+
+struct worker {
+    struct wpool *wp;
+    int id;
+    int *dq;                           // deque of group indices, ring
+    uint64_t top;                      // next to take, by owner
+    uint64_t bottom;                   // next to push, thieves take below
+    pthread_mutex_t lock;              // deque
+    uint64_t busy;                     // ns running groups
+    uint64_t runs;                     // groups run
+    uint64_t steals;                   // groups stolen from other workers
+    uint64_t pkts;                     // datagrams processed
+    uint64_t last[4];                  // busy, runs, steals, pkts at last report
+    pthread_t thread;
+};
+
+struct wpool {
+    struct rxgroup *g;                 // groups
+    int ngroups;
+    struct worker *w;                  // workers
+    int nworkers;
+    struct pool pool;                  // datagram buffers
+    double work;                       // emulated cost per datagram in us
+    int sleeping;                      // workers waiting on cond
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t last;                     // time of last report
+};
+
+static inline void wp_push(struct worker *w, int i) {
+    pthread_mutex_lock(&w->lock);
+    w->dq[w->bottom++ % w->wp->ngroups] = i;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Take group from top of own deque, or from bottom of other deque, -1 if none
+static inline int wp_take(struct worker *w, int steal) {
+    int i = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->top != w->bottom) {
+        i = steal ? w->dq[--w->bottom % w->wp->ngroups] : w->dq[w->top++ % w->wp->ngroups];
+    }
+    pthread_mutex_unlock(&w->lock);
+    return i;
+}
+
+// Queue datagram to group, and make group runnable unless it is already
+void wp_submit(struct wpool *wp, int i, const struct rxmsg *m) {
+    struct rxgroup *q = &wp->g[i];
+    uint64_t t = q->wtail;
+    struct pbuf *b;
+    if (t - __atomic_load_n(&q->whead, __ATOMIC_ACQUIRE) >= WORKQ ||
+            ! (b = pbuf_get(&wp->pool))) {
+        q->wdrops++;
+        return;
+    }
+    if (pbuf_fill(&wp->pool, b, m)) { q->wtrunc++; }
+    b->refs = 1;
+    q->wq[t % WORKQ] = b;
+    __atomic_store_n(&q->wtail, t + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&q->queued, 1, __ATOMIC_SEQ_CST)) { return; }
+    wp_push(&wp->w[q->home], i);
+    if (__atomic_load_n(&wp->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&wp->lock);
+        pthread_cond_signal(&wp->cond);
+        pthread_mutex_unlock(&wp->lock);
+    }
+}
+
+void *worker_thread(void *args) {
+    struct worker *w = args;
+    struct wpool *wp = w->wp;
+    while (1) {
+        int j, i = wp_take(w, 0);
+        for (j = 1; i < 0 && j < wp->nworkers; j++) {
+            i = wp_take(&wp->w[(w->id + j) % wp->nworkers], 1);
+            if (i >= 0) { __atomic_fetch_add(&w->steals, 1, __ATOMIC_RELAXED); }
+        }
+        if (i < 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 1000000;
+            if (ts.tv_nsec >= (long)NSEC) { ts.tv_sec++; ts.tv_nsec -= NSEC; }
+            pthread_mutex_lock(&wp->lock);
+            __atomic_add_fetch(&wp->sleeping, 1, __ATOMIC_SEQ_CST);
+            pthread_cond_timedwait(&wp->cond, &wp->lock, &ts);
+            __atomic_sub_fetch(&wp->sleeping, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&wp->lock);
+            continue;
+        }
+
+        // Run group up to its quantum
+        struct rxgroup *q = &wp->g[i];
+        uint64_t start = now_ns();
+        int k;
+        pthread_mutex_lock(&q->lock);
+        for (k = 0; k < q->quantum; k++) {
+            uint64_t h = q->whead;
+            if (h == __atomic_load_n(&q->wtail, __ATOMIC_ACQUIRE)) { break; }
+            struct pbuf *b = q->wq[h % WORKQ];
+            rx_process(&q->rx, &b->m);
+            if (wp->work > 0) {                     // emulated decode
+                uint64_t end = now_ns() + (uint64_t)(wp->work * 1000);
+                while (now_ns() < end) { }
+            }
+            __atomic_store_n(&q->whead, h + 1, __ATOMIC_RELEASE);
+            pbuf_put(&wp->pool, b);
+        }
+        pthread_mutex_unlock(&q->lock);
+        __atomic_fetch_add(&w->busy, now_ns() - start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->runs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->pkts, k, __ATOMIC_RELAXED);
+
+        // Yield with datagrams left, or let receiver make group runnable again
+        if (q->whead != __atomic_load_n(&q->wtail, __ATOMIC_ACQUIRE)) {
+            wp_push(w, i);
+            continue;
+        }
+        __atomic_store_n(&q->queued, 0, __ATOMIC_SEQ_CST);
+        if (q->whead != __atomic_load_n(&q->wtail, __ATOMIC_SEQ_CST) &&
+                ! __atomic_exchange_n(&q->queued, 1, __ATOMIC_SEQ_CST)) {
+            wp_push(w, i);
+        }
+    }
+    return NULL;
+}
+
+struct wpool *wp_start(struct rxgroup *g, int n, struct param *pp) {
+    struct wpool *wp = calloc(1, sizeof(*wp));
+    if (! wp) {
+        perror("Worker pool allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    wp->g = g;
+    wp->ngroups = n;
+    wp->nworkers = pp->workers;
+    wp->work = pp->work;
+    wp->w = calloc(wp->nworkers, sizeof(*wp->w));
+    if (! wp->w) {
+        perror("Worker pool allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    pool_init(&wp->pool, pp->size > BUFSIZE ? pp->size : BUFSIZE);
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->cond, NULL);
+    wp->last = now_ns();
+
+    int i;
+    for (i = 0; i < n; i++) {
+        g[i].wq = calloc(WORKQ, sizeof(*g[i].wq));
+        g[i].home = i % wp->nworkers;
+        if (! g[i].wq) {
+            perror("Group queue allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < wp->nworkers; i++) {
+        struct worker *w = &wp->w[i];
+        w->wp = wp;
+        w->id = i;
+        w->dq = calloc(n, sizeof(*w->dq));
+        if (! w->dq) {
+            perror("Worker deque allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    for (i = 0; i < wp->nworkers; i++) {            // all deques set for thieves
+        pthread_create(&wp->w[i].thread, NULL, worker_thread, &wp->w[i]);
+    }
+    return wp;
+}
+
+void wp_report(struct wpool *wp) {
+    uint64_t now = now_ns(), ns = now - wp->last;
+    int i, k;
+    for (i = 0; i < wp->nworkers; i++) {
+        struct worker *w = &wp->w[i];
+        uint64_t v[4] = { __atomic_load_n(&w->busy, __ATOMIC_RELAXED),
+                          __atomic_load_n(&w->runs, __ATOMIC_RELAXED),
+                          __atomic_load_n(&w->steals, __ATOMIC_RELAXED),
+                          __atomic_load_n(&w->pkts, __ATOMIC_RELAXED) };
+        printf("Worker %d: util %.1f%% runs %llu steals %llu packets %llu\n", i,
+                ns ? 100.0 * (v[0] - w->last[0]) / ns : 0.0,
+                (unsigned long long)(v[1] - w->last[1]),
+                (unsigned long long)(v[2] - w->last[2]),
+                (unsigned long long)(v[3] - w->last[3]));
+        for (k = 0; k < 4; k++) { w->last[k] = v[k]; }
+    }
+    wp->last = now;
+}
+
+/*
+ * Receiver Thread of several groups
+ */
+void grp_report(struct rxgroup *g, int n, struct wpool *wp) {
+    int i, c;
+    for (i = 0; i < n; i++) {
+        char ipaddr[INET6_ADDRSTRLEN];
+        printf("Group [%s]:%d class %d quantum %d\n",
+                inet_ntop(AF_INET6, &g[i].p.mip, ipaddr, sizeof(ipaddr)),
+                ntohs(g[i].p.port), g[i].cls, g[i].quantum);
+        pthread_mutex_lock(&g[i].lock);
+        rx_report(&g[i].rx);
+        pthread_mutex_unlock(&g[i].lock);
+        if (wp) {
+            printf("  worker queue dropped %llu truncated %llu\n",
+                    (unsigned long long)g[i].wdrops, (unsigned long long)g[i].wtrunc);
+        }
+    }
+    for (c = 0; c < NCLASSES; c++) {
+        struct hist lat;
+        uint64_t pkts = 0;
+        int groups = 0;
+        memset(&lat, 0, sizeof(lat));
+        for (i = 0; i < n; i++) {
+            if (g[i].cls != c) { continue; }
+            pthread_mutex_lock(&g[i].lock);
+            hist_merge(&lat, &g[i].rx.lat);
+            pkts += g[i].rx.pkts;
+            pthread_mutex_unlock(&g[i].lock);
+            groups++;
+        }
+        if (groups == 0) { continue; }
+        printf("Class %d: %d groups %llu packets\n", c, groups, (unsigned long long)pkts);
+        hist_print("latency", &lat);
+        if (lat.n > 0 && g[0].p.syncport) {
+            printf("  sync bound +-%.1f us\n", clk_bound() / 1e3);
+        }
+    }
+    if (wp) { wp_report(wp); }
+    fflush(stdout);
+}
+
+void *group_thread(void *args) {
+    struct param *pp = args;
+    int i, n = pp->ngroups + 1;
+    struct rxgroup *g = calloc(n, sizeof(*g));
+    struct epoll_event *ev = calloc(n, sizeof(*ev));
+    int ep = epoll_create1(0);
+    if (! g || ! ev || ep < 0) {
+        perror("Group receiver setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Groups are polled by socket, engines of their own rings fall back to mmsg
+    const struct engops *ops = pp->engine;
+    if (strcmp(ops->name, "plain") != 0 && strcmp(ops->name, "mmsg") != 0) {
+        ops = eng_find("mmsg");
+    }
+
+    for (i = 0; i < n; i++) {
+        struct rxgroup *q = &g[i];
+        q->p = *pp;
+        q->cls = 0;                                 // group of command line
+        q->quantum = QUANTUM;
+        if (i > 0) {
+            q->p.mip = pp->group[i - 1].mip;
+            q->p.port = pp->group[i - 1].port;
+            q->cls = pp->group[i - 1].cls;
+            q->quantum = pp->group[i - 1].quantum;
+        }
+        int batch = pp->batch > 0 ? pp->batch : ENGBATCH;
+        q->p.batch = batch < q->quantum ? batch : q->quantum;  // bounded batch
+        q->sock = recv_socket(&q->p);
+        if (fcntl(q->sock, F_SETFL, fcntl(q->sock, F_GETFL) | O_NONBLOCK) < 0 ||
+                eng_open(&q->eng, ops, &q->p, q->sock, NULL, 0) < 0) {
+            perror("Engine setup failed (receiver)");
+            exit(EXIT_FAILURE);
+        }
+        rx_init(&q->rx, &q->p);
+        if (q->rx.police) { q->rx.police->sock = eng_rxsock(&q->eng); }
+        pthread_mutex_init(&q->lock, NULL);
+
+        struct epoll_event e;
+        memset(&e, 0, sizeof(e));
+        e.events = EPOLLIN;
+        e.data.u32 = i;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, q->sock, &e) < 0) {
+            perror("epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct wpool *wp = pp->workers > 0 ? wp_start(g, n, pp) : NULL;
+    int timeout = pp->stats > 0 ? (int)(pp->stats * 1000 + 0.999) : -1;
+    uint64_t report = now_ns() + (uint64_t)(pp->stats * NSEC);
+    int rr[NCLASSES];                               // round robin per class
+    memset(rr, 0, sizeof(rr));
+    while (1) {
+        grp_poll(g, ep, ev, n, timeout);
+
+        int c;
+        while ((c = grp_class(g, n)) >= 0) {
+            int j = rr[c];
+            while (! g[j].ready || g[j].cls != c) { j = (j + 1) % n; }
+            rr[c] = (j + 1) % n;
+
+            struct rxgroup *q = &g[j];
+            q->deficit += q->quantum;
+            while (q->deficit > 0) {
+                int k, m = q->eng.ops->recv(&q->eng);
+                if (m <= 0) {                       // drained
+                    if (m < 0) { perror("Receive failed"); }
+                    q->ready = 0;
+                    q->deficit = 0;
+                    break;
+                }
+                for (k = 0; k < m; k++) {
+                    if (wp) {
+                        wp_submit(wp, j, &q->eng.rx[k]);
+                    } else {
+                        rx_process(&q->rx, &q->eng.rx[k]);
+                    }
+                }
+                q->deficit -= m;
+            }
+            grp_poll(g, ep, ev, n, 0);
+        }
+
+        uint64_t now = now_ns();
+        if (pp->stats > 0 && now >= report) {
+            grp_report(g, n, wp);
+            report = now + (uint64_t)(pp->stats * NSEC);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Traffic patterns
+ *
+ * Real publishers are bursty, so instead of the regular gaps of --rate
+ * the sender may follow a pattern given by --pattern, still paced at the
+ * absolute due time of each packet (by the kernel with sqpoll engine):
+ *
+ *   onoff,n,ms          bursts of n packets at --rate, ms idle between bursts
+ *   poisson             exponential gaps of mean 1/--rate, drawn from --seed
+ *   diurnal,sec[,pct]   rate ramps from pct (default 10) percent of --rate up
+ *                       to --rate and back down over sec seconds, repeating
+ *   trace,file          gaps in us from first column of each line of a CSV
+ *                       file, other lines skipped, repeating
+ *
+ * Gap after each packet is computed from the due time of the packet, so
+ * patterns do not drift by the time taken to send.
+ */
+
+// Natural logarithm of x > 0, without libm
+static double pat_ln(double x) {
+    int e = 0;
+    while (x >= 2) { x /= 2; e++; }
+    while (x < 1) { x *= 2; e--; }
+    double z = (x - 1) / (x + 1), z2 = z * z, term = z, sum = 0;
+    int k;
+    for (k = 1; k < 40 && term > 1e-17; k += 2) {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + e * 0.69314718055994531;
+}
+
+// Gaps of trace file in ns, exits on errors of file
+int pat_trace(struct pattern *pt, const char *file) {
+    FILE *f = fopen(file, "r");
+    if (! f) {
+        perror("Trace open failed");
+        exit(EXIT_FAILURE);
+    }
+    char line[256];
+    int cap = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *end;
+        double us = strtod(line, &end);
+        if (end == line || (*end != ',' && ! isspace((unsigned char)*end))) { continue; }
+        if (us < 0) { break; }
+        if (pt->ngaps == cap) {
+            cap = cap ? cap * 2 : 1024;
+            pt->gaps = realloc(pt->gaps, cap * sizeof(*pt->gaps));
+            if (! pt->gaps) {
+                perror("Trace allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        pt->gaps[pt->ngaps++] = (uint64_t)(us * 1e3);
+    }
+    int bad = ferror(f) || ! feof(f);
+    fclose(f);
+    return ! bad && pt->ngaps > 0;
+}
+
+// Pattern of --pattern, 0 if malformed
+int pat_parse(const char *arg, struct pattern *pt) {
+    memset(pt, 0, sizeof(*pt));
+    pt->low = 10;
+    if (sscanf(arg, "onoff,%d,%lf", &pt->burst, &pt->gap) == 2) {
+        pt->kind = PAT_ONOFF;
+        return pt->burst > 0 && pt->gap >= 0;
+    }
+    if (strcmp(arg, "poisson") == 0) {
+        pt->kind = PAT_POISSON;
+        return 1;
+    }
+    if (sscanf(arg, "diurnal,%lf,%lf", &pt->period, &pt->low) >= 1) {
+        pt->kind = PAT_DIURNAL;
+        return pt->period > 0 && pt->low > 0 && pt->low <= 100;
+    }
+    if (strncmp(arg, "trace,", 6) == 0) {
+        pt->kind = PAT_TRACE;
+        return pat_trace(pt, arg + 6);
+    }
+    return 0;
+}
+
+struct patstate {
+    const struct pattern *cfg;         // pattern, kind PAT_NONE for regular
+    uint64_t interval;                 // ns between packets at --rate
+    uint64_t start;                    // due time of first packet
+    uint64_t rng;                      // poisson generator
+    uint64_t n;                        // packets sent
+};
+
+void pat_init(struct patstate *ps, const struct param *pp, uint64_t interval, uint64_t start) {
+    memset(ps, 0, sizeof(*ps));
+    ps->cfg = &pp->pat;
+    ps->interval = interval;
+    ps->start = start;
+    rng_seed(&ps->rng, pp->imp.seed + 1);          // apart from impairments
+}
+
+// Due time of packet after the one due at next
+static inline uint64_t pat_next(struct patstate *ps, uint64_t next) {
+    const struct pattern *pt = ps->cfg;
+    uint64_t n = ps->n++;
+    switch (pt->kind) {
+    case PAT_ONOFF:
+        return next + ((n + 1) % pt->burst ? ps->interval : (uint64_t)(pt->gap * 1e6));
+    case PAT_POISSON:
+        return next + (uint64_t)(-pat_ln(1 - rng_unit(&ps->rng)) * ps->interval);
+    case PAT_DIURNAL: {
+        uint64_t period = (uint64_t)(pt->period * NSEC);
+        double x = (double)((next - ps->start) % period) / period;
+        double ramp = x < 0.5 ? 2 * x : 2 - 2 * x;
+        double frac = pt->low / 100 + (1 - pt->low / 100) * ramp;
+        return next + (uint64_t)(ps->interval / frac);
+    }
+    case PAT_TRACE:
+        return next + pt->gaps[n % pt->ngaps];
+    default:
+        return next + ps->interval;
+    }
+}
+
+/*
+ * Sender threads
+ *
+ * One sender thread on one socket caps generation at one core, and threads
+ * sharing a socket contend on its lock.  With --send-threads n, n sender
+ * threads run, each on its own socket, so with its own source port and thus
+ * a stream of its own sequence at receivers, and each pinned to next CPU
+ * this process may run on.  Threads share the aggregate --rate thru a token
+ * bucket kept in virtual time, where taking a token is one compare and swap
+ * and up to TBURST tokens are saved while idle.  --count is divided among
+ * threads.  Per thread and aggregate rate are reported at --stats interval
+ * and at the end.
+ */
+
+#define TBURST 8                       // tokens saved while idle
+
+// Token bucket shared by sender threads
+struct bucket {
+    uint64_t tat;                      // time next token falls due
+    uint64_t interval;                 // ns per token
+    uint64_t depth;                    // ns of saved tokens
+};
+
+// Sender thread progress
+struct txstat {
+    int cpu;                           // pinned CPU
+    uint64_t sent;                     // packets sent
+    uint64_t ns;                       // first to last send
+    int done;                          // thread finished
+};
+
+// Take a token, returns time it may be spent
+static inline uint64_t tb_take(struct bucket *b, uint64_t now) {
+    uint64_t cur = __atomic_load_n(&b->tat, __ATOMIC_RELAXED), at;
+    do {
+        at = cur + b->depth > now ? cur : now - b->depth;
+    } while (! __atomic_compare_exchange_n(&b->tat, &cur, at + b->interval, 1,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return at;
+}
+
+void tx_report(struct param *p, int n, double rate) {
+    uint64_t sent = 0, ns = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        struct txstat *ts = p[i].txs;
+        uint64_t s = __atomic_load_n(&ts->sent, __ATOMIC_RELAXED);
+        uint64_t t = __atomic_load_n(&ts->ns, __ATOMIC_RELAXED);
+        printf("Sender %d: cpu %d %llu packets %.0f pps\n", i, ts->cpu,
+                (unsigned long long)s, t ? s * 1e9 / t : 0.0);
+        sent += s;
+        if (t > ns) { ns = t; }
+    }
+    printf("Senders: %d threads %llu packets %.0f pps of %.0f\n", n,
+                (unsigned long long)sent, ns ? sent * 1e9 / ns : 0.0, rate);
+    fflush(stdout);
+}
+
+/*
+ * Sender Thread
+ */
+void *send_thread(void *args) {
+    struct param *pp = args;
+
+    int sock;
+    char fixstr[] = "0.....";
+
+    // Create socket
+    sock = udp_socket(pp, 0);
+    if (sock < 0) {
+        perror("Socket creation failed (sender)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind local interface
+    struct sockaddr_in6 local_bind; 
+    memset(&local_bind, 0, sizeof(local_bind));
+    local_bind.sin6_family = AF_INET6;
+    //local_bind.sin6_addr = in6addr_any;
+    local_bind.sin6_addr = pp->sip;                       // src address
+
+    // Set source port number when bidir mode
+    if (pp->bidir == 1) {
+        int reuse = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+            perror("setsockopt(SO_REUSEADDR) failed (sender)");
+            exit(EXIT_FAILURE);
+        }
+        local_bind.sin6_port = pp->port;                   // src port number
+    }
+
+    if (bind(sock, (struct sockaddr*)&local_bind, sizeof(local_bind)) < 0) {
+        perror("Bind for source interfce and port failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set multicast interface to send if local interface is specified
+    if (pp->ifidx != IFIDXDEFAULT) {
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                &pp->ifidx, sizeof(pp->ifidx)) < 0) {
+            perror("setsockopt(IPV6_MULTICAST_IF) failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (! pp->res) {
+        printf("Sending via interface index %d (%s)\n", pp->ifidx, pp->ifname);
+    }
+
+    // Set hop limit value to packet to go beyond routers
+    int hop = pp->ttl;
+    if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+            &hop, sizeof(hop)) < 0) {
+        perror("setsockopt(IPV6_MULTICAST_HOPS) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Mark datagrams with DSCP
+    if (pp->dscp > 0) {
+        int tclass = pp->dscp << 2;
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &tclass, sizeof(tclass)) < 0) {
+            perror("setsockopt(IPV6_TCLASS) failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Enable/Disable IP_MULTICAST_LOOP to local receiver
+    if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+            &pp->loop, sizeof(pp->loop)) < 0) {
+        perror("setsockopt(IPV6_MULTICAST_LOOP) failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set up destination multicast address
+    struct sockaddr_in6 multicast_addr;
+    memset(&multicast_addr, 0, sizeof(multicast_addr));
+    multicast_addr.sin6_family = AF_INET6;
+    multicast_addr.sin6_addr = pp->mip;                    // multicast-group
+    multicast_addr.sin6_port = pp->port;                   // udp-port-number
+
+    // Probe path MTU of group, size of messages below it
+    if (pp->pmtuport > 0) { pmtu_probe(pp, sock, &multicast_addr); }
+
+    // Message of size given or probed
+    int msgsize = pp->size > BUFSIZE ? pp->size : BUFSIZE;
+    char *message = malloc(msgsize);
+    if (! message) {
+        perror("Message allocation failed (sender)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Open engine, packet engine receives only and sends with plain
+    struct eng eng;
+    if (eng_open(&eng, pp->engine->send ? pp->engine : &engines[0], pp, sock,
+                &multicast_addr, 0) < 0) {
+        perror("Engine setup failed (sender)");
+        exit(EXIT_FAILURE);
+    }
+
+    // Transmit timestamps, read from error queue while waiting
+    struct txts *txts = NULL;
+    if (pp->txstamp) {
+        txts = malloc(sizeof(*txts));
+        if (! txts || txts_open(txts, sock) < 0) {
+            perror("setsockopt(SO_TIMESTAMPING) failed");
+            exit(EXIT_FAILURE);
+        }
+        eng.txts = txts;
+    }
+    uint64_t report = now_ns() + (uint64_t)(pp->stats * NSEC);
+
+    // Prepare impairment emulation, which preallocates delay queue
+    struct impstate imp;
+    imp_init(&imp, &pp->imp);
+
+    // Send multicast message paced at absolute time of each packet
+    uint64_t interval = (uint64_t)(NSEC / pp->rate);
+    uint64_t next = now_ns(), start = next, cpu0 = cpu_ns();
+    struct patstate pat;
+    pat_init(&pat, pp, interval, next);
+
+    // Engine pacing by itself gets datagrams ahead of time, a batch at most
+    int paced = eng.ops->paced;
+    uint64_t lead = paced ? eng.batch * interval : 0;
+    if (lead > SQPOLL_LEAD) { lead = SQPOLL_LEAD; }
+    if (pp->bucket) {
+        next = tb_take(pp->bucket, next);
+        sleep_until(next);
+        start = now_ns();
+    }
+    char timestr[7];
+    time_t last = -1;
+    struct tm tm;
+    int i = 0;
+    while (1) {
+        // Format current time when second changed, reentrant for send threads
+        time_t now = time(NULL);
+        if (now != last) {
+            strftime(timestr, sizeof(timestr), "%H%M%S", localtime_r(&now, &tm));
+            last = now;
+        }
+
+        fixstr[0] = '0' + (i / (sizeof(fixstr)-1)) % 10;
+
+        int sending_size = snprintf(message, msgsize, "%s%.*s/%s/%06d",
+                    fixstr + (sizeof(fixstr)-1) - (i % (sizeof(fixstr)-1)), 
+                    (int)((sizeof(fixstr)-1) - (i % (sizeof(fixstr)-1))), fixstr,
+                    timestr, (i+1));
+        if (pp->stamp) {                            // due time when paced or compared
+            uint64_t wall = wall_ns();
+            if (paced || pp->res) { wall = wall + next - now_ns(); }
+            sending_size += snprintf(message + sending_size, msgsize - sending_size,
+                                "/%llu", (unsigned long long)wall);
+        }
+        if (sending_size < pp->size) {              // padded to size
+            memset(message + sending_size, '.', pp->size - sending_size);
+            sending_size = pp->size;
+        }
+        eng.due = paced ? next : 0;
+
+        // Send multicast message thru impairments
+        int flags = imp_send(&imp, &eng, message, sending_size, now_ns());
+        char tag[64];
+        imp_tag(flags, tag, sizeof(tag));
+
+        char ipaddr[INET6_ADDRSTRLEN];
+        if (! pp->quiet) {
+            printf("Sent to [%s]:%d = %.*s (%d)%s\n",
+                        inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)),
+                        ntohs(pp->port),
+                        sending_size, message, sending_size, tag);
+        }
+        if (pp->txs) {
+            __atomic_store_n(&pp->txs->sent, i + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&pp->txs->ns, now_ns() - start, __ATOMIC_RELAXED);
+        }
+        if (pp->count > 0 && i + 1 >= pp->count) { break; }
+
+        // Wait for next packet, releasing delayed packets when fallen due,
+        // and send what engine has queued before sleeping
+        next = pp->bucket ? tb_take(pp->bucket, now_ns()) : pat_next(&pat, next);
+        eng.due = 0;
+        uint64_t t = now_ns(), due = imp_flush(&imp, &eng, t);
+        if (txts) {
+            txts_poll(txts, sock);
+            if (pp->stats > 0 && t >= report) {
+                txts_report(txts);
+                report = t + (uint64_t)(pp->stats * NSEC);
+            }
+        }
+        while (t + lead < next) {
+            eng_flush(&eng);
+            sleep_until(due < next - lead ? due : next - lead);
+            t = now_ns();
+            due = imp_flush(&imp, &eng, t);
+        }
+        i++;
+    }
+
+    // Send packets still held or delayed
+    uint64_t due;
+    while ((due = imp_drain(&imp, &eng, now_ns())) != UINT64_MAX) {
+        eng_flush(&eng);
+        sleep_until(due);
+    }
+    eng_flush(&eng);
+    eng_close(&eng);
+    if (txts) {                                     // stamps of last datagrams
+        sleep_until(now_ns() + TXTS_LINGER);
+        txts_poll(txts, sock);
+        if (pp->res) {
+            pp->res->txqdisc = txts->qdisc;
+            pp->res->txdriver = txts->driver;
+        } else {
+            txts_report(txts);
+        }
+        free(txts);
+    }
+
+    if (pp->res) {
+        pp->res->txpkts = imp.sent;
+        pp->res->txns = now_ns() - start;
+        pp->res->txcpu = cpu_ns() - cpu0;
+        pp->res->txsq = eng.sqcpu;
+        __atomic_store_n(&pp->res->txdone, 1, __ATOMIC_RELEASE);
+    }
+    if (pp->txs) { __atomic_store_n(&pp->txs->done, 1, __ATOMIC_RELEASE); }
+    imp_exit(&imp);
+    close(sock);
+    return 0;
+}
+
+/*
+ * Run sender threads until they have sent their count, or forever
+ */
+void send_threads(struct param *pp) {
+    int i, n = pp->sendthreads;
+    struct param *p = calloc(n, sizeof(*p));
+    struct txstat *ts = calloc(n, sizeof(*ts));
+    pthread_t *th = calloc(n, sizeof(*th));
+    if (! p || ! ts || ! th) {
+        perror("Sender threads allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct bucket b;
+    b.interval = (uint64_t)(NSEC / pp->rate);
+    b.depth = TBURST * b.interval;
+    b.tat = now_ns();
+
+    cpu_set_t avail;
+    CPU_ZERO(&avail);
+    if (sched_getaffinity(0, sizeof(avail), &avail) < 0) { CPU_SET(0, &avail); }
+    int cpu = -1;
+    for (i = 0; i < n; i++) {
+        p[i] = *pp;
+        p[i].bucket = &b;
+        p[i].txs = &ts[i];
+        if (pp->count > 0) { p[i].count = pp->count / n + (i < pp->count % n); }
+
+        // Pin to next CPU, round robin when threads outnumber CPUs
+        do { cpu = (cpu + 1) % CPU_SETSIZE; } while (! CPU_ISSET(cpu, &avail));
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        ts[i].cpu = cpu;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        if (pthread_create(&th[i], &attr, send_thread, &p[i]) != 0) {
+            perror("Sender thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    uint64_t report = now_ns() + (uint64_t)(pp->stats * NSEC);
+    while (1) {
+        int done = 0;
+        for (i = 0; i < n; i++) { done += __atomic_load_n(&ts[i].done, __ATOMIC_ACQUIRE); }
+        if (done == n) { break; }
+        uint64_t now = now_ns();
+        if (pp->stats > 0 && now >= report) {
+            tx_report(p, n, pp->rate);
+            report = now + (uint64_t)(pp->stats * NSEC);
+        }
+        sleep_until(now + NSEC / 10);
+    }
+    for (i = 0; i < n; i++) { pthread_join(th[i], NULL); }
+    tx_report(p, n, pp->rate);
+    free(p);
+    free(ts);
+    free(th);
+}
+
+/*
+ * Network namespaces
+ *
+ * With --netns prefix[,n], mode recv or send runs a thread per simulated
+ * host instead of a process per host: n threads in namespaces prefix0 to
+ * prefix(n-1), or one thread in namespace prefix without n.  A thread enters
+ * its namespace by setns from NS_DIR, where ip netns keeps them, or creates
+ * it if missing, as ip netns add does, with loopback up.  Namespace is per
+ * thread, so each thread opens its own socket, joins the group and keeps
+ * its own counters as the process of one host would.  Interface of ifname
+ * is looked up by name again in each namespace.
+ *
+ * Receiver threads publish their counters every NS_PUBLISH ms instead of
+ * reporting, and one report at --stats interval sums them: packets, rate,
+ * loss and latency of all hosts, with a line per host up to NS_LINES hosts,
+ * else the least and most receiving.  Each sender sends at --rate.
+ */
+
+#define NS_PUBLISH 100                 // ms between counters of host threads
+#define NS_LINES 16                    // hosts reported one by one
+#define NS_DIR "/run/netns"
+#define MAXNETNS 4096                  // hosts at most
+
+struct nshost {
+    char name[80];                     // namespace
+    pthread_mutex_t lock;              // counters published by receiver
+    uint64_t pkts, bytes, lost;
+    int streams;
+    struct hist lat;
+    uint64_t prev;                     // packets at last report
+};
+
+struct nsrun {
+    struct param *p;                   // parameters of host threads
+    struct nshost *h;
+    struct txstat *ts;                 // progress of senders, NULL if receivers
+    int n;
+    uint64_t last;                     // time of last report
+};
+
+// Publish counters of receiver thread to report
+void ns_publish(struct nshost *h, const struct rxstate *rx) {
+    uint64_t lost = 0;
+    int i;
+    for (i = 0; i < rx->slots; i++) { lost += rx->cnt.lost[i]; }
+    pthread_mutex_lock(&h->lock);
+    h->pkts = rx->pkts;
+    h->bytes = rx->bytes;
+    h->lost = lost;
+    h->streams = rx->nstreams;
+    h->lat = rx->lat;
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Create namespace at path for calling thread, keeping it like ip netns add
+int ns_create(const char *path) {
+    mkdir(NS_DIR, 0755);
+    int fd = open(path, O_RDONLY | O_CREAT | O_EXCL, 0);
+    if (fd < 0) { return -1; }
+    close(fd);
+    if (unshare(CLONE_NEWNET) < 0 ||
+            mount("/proc/thread-self/ns/net", path, "none", MS_BIND, NULL) < 0) {
+        int err = errno;
+        unlink(path);
+        errno = err;
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "lo");
+    int sock = socket(AF_INET, SOCK_DGRAM, 0), rc = -1;
+    if (sock >= 0 && ioctl(sock, SIOCGIFFLAGS, &ifr) == 0) {
+        ifr.ifr_flags |= IFF_UP;
+        rc = ioctl(sock, SIOCSIFFLAGS, &ifr);
+    }
+    if (sock >= 0) { close(sock); }
+    return rc;
+}
+
+// Move calling thread into namespace of name, created if missing
+int ns_enter(const char *name) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", NS_DIR, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) { return ns_create(path); }
+    if (fd < 0) { return -1; }
+    int rc = setns(fd, CLONE_NEWNET);
+    close(fd);
+    return rc;
+}
+
+// Host thread, receiver or sender in its namespace
+void *ns_thread(void *args) {
+    struct param *pp = args;
+    if (ns_enter(pp->nsh->name) < 0) {
+        fprintf(stderr, "Namespace %s: %s\n", pp->nsh->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pp->ifidx != IFIDXDEFAULT && (pp->ifidx = if_nametoindex(pp->ifname)) == 0) {
+        fprintf(stderr, "Namespace %s: no interface %s\n", pp->nsh->name, pp->ifname);
+        exit(EXIT_FAILURE);
+    }
+    return pp->txs ? send_thread(pp) : recv_thread(pp);
+}
+
+void ns_report(struct nsrun *r) {
+    uint64_t now = now_ns(), pkts = 0, bytes = 0, lost = 0, lo = UINT64_MAX, hi = 0;
+    double sec = (now - r->last) / 1e9;
+    int i, active = 0, streams = 0, ilo = 0, ihi = 0;
+    struct hist lat;
+    memset(&lat, 0, sizeof(lat));
+    for (i = 0; i < r->n; i++) {
+        struct nshost *h = &r->h[i];
+        uint64_t n, b = 0, l = 0;
+        int s = 0;
+        if (r->ts) {
+            n = __atomic_load_n(&r->ts[i].sent, __ATOMIC_RELAXED);
+        } else {
+            pthread_mutex_lock(&h->lock);
+            n = h->pkts;
+            b = h->bytes;
+            l = h->lost;
+            s = h->streams;
+            hist_merge(&lat, &h->lat);
+            pthread_mutex_unlock(&h->lock);
+        }
+        uint64_t d = n - h->prev;
+        h->prev = n;
+        pkts += n;
+        bytes += b;
+        lost += l;
+        streams += s;
+        active += d > 0;
+        if (d < lo) { lo = d; ilo = i; }
+        if (d >= hi) { hi = d; ihi = i; }
+        if (r->n <= NS_LINES) {
+            printf("  %s: %llu pkts %.0f pps", h->name, (unsigned long long)n, sec > 0 ? d / sec : 0.0);
+            if (! r->ts) { printf(" lost %llu streams %d", (unsigned long long)l, s); }
+            printf("\n");
+        }
+    }
+    if (r->n > NS_LINES) {
+        printf("  least %s %.0f pps, most %s %.0f pps\n", r->h[ilo].name, sec > 0 ? lo / sec : 0.0,
+                r->h[ihi].name, sec > 0 ? hi / sec : 0.0);
+    }
+    if (r->ts) {
+        printf("Hosts: %d namespaces, %d sending, %llu packets\n", r->n, active,
+                (unsigned long long)pkts);
+    } else {
+        printf("Hosts: %d namespaces, %d receiving, %llu packets %llu bytes %d streams lost %llu\n",
+                r->n, active, (unsigned long long)pkts, (unsigned long long)bytes, streams,
+                (unsigned long long)lost);
+        hist_print("latency", &lat);
+    }
+    fflush(stdout);
+    r->last = now;
+}
+
+/*
+ * Run a receiver or sender thread per namespace, reporting them as one
+ */
+void ns_run(struct param *pp, int tx) {
+    struct nsrun r;
+    memset(&r, 0, sizeof(r));
+    r.n = pp->nnetns > 0 ? pp->nnetns : 1;
+    r.p = calloc(r.n, sizeof(*r.p));
+    r.h = calloc(r.n, sizeof(*r.h));
+    r.ts = tx ? calloc(r.n, sizeof(*r.ts)) : NULL;
+    pthread_t *th = calloc(r.n, sizeof(*th));
+    if (! r.p || ! r.h || (tx && ! r.ts) || ! th) {
+        perror("Namespace threads allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    int i;
+    for (i = 0; i < r.n; i++) {
+        struct nshost *h = &r.h[i];
+        if (pp->nnetns > 0) {
+            snprintf(h->name, sizeof(h->name), "%s%d", pp->netns, i);
+        } else {
+            snprintf(h->name, sizeof(h->name), "%s", pp->netns);
+        }
+        pthread_mutex_init(&h->lock, NULL);
+        r.p[i] = *pp;
+        r.p[i].nsh = h;
+        if (tx) {
+            r.p[i].txs = &r.ts[i];
+        } else {
+            r.p[i].stats = NS_PUBLISH / 1000.0;
+        }
+        if (pthread_create(&th[i], NULL, ns_thread, &r.p[i]) != 0) {
+            perror("Namespace thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    r.last = now_ns();
+    uint64_t report = r.last + (uint64_t)(pp->stats * NSEC);
+    while (1) {
+        int done = 0;
+        for (i = 0; tx && i < r.n; i++) { done += __atomic_load_n(&r.ts[i].done, __ATOMIC_ACQUIRE); }
+        if (tx && done == r.n) { break; }
+        uint64_t now = now_ns();
+        if (pp->stats > 0 && now >= report) {
+            ns_report(&r);
+            report = now + (uint64_t)(pp->stats * NSEC);
+        }
+        sleep_until(now + NSEC / 10);
+    }
+    for (i = 0; i < r.n; i++) { pthread_join(th[i], NULL); }
+    ns_report(&r);
+    free(r.p);
+    free(r.h);
+    free(r.ts);
+    free(th);
+}
+
+/*
+ * Offline pcap ingestion
+ *
+ * Reads a recorded capture thru mmap and feeds UDP datagrams of the group
+ * into the receive pipeline, as fast as possible or at captured timing, to
+ * measure processing cost independent of the kernel and to regression test
+ * processing changes against production captures.  Classic pcap in micro or
+ * nano second resolution with Ethernet (and VLAN), Linux cooked, loopback and
+ * raw IP link types is supported, pcapng is not.  Fragments are skipped.
+ */
+
+/*
+ * Replay pcap file thru receive pipeline and report processing rate
+ */
+void pcap_replay(struct param *pp) {
+    int fd = open(pp->pcap, O_RDONLY);
+    if (fd < 0) {
+        perror("Open pcap failed");
+        exit(EXIT_FAILURE);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        perror("fstat pcap failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = sb.st_size;
+    if (size < 24) {
+        fprintf(stderr, "Not a pcap file: %s\n", pp->pcap);
+        exit(EXIT_FAILURE);
+    }
+    const u_char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap pcap failed");
+        exit(EXIT_FAILURE);
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+
+    int swap, nano;
+    switch (rd32(map, 0)) {
+    case 0xa1b2c3d4: swap = 0; nano = 0; break;
+    case 0xd4c3b2a1: swap = 1; nano = 0; break;
+    case 0xa1b23c4d: swap = 0; nano = 1; break;
+    case 0x4d3cb2a1: swap = 1; nano = 1; break;
+    default:
+        fprintf(stderr, "Unsupported capture format (pcapng?): %s\n", pp->pcap);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t linktype = rd32(map + 20, swap) & 0x0fffffff;
+
+    char ipaddr[INET6_ADDRSTRLEN];
+    printf("Reading %s (linktype %u) for [%s]:%d",
+                pp->pcap, linktype,
+                inet_ntop(AF_INET6, &pp->mip, ipaddr, sizeof(ipaddr)),
+                ntohs(pp->port));
+    printf("%s\n", pp->realtime ? " at captured timing" : "");
+
+    struct rxstate rx;
+    rx_init(&rx, pp);
+
+    uint64_t records = 0, t0 = 0;
+    uint64_t wall0 = now_ns(), cpu0 = cpu_ns();
+    size_t off = 24;
+    while (off + 16 <= size) {
+        const u_char *rec = map + off;
+        uint64_t ts = rd32(rec, swap) * NSEC
+                    + (uint64_t)rd32(rec + 4, swap) * (nano ? 1 : 1000);
+        uint32_t caplen = rd32(rec + 8, swap);
+        if (caplen > size - off - 16) { break; }    // truncated file
+        off += 16 + caplen;
+        records++;
+
+        const u_char *pkt = rec + 16;
+        uint16_t ethertype;
+        int l3 = pcap_link(pkt, caplen, linktype, &ethertype);
+        if (l3 < 0 || ethertype != 0x86dd) { continue; }
+
+        struct rxmsg m;
+        struct in6_addr dst;
+        u_short dport;
+        const u_char *payload;
+        int len = pcap_udp(pkt + l3, caplen - l3, &m.src, &dst, &dport, &payload);
+        if (len < 0) { continue; }
+        if (! IN6_IS_ADDR_UNSPECIFIED(&pp->mip) && ! IN6_ARE_ADDR_EQUAL(&dst, &pp->mip)) { continue; }
+        if (pp->port != 0 && dport != pp->port) { continue; }
+        if (pp->ssm && ! IN6_ARE_ADDR_EQUAL(&m.src.sin6_addr, &pp->sip)) { continue; }
+
+        if (pp->realtime) {                         // captured timing
+            if (t0 == 0) { t0 = ts; }
+            if (wall0 + (ts - t0) > now_ns()) { sleep_until(wall0 + (ts - t0)); }
+        }
+        m.buf = (char *)payload;
+        m.len = len;
+        m.ts = ts;
+        m.wall = ts;
+        m.kts = ts;
+        m.ttl = (pkt + l3)[7];
+        rx_process(&rx, &m);
+    }
+    uint64_t wall = now_ns() - wall0, cpu = cpu_ns() - cpu0;
+
+    fan_close(&rx.fan);
+    rx_report(&rx);
+    printf("Pcap: %llu records %llu datagrams in %.3f s (cpu %.3f s), %.0f pps per core\n",
+                (unsigned long long)records, (unsigned long long)rx.pkts,
+                wall / 1e9, cpu / 1e9, cpu ? rx.pkts * 1e9 / cpu : 0.0);
+    rx_exit(&rx);
+
+    munmap((void *)map, size);
+    close(fd);
+}
+
+/*
+ * Check engine on a scratch socket, returns 0 or errno why it cannot run
+ */
+int eng_usable(struct param *pp, const struct engops *ops) {
+    struct eng e;
+    int err = 0, sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) { return errno; }
+    if (eng_open(&e, ops, pp, sock, NULL, 0) < 0) { err = errno; }
+    eng_close(&e);
+    close(sock);
+    return err;
+}
+
+/*
+ * Run sender and receiver thread of a compare or tune run to completion
+ */
+void run_pair(struct param *pp) {
+    pthread_t rt, st;
+    pthread_create(&rt, NULL, recv_thread, pp);
+    while (! __atomic_load_n(&pp->res->rxready, __ATOMIC_ACQUIRE)) { usleep(100); }
+    pthread_create(&st, NULL, send_thread, pp);
+    pthread_join(st, NULL);
+    pthread_join(rt, NULL);
+}
+
+/*
+ * Run compare workload thru each engine and print results side by side
+ */
+void compare(struct param *pp) {
+    struct result res[2 * NENGINES];
+    memset(res, 0, sizeof(res));
+    int i, n = 0, lite;
+    for (i = 0; i < NENGINES; i++) {
+        for (lite = 0; lite <= pp->lite; lite++) {  // UDP, then UDP-Lite if asked
+            struct result *r = &res[n++];
+            r->engine = engines[i].name;
+            r->lite = lite;
+
+            if ((r->err = eng_usable(pp, &engines[i])) != 0) { continue; }
+
+            struct param cp = *pp;
+            cp.record = cp.forward = NULL;
+            cp.txstamp = 0;
+            cp.engine = &engines[i];
+            cp.lite = lite;
+            cp.res = r;
+            r->idle = COMPARE_IDLE;
+            run_pair(&cp);
+        }
+    }
+
+    char clock_name[32];
+    tsc_name(clock_name, sizeof(clock_name));
+    printf("Compared %ld packets at %.0f pps per engine, clock %s", pp->count, pp->rate,
+                clock_name);
+    if (pp->lite) { printf(", UDP-Lite coverage %d of %d bytes", pp->cscov, pp->size); }
+    printf("\n");
+    int w = pp->lite ? 13 : 10;                 // engine/lite
+    printf("%-*s %10s %10s %8s %10s %10s %10s %10s %10s\n", w, "engine", "tx pps", "rx pps",
+                "lost", "tx ns/pkt", "rx ns/pkt", "sq ns/pkt", "p50 us", "p99 us");
+    for (i = 0; i < n; i++) {
+        struct result *r = &res[i];
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s", r->engine, r->lite ? "/lite" : "");
+        if (r->err) {
+            printf("%-*s n/a (%s)\n", w, name, strerror(r->err));
+            continue;
+        }
+        printf("%-*s %10.0f %10.0f %8llu %10.0f %10.0f %10.0f %10.1f %10.1f\n", w, name,
+                r->txns ? r->txpkts * 1e9 / r->txns : 0.0,
+                r->rxns ? (r->rxpkts - 1) * 1e9 / r->rxns : 0.0,
+                (unsigned long long)(r->txpkts > r->rxpkts ? r->txpkts - r->rxpkts : 0),
+                r->txpkts ? (double)r->txcpu / r->txpkts : 0.0,
+                r->rxpkts ? (double)r->rxcpu / r->rxpkts : 0.0,
+                r->rxpkts ? (double)(r->txsq + r->rxsq) / r->rxpkts : 0.0,
+                hist_pct(&r->lat, 50) / 1e3, hist_pct(&r->lat, 99) / 1e3);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Socket topology benchmark
+ *
+ * Mode topology receives one multi-group workload with three layouts of
+ * sockets, for each count of --topo (default TOPO_GROUPS) groups from the
+ * group of command line upward, all on its port, at --rate in total
+ * (default TOPO_RATE) for --duration seconds:
+ *
+ *   any        one socket bound to the wildcard address with a membership
+ *              per group, as recv_socket does
+ *   group      a socket per group bound to the group address, all served
+ *              by one thread thru epoll
+ *   reuseport  up to TOPO_SHARDS sockets bound to the wildcard address
+ *              with SO_REUSEPORT and IPV6_MULTICAST_ALL off, each joining a
+ *              share of the groups, with a thread each
+ *
+ * Sender goes round robin over the groups with hop limit 0, so nothing
+ * leaves this host.  Over loopback the kernel looks up receiving sockets
+ * and delivers to them within the system call of the sender, so sender CPU
+ * per packet shows lookup cost as sockets on the port grow.  Receivers
+ * drain with recvmmsg after each epoll wakeup, and wakeups are voluntary
+ * context switches of receiver threads.  Datagrams delivered to more than
+ * one socket show as dup.  Layouts the host refuses, such as memberships
+ * beyond optmem_max of one socket, are shown as n/a with the reason.
+ */
+
+#define TOPO_GROUPS "1,4,16,64,256"    // default group counts
+#define TOPO_RATE 50000                // default packets per second in total
+#define TOPO_STEP 2                    // default seconds per run
+#define TOPO_SHARDS 4                  // sockets and threads of reuseport
+#define TOPO_IDLE 200                  // ms without packets ending a run
+#define MAXTOPO 4096                   // groups at most
+
+#define TOPO_ANY 0
+#define TOPO_GROUP 1
+#define TOPO_REUSEPORT 2
+
+const char *topo_layouts[] = { "any", "group", "reuseport" };
+
+struct toporun;
+
+struct toporx {
+    struct toporun *run;
+    int ep;                            // epoll of sockets, -1 if none
+    int *sock;                         // sockets of this thread
+    int nsock;
+    uint64_t pkts;                     // datagrams received
+    uint64_t cpu;                      // CPU time
+    uint64_t wakeups;                  // voluntary context switches
+};
+
+struct toporun {
+    struct param *pp;
+    int layout;                        // TOPO_*
+    int groups;                        // groups in run
+    int err;                           // errno if layout refused
+    int txdone;                        // sender finished
+    uint64_t txpkts;                   // datagrams sent
+    uint64_t txns;                     // sending time
+    uint64_t txcpu;                    // sender CPU time
+    struct toporx rx[TOPO_SHARDS];
+    int nrx;                           // receiver threads
+};
+
+// Group counts separated by comma
+int topo_steps(const char *arg, struct param *pp) {
+    pp->ntopo = 0;
+    while (pp->ntopo < MAXTOPOS) {
+        char *end;
+        long v = strtol(arg, &end, 10);
+        if (end == arg || v < 1 || v > MAXTOPO) { return 0; }
+        pp->topo[pp->ntopo++] = v;
+        if (*end != ',') { return *end == '\0'; }
+        arg = end + 1;
+    }
+    return 0;
+}
+
+// Address of group k, counting up from group of command line
+void topo_group(const struct param *pp, int k, struct in6_addr *a) {
+    *a = pp->mip;
+    a->s6_addr32[3] = htonl(ntohl(a->s6_addr32[3]) + k);
+}
+
+// Receiving socket of layout bound to addr, -1 with errno if refused
+int topo_socket(struct toporun *run, const struct in6_addr *addr) {
+    struct param *pp = run->pp;
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0), on = 1, off = 0;
+    if (sock < 0) { return -1; }
+    struct sockaddr_in6 local;
+    memset(&local, 0, sizeof(local));
+    local.sin6_family = AF_INET6;
+    local.sin6_addr = *addr;
+    local.sin6_port = pp->port;
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0 ||
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            (run->layout == TOPO_REUSEPORT &&
+                (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+                 setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &off, sizeof(off)) < 0)) ||
+            (pp->sockbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &pp->sockbuf,
+                                            sizeof(pp->sockbuf)) < 0) ||
+            bind(sock, (struct sockaddr*)&local, sizeof(local)) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+// Join socket to group k
+int topo_join(struct toporun *run, int sock, int k) {
+    struct ipv6_mreq mreq;
+    topo_group(run->pp, k, &mreq.ipv6mr_multiaddr);
+    mreq.ipv6mr_interface = run->pp->ifidx;
+    return setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+}
+
+// Add socket to receiver thread
+int topo_add(struct toporx *t, int sock) {
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLIN;
+    e.data.fd = sock;
+    t->sock[t->nsock++] = sock;
+    return epoll_ctl(t->ep, EPOLL_CTL_ADD, sock, &e);
+}
+
+// Open and join sockets of layout, -1 with run->err if refused
+int topo_open(struct toporun *run) {
+    struct in6_addr any = in6addr_any, group;
+    int i, k, sock;
+    run->nrx = run->layout != TOPO_REUSEPORT ? 1 :
+                run->groups < TOPO_SHARDS ? run->groups : TOPO_SHARDS;
+    for (i = 0; i < run->nrx; i++) { run->rx[i].ep = -1; }
+    for (i = 0; i < run->nrx; i++) {
+        struct toporx *t = &run->rx[i];
+        t->run = run;
+        t->ep = epoll_create1(0);
+        t->sock = malloc(run->groups * sizeof(*t->sock));
+        if (t->ep < 0 || ! t->sock) {
+            run->err = errno;
+            return -1;
+        }
+    }
+    for (k = 0; k < run->groups; k++) {
+        struct toporx *t = &run->rx[k % run->nrx];
+        topo_group(run->pp, k, &group);
+        if (run->layout == TOPO_GROUP || t->nsock == 0) {
+            sock = topo_socket(run, run->layout == TOPO_GROUP ? &group : &any);
+            if (sock < 0 || topo_add(t, sock) < 0) {
+                run->err = errno;
+                return -1;
+            }
+        }
+        if (topo_join(run, t->sock[t->nsock - 1], k) < 0) {
+            run->err = errno;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void topo_close(struct toporun *run) {
+    int i, j;
+    for (i = 0; i < run->nrx; i++) {
+        struct toporx *t = &run->rx[i];
+        for (j = 0; j < t->nsock; j++) { close(t->sock[j]); }
+        if (t->ep >= 0) { close(t->ep); }
+        free(t->sock);
+    }
+}
+
+// Receiver thread, drains its sockets at each wakeup until sender is done
+void *topo_recv(void *args) {
+    struct toporx *t = args;
+    char (*buf)[BUFSIZE] = malloc(ENGBATCH * sizeof(*buf));
+    if (! buf) {
+        perror("Buffer allocation failed (topology)");
+        exit(EXIT_FAILURE);
+    }
+    struct mmsghdr msg[ENGBATCH];
+    struct iovec iov[ENGBATCH];
+    int i;
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < ENGBATCH; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = BUFSIZE;
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    struct rusage ru0, ru;
+    getrusage(RUSAGE_THREAD, &ru0);
+    uint64_t cpu0 = cpu_ns();
+    struct epoll_event ev[ENGBATCH];
+    while (1) {
+        int n = epoll_wait(t->ep, ev, ENGBATCH, TOPO_IDLE);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait failed (topology)");
+            break;
+        }
+        if (n <= 0) {
+            if (__atomic_load_n(&t->run->txdone, __ATOMIC_ACQUIRE)) { break; }
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            int m;
+            while ((m = recvmmsg(ev[i].data.fd, msg, ENGBATCH, 0, NULL)) > 0) { t->pkts += m; }
+        }
+    }
+    t->cpu = cpu_ns() - cpu0;
+    getrusage(RUSAGE_THREAD, &ru);
+    t->wakeups = ru.ru_nvcsw - ru0.ru_nvcsw;
+    free(buf);
+    return NULL;
+}
+
+// Sender thread, round robin over groups at rate for duration
+void *topo_send(void *args) {
+    struct toporun *run = args;
+    struct param *pp = run->pp;
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0), ttl = 0;
+    if (sock < 0 || setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)) < 0 ||
+            (pp->ifidx != IFIDXDEFAULT && setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                                            &pp->ifidx, sizeof(pp->ifidx)) < 0)) {
+        perror("Socket setup failed (topology sender)");
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_in6 *dst = calloc(run->groups, sizeof(*dst));
+    if (! dst) {
+        perror("Destination allocation failed (topology)");
+        exit(EXIT_FAILURE);
+    }
+    int k;
+    for (k = 0; k < run->groups; k++) {
+        dst[k].sin6_family = AF_INET6;
+        topo_group(pp, k, &dst[k].sin6_addr);
+        dst[k].sin6_port = pp->port;
+    }
+
+    char msg[64];
+    uint64_t i, count = (uint64_t)(pp->rate * pp->duration), interval = (uint64_t)(NSEC / pp->rate);
+    uint64_t start = now_ns(), next = start, cpu0 = cpu_ns();
+    for (i = 0; i < count; i++) {
+        int len = snprintf(msg, sizeof(msg), "t/000000/%llu", (unsigned long long)(i / run->groups));
+        if (sendto(sock, msg, len, 0, (struct sockaddr*)&dst[i % run->groups], sizeof(dst[0])) == len) {
+            run->txpkts++;
+        }
+        next += interval;
+        if (i % ENGBATCH == ENGBATCH - 1 && next > now_ns()) { sleep_until(next); }
+    }
+    run->txns = now_ns() - start;
+    run->txcpu = cpu_ns() - cpu0;
+    __atomic_store_n(&run->txdone, 1, __ATOMIC_RELEASE);
+    free(dst);
+    close(sock);
+    return NULL;
+}
+
+void topo_run(struct toporun *run) {
+    pthread_t rt[TOPO_SHARDS], st;
+    int i;
+    if (topo_open(run) == 0) {
+        for (i = 0; i < run->nrx; i++) { pthread_create(&rt[i], NULL, topo_recv, &run->rx[i]); }
+        pthread_create(&st, NULL, topo_send, run);
+        pthread_join(st, NULL);
+        for (i = 0; i < run->nrx; i++) { pthread_join(rt[i], NULL); }
+    }
+    topo_close(run);
+}
+
+/*
+ * Run each layout at each group count and print results side by side
+ */
+void topology(struct param *pp) {
+    char clock_name[32];
+    tsc_name(clock_name, sizeof(clock_name));
+    printf("Topology at %.0f pps for %.1f s per run, port %d, clock %s\n", pp->rate,
+                pp->duration, ntohs(pp->port), clock_name);
+    printf("%6s %-10s %10s %10s %8s %8s %10s %10s %10s\n", "groups", "layout", "tx pps",
+                "rx pps", "lost", "dup", "tx ns/pkt", "rx ns/pkt", "pkts/wake");
+    int s, l, i;
+    for (s = 0; s < pp->ntopo; s++) {
+        for (l = TOPO_ANY; l <= TOPO_REUSEPORT; l++) {
+            struct toporun run;
+            memset(&run, 0, sizeof(run));
+            run.pp = pp;
+            run.layout = l;
+            run.groups = pp->topo[s];
+            topo_run(&run);
+            if (run.err) {
+                printf("%6d %-10s n/a (%s)\n", run.groups, topo_layouts[l], strerror(run.err));
+                continue;
+            }
+            uint64_t rx = 0, cpu = 0, wakeups = 0;
+            for (i = 0; i < run.nrx; i++) {
+                rx += run.rx[i].pkts;
+                cpu += run.rx[i].cpu;
+                wakeups += run.rx[i].wakeups;
+            }
+            printf("%6d %-10s %10.0f %10.0f %8llu %8llu %10.0f %10.0f %10.1f\n",
+                    run.groups, topo_layouts[l],
+                    run.txns ? run.txpkts * 1e9 / run.txns : 0.0,
+                    run.txns ? rx * 1e9 / run.txns : 0.0,
+                    (unsigned long long)(run.txpkts > rx ? run.txpkts - rx : 0),
+                    (unsigned long long)(rx > run.txpkts ? rx - run.txpkts : 0),
+                    run.txpkts ? (double)run.txcpu / run.txpkts : 0.0,
+                    rx ? (double)cpu / rx : 0.0,
+                    wakeups ? (double)rx / wakeups : 0.0);
+            fflush(stdout);
+        }
+    }
+}
+
+/*
+ * Querier
+ *
+ * Mode querier stands in for a multicast router on a link, such as a Linux
+ * bridge with MLD snooping between network namespaces, to time how hosts
+ * answer.  It sends MLDv2 general queries to ff02::1 every --query
+ * seconds (default QRY_INTERVAL) with max response time of ms (default
+ * QRY_RESP), and queries specific to the group of command line every gsec
+ * seconds if given, from a raw ICMPv6 socket (needs CAP_NET_RAW) with
+ * hop limit 1 and Router Alert, out of interface of ifname or default.
+ *
+ * Each query opens a round, and the same socket reads membership reports.
+ * Reports count to the latest query, so a group query sent within max
+ * response time of a general query blurs both rounds.  Records of current
+ * state in MLDv2 reports answer the query, state change records and leaves
+ * count as changes.  MLDv1 reports answer it when they come within max
+ * response time.  A line per round, unless -q, shows hosts answering,
+ * reports, group records and latency of first and last report since the
+ * query.  At the end a line per host shows rounds answered, reports and
+ * records per round, mean latency of first and last report, and changes.
+ * Socket joins ff02::16 where MLDv2 reports go, MLDv1 reports of groups not
+ * joined here may not reach it.
+ *
+ * With --topo n[,n]..., this host also joins n groups counting up from the
+ * group of command line, on a socket per group as layout group of Socket
+ * topology benchmark, for --duration seconds per count, so that report
+ * volume and spread can be read against groups joined.
+ */
+
+#define QRY_INTERVAL 2                 // default seconds between general queries
+#define QRY_RESP 1000                  // default max response time in ms
+#define QRY_HOSTS 256                  // hosts tracked
+#define QRY_ROBUST 2                   // robustness variable told to hosts
+#define QRY_ALLNODES "ff02::1"         // general queries
+#define QRY_V2REPORTS "ff02::16"       // MLDv2 reports
+#define QRY_MLD2REPORT 143             // MLDv2 report type
+
+struct qhost {
+    struct in6_addr addr;
+    uint32_t round;                    // last round answered
+    uint64_t answered;                 // rounds answered
+    uint64_t reports;                  // reports answering queries
+    uint64_t records;                  // group records in them
+    uint64_t changes;                  // state change reports and leaves
+    uint64_t last;                     // latency of last report in round
+    uint64_t firstsum;                 // latency of first reports of rounds
+    uint64_t lastsum;                  // of last reports
+};
+
+struct querier {
+    struct param *pp;
+    int sock;
+    uint64_t start;
+    uint32_t round;                    // current round
+    int open;                          // round open, reports answer its query
+    int general;                       // round of general query
+    uint64_t sent;                     // time query of round was sent
+    int hosts, reports, records;       // of round
+    uint64_t first, last;              // latency of round
+    struct qhost host[QRY_HOSTS];
+    int nhost;
+    uint64_t overflow;                 // reports of hosts beyond table
+};
+
+// Host of address, NULL if table is full
+struct qhost *qry_host(struct querier *q, const struct in6_addr *addr) {
+    int i;
+    for (i = 0; i < q->nhost; i++) {
+        if (memcmp(&q->host[i].addr, addr, sizeof(*addr)) == 0) { return &q->host[i]; }
+    }
+    if (q->nhost == QRY_HOSTS) { return NULL; }
+    struct qhost *h = &q->host[q->nhost++];
+    memset(h, 0, sizeof(*h));
+    h->addr = *addr;
+    return h;
+}
+
+// Count report of host with records answering round, or as change
+void qry_report(struct querier *q, const struct in6_addr *addr, int records, int change, uint64_t now) {
+    struct qhost *h = qry_host(q, addr);
+    if (! h) {
+        q->overflow++;
+        return;
+    }
+    if (change || ! q->open) {
+        h->changes++;
+        return;
+    }
+    uint64_t lat = now - q->sent;
+    if (h->round != q->round) {        // first answer of round
+        h->round = q->round;
+        h->answered++;
+        h->firstsum += lat;
+        h->lastsum += lat;
+        if (q->hosts++ == 0 || lat < q->first) { q->first = lat; }
+    } else {
+        h->lastsum += lat - h->last;
+    }
+    h->last = lat;
+    h->reports++;
+    h->records += records;
+    q->reports++;
+    q->records += records;
+    if (lat > q->last) { q->last = lat; }
+}
+
+// Close round and print it
+void qry_round(struct querier *q) {
+    if (! q->open) { return; }
+    q->open = 0;
+    if (q->pp->quiet) { return; }
+    printf("query %u %s at %.3f s: %d hosts, %d reports, %d records, first %.1f ms, last %.1f ms\n",
+            q->round, q->general ? "general" : "group", (q->sent - q->start) / 1e9,
+            q->hosts, q->reports, q->records, q->first / 1e6, q->last / 1e6);
+    fflush(stdout);
+}
+
+// Raw ICMPv6 socket sending queries and reading reports
+int qry_open(struct param *pp) {
+    int sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6), hops = 1;
+    u_char alert[8] = { 0, 0, 5, 2, 0, 0, 1, 0 }; // Hop-by-Hop, Router Alert MLD, PadN
+    struct icmp6_filter f;
+    ICMP6_FILTER_SETBLOCKALL(&f);
+    ICMP6_FILTER_SETPASS(MLD_LISTENER_REPORT, &f);
+    ICMP6_FILTER_SETPASS(MLD_LISTENER_REDUCTION, &f);
+    ICMP6_FILTER_SETPASS(QRY_MLD2REPORT, &f);
+    struct ipv6_mreq mreq;
+    inet_pton(AF_INET6, QRY_V2REPORTS, &mreq.ipv6mr_multiaddr);
+    mreq.ipv6mr_interface = pp->ifidx;
+    if (sock < 0 || setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops)) < 0 ||
+            setsockopt(sock, IPPROTO_IPV6, IPV6_HOPOPTS, alert, sizeof(alert)) < 0 ||
+            setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &f, sizeof(f)) < 0 ||
+            (pp->ifidx != IFIDXDEFAULT && setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                                            &pp->ifidx, sizeof(pp->ifidx)) < 0) ||
+            setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0) {
+        perror("Raw ICMPv6 socket failed (querier)");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+// MLDv2 query, general to all nodes or specific to group of command line
+int qry_xmit(struct querier *q, int general) {
+    struct param *pp = q->pp;
+    u_char msg[28];
+    memset(msg, 0, sizeof(msg));
+    msg[0] = MLD_LISTENER_QUERY;                   // checksum by kernel
+    msg[4] = pp->qresp >> 8;                       // max response in ms
+    msg[5] = pp->qresp;
+    if (! general) { memcpy(msg + 8, &pp->mip, 16); }
+    msg[24] = QRY_ROBUST;
+    msg[25] = pp->qint < 128 ? (int)pp->qint : 127; // querier's query interval
+    struct sockaddr_in6 dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin6_family = AF_INET6;
+    if (general) {
+        inet_pton(AF_INET6, QRY_ALLNODES, &dst.sin6_addr);
+    } else {
+        dst.sin6_addr = pp->mip;
+    }
+    dst.sin6_scope_id = pp->ifidx;
+    return sendto(q->sock, msg, sizeof(msg), 0, (struct sockaddr*)&dst, sizeof(dst));
+}
+
+// Listener report of ICMPv6 message from raw socket
+void qry_parse(struct querier *q, const struct sockaddr_in6 *src, const u_char *p, int len,
+                uint64_t now) {
+    if (len < 8) { return; }
+    if (p[0] == MLD_LISTENER_REPORT) {             // v1 report
+        qry_report(q, &src->sin6_addr, 1, now - q->sent > (uint64_t)q->pp->qresp * 1000000, now);
+    } else
+    if (p[0] == MLD_LISTENER_REDUCTION) {          // v1 done
+        qry_report(q, &src->sin6_addr, 0, 1, now);
+    } else
+    if (p[0] == QRY_MLD2REPORT) {                  // v2 report, records of groups
+        int nrec = p[6] << 8 | p[7], off = 8, cur = 0, chg = 0;
+        while (nrec-- > 0 && off + 20 <= len) {
+            if (p[off] <= 2) { cur++; } else { chg++; }  // MODE_IS_INCLUDE, MODE_IS_EXCLUDE
+            off += 20 + 16 * (p[off + 2] << 8 | p[off + 3]) + 4 * p[off + 1];
+        }
+        if (cur || chg) { qry_report(q, &src->sin6_addr, cur, cur == 0, now); }
+    }
+}
+
+// Send query and open its round
+void qry_send(struct querier *q, int general) {
+    qry_round(q);
+    q->round++;
+    q->open = 1;
+    q->general = general;
+    q->hosts = q->reports = q->records = 0;
+    q->first = q->last = 0;
+    q->sent = now_ns();
+    if (qry_xmit(q, general) < 0) { perror("Query send failed (querier)"); }
+}
+
+// Read reports waiting on socket
+void qry_input(struct querier *q) {
+    u_char buf[2048];
+    struct sockaddr_in6 src;
+    socklen_t len = sizeof(src);
+    int n;
+    while ((n = recvfrom(q->sock, buf, sizeof(buf), MSG_DONTWAIT,
+                            (struct sockaddr*)&src, &len)) > 0) {
+        qry_parse(q, &src, buf, n, now_ns());
+        len = sizeof(src);
+    }
+}
+
+// Query and read reports until stop
+void qry_step(struct querier *q, uint64_t stop) {
+    struct param *pp = q->pp;
+    uint64_t now = now_ns(), gen = now, grp = UINT64_MAX;
+    if (pp->qgrp > 0) { grp = now + (uint64_t)(pp->qgrp * NSEC / 2); }
+    while (now < stop) {
+        if (now >= gen) {
+            qry_send(q, 1);
+            gen += (uint64_t)(pp->qint * NSEC);
+        }
+        if (now >= grp) {
+            qry_send(q, 0);
+            grp += (uint64_t)(pp->qgrp * NSEC);
+        }
+        uint64_t next = gen < grp ? gen : grp;
+        if (next > stop) { next = stop; }
+        struct pollfd pfd = { q->sock, POLLIN, 0 };
+        if (poll(&pfd, 1, next > now ? (next - now + 999999) / 1000000 : 0) > 0) { qry_input(q); }
+        now = now_ns();
+    }
+    qry_round(q);
+}
+
+// Print hosts of step and forget them
+void qry_summary(struct querier *q) {
+    char host[INET6_ADDRSTRLEN];
+    int i;
+    printf("%-26s %8s %8s %10s %10s %10s %8s\n", "host", "answered", "reports",
+                "rec/query", "first ms", "last ms", "changes");
+    for (i = 0; i < q->nhost; i++) {
+        struct qhost *h = &q->host[i];
+        inet_ntop(AF_INET6, &h->addr, host, sizeof(host));
+        printf("%-26s %8llu %8llu %10.1f %10.1f %10.1f %8llu\n", host,
+                (unsigned long long)h->answered, (unsigned long long)h->reports,
+                h->answered ? (double)h->records / h->answered : 0.0,
+                h->answered ? h->firstsum / 1e6 / h->answered : 0.0,
+                h->answered ? h->lastsum / 1e6 / h->answered : 0.0,
+                (unsigned long long)h->changes);
+    }
+    if (q->overflow) {
+        printf("%llu reports of hosts beyond %d\n", (unsigned long long)q->overflow, QRY_HOSTS);
+    }
+    fflush(stdout);
+    q->nhost = 0;
+    q->overflow = 0;
+}
+
+/*
+ * Query for --duration, or for each count of groups joined by this host
+ */
+void querier(struct param *pp) {
+    struct querier *q = calloc(1, sizeof(*q));
+    if (! q) {
+        perror("Querier allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    q->pp = pp;
+    q->sock = qry_open(pp);
+    q->start = now_ns();
+    printf("Querier MLDv2 every %.1f s, max response %d ms", pp->qint, pp->qresp);
+    if (pp->qgrp > 0) {
+        char group[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &pp->mip, group, sizeof(group));
+        printf(", group %s every %.1f s", group, pp->qgrp);
+    }
+    printf("\n");
+    if (pp->ntopo == 0) {
+        qry_step(q, now_ns() + (uint64_t)(pp->duration * NSEC));
+        qry_summary(q);
+    }
+    int s;
+    for (s = 0; s < pp->ntopo; s++) {
+        struct toporun run;
+        memset(&run, 0, sizeof(run));
+        run.pp = pp;
+        run.layout = TOPO_GROUP;
+        run.groups = pp->topo[s];
+        if (topo_open(&run) < 0) {
+            printf("Joined %d groups: n/a (%s)\n", run.groups, strerror(run.err));
+        } else {
+            printf("Joined %d groups\n", run.groups);
+            qry_step(q, now_ns() + (uint64_t)(pp->duration * NSEC));
+            qry_summary(q);
+        }
+        topo_close(&run);
+    }
+    close(q->sock);
+    free(q);
+}
+
+/*
+ * Multicast router
+ *
+ * Mode router makes this host a minimal IPv6 multicast router thru the
+ * kernel's MRT6 API, as a router in the middle of senders and receivers in
+ * other network namespaces.  It opens the multicast routing socket (needs
+ * CAP_NET_ADMIN), adds a MIF for each interface of --vifs, and installs
+ * (S,G) routes into the forwarding cache (MFC):
+ *
+ *   configured  with sip of command line, (sip,mip) enters on the first
+ *               MIF and leaves on all others
+ *   on demand   kernel passes an upcall for each (S,G) it has no route for,
+ *               which is installed from the MIF it came in to all others
+ *
+ * Forwarding is by hop limit threshold 1 only, no IGMP/MLD or PIM state, so
+ * each MIF gets every group.  At --stats interval (default MRT_STATS) a
+ * report shows routes, upcalls, and per route the counters of
+ * /proc/net/ip6_mr_cache, with packet and bit rates of interval and packets
+ * that came in on a wrong interface, in the format of receiver stats.
+ * Routes go when the socket closes, at --duration seconds if given or on
+ * interrupt.
+ */
+
+#define MRT_STATS 1                    // default seconds between reports
+#define MRT_ROUTES 256                 // routes reported
+#define MRT_CACHE "/proc/net/ip6_mr_cache"
+
+struct mrcache {
+    char group[INET6_ADDRSTRLEN];
+    char origin[INET6_ADDRSTRLEN];
+    int iif;
+    uint64_t pkts, bytes, wrong;
+};
+
+struct mrouter {
+    struct param *pp;
+    int sock;
+    int nvif;
+    char name[MAXMIFS][IF_NAMESIZE];
+    uint64_t upcalls;                  // routes missing in kernel
+    uint64_t installed;                // routes added
+    uint64_t failed;                   // routes refused
+    struct mrcache prev[MRT_ROUTES];   // counters of last report
+    int nprev;
+    uint64_t last;                     // time of last report
+};
+
+// Routing socket with a MIF per interface of --vifs
+void mrt_open(struct mrouter *r) {
+    int on = 1;
+    r->sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+    if (r->sock < 0 || setsockopt(r->sock, IPPROTO_IPV6, MRT6_INIT, &on, sizeof(on)) < 0) {
+        perror("MRT6_INIT failed (router)");
+        exit(EXIT_FAILURE);
+    }
+    char names[256], *save, *name;
+    snprintf(names, sizeof(names), "%s", r->pp->vifs);
+    for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        struct mif6ctl mc;
+        memset(&mc, 0, sizeof(mc));
+        mc.mif6c_mifi = r->nvif;
+        mc.vifc_threshold = 1;
+        mc.mif6c_pifi = if_nametoindex(name);
+        if (r->nvif == MAXMIFS || mc.mif6c_pifi == 0 ||
+                setsockopt(r->sock, IPPROTO_IPV6, MRT6_ADD_MIF, &mc, sizeof(mc)) < 0) {
+            fprintf(stderr, "MIF %s: %s (router)\n", name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        snprintf(r->name[r->nvif++], IF_NAMESIZE, "%s", name);
+    }
+    printf("Router with %d MIFs:", r->nvif);
+    int i;
+    for (i = 0; i < r->nvif; i++) { printf(" %d %s", i, r->name[i]); }
+    printf("\n");
+}
+
+// Route (src,grp) from MIF iif to all others
+void mrt_install(struct mrouter *r, const struct in6_addr *src, const struct in6_addr *grp, int iif) {
+    struct mf6cctl mc;
+    memset(&mc, 0, sizeof(mc));
+    mc.mf6cc_origin.sin6_family = AF_INET6;
+    mc.mf6cc_origin.sin6_addr = *src;
+    mc.mf6cc_mcastgrp.sin6_family = AF_INET6;
+    mc.mf6cc_mcastgrp.sin6_addr = *grp;
+    mc.mf6cc_parent = iif;
+    IF_ZERO(&mc.mf6cc_ifset);
+    int i;
+    for (i = 0; i < r->nvif; i++) {
+        if (i != iif) { IF_SET(i, &mc.mf6cc_ifset); }
+    }
+    char origin[INET6_ADDRSTRLEN], group[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, src, origin, sizeof(origin));
+    inet_ntop(AF_INET6, grp, group, sizeof(group));
+    if (setsockopt(r->sock, IPPROTO_IPV6, MRT6_ADD_MFC, &mc, sizeof(mc)) < 0) {
+        fprintf(stderr, "Route (%s, %s): %s (router)\n", origin, group, strerror(errno));
+        r->failed++;
+        return;
+    }
+    r->installed++;
+    if (! r->pp->quiet) { printf("Route (%s, %s) from %s\n", origin, group, r->name[iif]); }
+}
+
+// Read upcalls, routing each missing (S,G)
+void mrt_upcall(struct mrouter *r) {
+    char buf[BUFSIZE];
+    int n;
+    while ((n = recv(r->sock, buf, sizeof(buf), MSG_DONTWAIT)) >= (int)sizeof(struct mrt6msg)) {
+        struct mrt6msg *m = (struct mrt6msg*)buf;
+        if (m->im6_mbz != 0 || m->im6_msgtype != MRT6MSG_NOCACHE) { continue; }  // ICMPv6 or other
+        r->upcalls++;
+        if (m->im6_mif < r->nvif) { mrt_install(r, &m->im6_src, &m->im6_dst, m->im6_mif); }
+    }
+}
+
+// Routes of kernel cache
+int mrt_cache(struct mrcache *c, int max) {
+    FILE *f = fopen(MRT_CACHE, "r");
+    if (! f) { return 0; }
+    char line[512], grp[64], org[64];
+    int n = 0;
+    unsigned long long pkts, bytes, wrong;
+    struct in6_addr a;
+    if (! fgets(line, sizeof(line), f)) { line[0] = '\0'; }  // header
+    while (n < max && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63s %63s %d %llu %llu %llu", grp, org, &c[n].iif, &pkts, &bytes, &wrong) != 6 ||
+                inet_pton(AF_INET6, grp, &a) != 1) {
+            continue;
+        }
+        inet_ntop(AF_INET6, &a, c[n].group, sizeof(c[n].group));
+        if (inet_pton(AF_INET6, org, &a) != 1) { continue; }
+        inet_ntop(AF_INET6, &a, c[n].origin, sizeof(c[n].origin));
+        c[n].pkts = pkts;
+        c[n].bytes = bytes;
+        c[n].wrong = wrong;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+// Print forwarding counters of kernel against last report
+void mrt_report(struct mrouter *r) {
+    uint64_t now = now_ns();
+    double sec = (now - r->last) / 1e9;
+    struct mrcache cur[MRT_ROUTES];
+    int n = mrt_cache(cur, MRT_ROUTES), i, j;
+    printf("Router: %d routes, %llu upcalls %llu installed %llu failed\n", n,
+            (unsigned long long)r->upcalls, (unsigned long long)r->installed,
+            (unsigned long long)r->failed);
+    for (i = 0; i < n; i++) {
+        struct mrcache *c = &cur[i], *p = NULL;
+        for (j = 0; j < r->nprev && ! p; j++) {
+            if (strcmp(r->prev[j].group, c->group) == 0 &&
+                    strcmp(r->prev[j].origin, c->origin) == 0) { p = &r->prev[j]; }
+        }
+        uint64_t pkts = c->pkts - (p ? p->pkts : 0), bytes = c->bytes - (p ? p->bytes : 0);
+        printf("  (%s, %s) from %s: %llu pkts %llu bytes %.0f pps %.1f Mbit/s wrong %llu\n",
+                c->origin, c->group, c->iif >= 0 && c->iif < r->nvif ? r->name[c->iif] : "-",
+                (unsigned long long)c->pkts, (unsigned long long)c->bytes,
+                sec > 0 ? pkts / sec : 0.0, sec > 0 ? bytes * 8 / sec / 1e6 : 0.0,
+                (unsigned long long)c->wrong);
+    }
+    fflush(stdout);
+    memcpy(r->prev, cur, n * sizeof(cur[0]));
+    r->nprev = n;
+    r->last = now;
+}
+
+/*
+ * Route until --duration ends, if given, reporting at --stats interval
+ */
+void mrouter(struct param *pp) {
+    struct mrouter *r = calloc(1, sizeof(*r));
+    if (! r) {
+        perror("Router allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    r->pp = pp;
+    mrt_open(r);
+    if (! IN6_IS_ADDR_UNSPECIFIED(&pp->sip)) { mrt_install(r, &pp->sip, &pp->mip, 0); }
+    uint64_t now = now_ns(), stop = pp->duration > 0 ? now + (uint64_t)(pp->duration * NSEC) : UINT64_MAX;
+    uint64_t report = now + (uint64_t)(pp->stats * NSEC);
+    r->last = now;
+    while (now < stop) {
+        uint64_t next = report < stop ? report : stop;
+        struct pollfd pfd = { r->sock, POLLIN, 0 };
+        if (poll(&pfd, 1, next > now ? (next - now + 999999) / 1000000 : 0) > 0) { mrt_upcall(r); }
+        now = now_ns();
+        if (now >= report) {
+            mrt_report(r);
+            report += (uint64_t)(pp->stats * NSEC);
+        }
+    }
+    close(r->sock);                    // kernel removes routes
+    free(r);
+}
+
+/*
+ * Latency under load
+ *
+ * Mode load shows what bulk traffic does to latency of small critical
+ * messages sharing links and host with it.  At each step of --load, a bulk
+ * sender fills the --bulk group with datagrams of --size bytes at that many
+ * Mbit/s of payload, while a probe sender sends stamped messages to the
+ * group of command line at --rate, both for --duration seconds, and a
+ * receiver thread on this host takes the probes back over multicast
+ * loopback.  Probe latency is tabulated per step.  Bulk and probes also go
+ * out of the interface, so that receivers elsewhere with --stamp (and
+ * --sync) see queueing in switches, and --txstamp adds p99 of probes from
+ * application to qdisc and from qdisc to driver, to show queueing in this
+ * host apart.  --dscp marks probes, and the bulk group may have its own.
+ */
+
+#define LOAD_STEPS "0,50,100,200,400"  // default bulk Mbit/s per step
+#define LOAD_RATE 1000                 // default probes per second
+#define LOAD_STEP 2                    // default seconds per step
+#define LOAD_SIZE 1400                 // default bulk payload bytes
+
+// Bulk group [mip]:port[:dscp]
+int load_parse(const char *arg, struct param *pp) {
+    char host[INET6_ADDRSTRLEN];
+    int port, dscp = 0;
+    if (sscanf(arg, "[%45[^]]]:%d:%d", host, &port, &dscp) < 2 ||
+            inet_pton(AF_INET6, host, &pp->bulkmip) != 1) { return 0; }
+    pp->bulkport = htons(port);
+    pp->bulkdscp = dscp;
+    return port > 0 && port < 65536 && dscp >= 0 && dscp < 64;
+}
+
+// Load steps, Mbit/s separated by comma
+int load_steps(const char *arg, struct param *pp) {
+    pp->nloads = 0;
+    while (pp->nloads < MAXLOADS) {
+        char *end;
+        double v = strtod(arg, &end);
+        if (end == arg || v < 0) { return 0; }
+        pp->load[pp->nloads++] = v;
+        if (*end != ',') { return *end == '\0'; }
+        arg = end + 1;
+    }
+    return 0;
+}
+
+struct loadres {
+    double mbps;                       // bulk load of step
+    struct result probe;               // probe sender and receiver
+    struct result bulk;                // bulk sender
+};
+
+/*
+ * Run probes under each load step and print latency per step
+ */
+void load_test(struct param *pp) {
+    struct loadres *res = calloc(pp->nloads, sizeof(*res));
+    if (! res) {
+        perror("Load results allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    int i, size = pp->size ? pp->size : LOAD_SIZE;
+    for (i = 0; i < pp->nloads; i++) {
+        struct loadres *r = &res[i];
+        r->mbps = pp->load[i];
+
+        struct param pr = *pp;
+        pr.record = pr.forward = NULL;
+        pr.size = 0;
+        pr.count = (long)(pp->rate * pp->duration);
+        pr.res = &r->probe;
+        r->probe.idle = COMPARE_IDLE;
+
+        // Bulk sender, unstamped and unimpaired
+        struct param bk = *pp;
+        bk.mip = pp->bulkmip;
+        bk.port = pp->bulkport;
+        bk.dscp = pp->bulkdscp;
+        bk.stamp = bk.txstamp = 0;
+        bk.imp.enabled = 0;
+        bk.size = size;
+        bk.rate = r->mbps * 1e6 / 8 / size;
+        bk.count = (long)(bk.rate * pp->duration);
+        bk.res = &r->bulk;
+
+        pthread_t rt, st, bt;
+        pthread_create(&rt, NULL, recv_thread, &pr);
+        while (! __atomic_load_n(&r->probe.rxready, __ATOMIC_ACQUIRE)) { usleep(100); }
+        if (bk.count > 0) { pthread_create(&bt, NULL, send_thread, &bk); }
+        pthread_create(&st, NULL, send_thread, &pr);
+        pthread_join(st, NULL);
+        pthread_join(rt, NULL);
+        if (bk.count > 0) { pthread_join(bt, NULL); }
+    }
+
+    char probe_ip[INET6_ADDRSTRLEN], bulk_ip[INET6_ADDRSTRLEN], clock_name[32];
+    inet_ntop(AF_INET6, &pp->mip, probe_ip, sizeof(probe_ip));
+    inet_ntop(AF_INET6, &pp->bulkmip, bulk_ip, sizeof(bulk_ip));
+    tsc_name(clock_name, sizeof(clock_name));
+    printf("Load test: probes to [%s]:%d at %.0f pps dscp %d, bulk to [%s]:%d of %d bytes dscp %d,\n"
+           "           %.1f s per step, clock %s\n",
+                probe_ip, ntohs(pp->port), pp->rate, pp->dscp,
+                bulk_ip, ntohs(pp->bulkport), size, pp->bulkdscp, pp->duration, clock_name);
+    printf("%10s %10s %8s %8s %10s %10s %10s %10s %10s", "load Mbps", "bulk Mbps",
+                "probes", "lost", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    if (pp->txstamp) { printf(" %10s %10s", "qdisc p99", "driver p99"); }
+    printf("\n");
+    for (i = 0; i < pp->nloads; i++) {
+        struct loadres *r = &res[i];
+        const struct hist *h = &r->probe.lat;
+        printf("%10.1f %10.1f %8llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f", r->mbps,
+                r->bulk.txns ? r->bulk.txpkts * size * 8e3 / r->bulk.txns : 0.0,
+                (unsigned long long)h->n,
+                (unsigned long long)(r->probe.txpkts > h->n ? r->probe.txpkts - h->n : 0),
+                hist_pct(h, 50) / 1e3, hist_pct(h, 90) / 1e3, hist_pct(h, 99) / 1e3,
+                hist_pct(h, 99.9) / 1e3, h->max / 1e3);
+        if (pp->txstamp) {
+            printf(" %10.1f %10.1f", hist_pct(&r->probe.txqdisc, 99) / 1e3,
+                        hist_pct(&r->probe.txdriver, 99) / 1e3);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+    free(res);
+}
+
+/*
+ * Capability probe and auto-tune
+ *
+ * Kernel features differ across hosts, so --tune first probes what this
+ * kernel offers, then calibrates on the chosen interface with short bursts
+ * from a sender to a receiver thread, one setting at a time: engine, batch
+ * size, socket buffer size and busy poll spin, keeping what costs least CPU
+ * per delivered packet.  Calibration packets have TTL 0, so they loop back
+ * to this host only and never go on the wire.  Trials stop at the time
+ * budget, keeping startup under a second, and the chosen settings are
+ * printed as options to pin them.
+ */
+
+#define TUNE_BUDGET 800                // ms for all trials
+#define TUNE_COUNT 2000                // packets per trial
+#define TUNE_IDLE 20                   // ms without packets ending a trial
+
+// Kernel features found by probe
+struct caps {
+    int udp_gso;                       // UDP_SEGMENT
+    int udp_gro;                       // UDP_GRO
+    int io_uring;                      // io_uring_setup()
+    int multishot;                     // io_uring multishot receive
+    int txtime;                        // SO_TXTIME
+    int busy_poll;                     // SO_BUSY_POLL
+    int packet;                        // AF_PACKET socket
+};
+
+void probe(struct caps *c) {
+    memset(c, 0, sizeof(*c));
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed (probe)");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1, seg = 1000, spin = 1;
+    struct sock_txtime txtime = { CLOCK_MONOTONIC, 0 };
+    c->udp_gso = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0;
+    c->udp_gro = setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+    c->txtime = setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == 0;
+    c->busy_poll = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &spin, sizeof(spin)) == 0;
+
+#ifndef SIMULATION
+    // Kernels without multishot receive refuse it at submission
+    struct uring r;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (uring_init(&r, 8, &p) == 0) {
+        c->io_uring = 1;
+        struct io_uring_sqe *sqe = uring_sqe(&r);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sock;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        uring_push(&r);
+        uring_enter(&r, 0, 0);
+        struct io_uring_cqe *cqe = uring_cqe(&r);
+        c->multishot = ! cqe || cqe->res != -EINVAL;
+        uring_exit(&r);
+    }
+
+    int psock = socket(AF_PACKET, SOCK_DGRAM, 0);
+    c->packet = psock >= 0;
+    if (psock >= 0) { close(psock); }
+#endif
+    close(sock);
+
+    printf("Probe: udp_gso %s udp_gro %s io_uring %s multishot %s txtime %s busy_poll %s packet %s\n",
+                c->udp_gso ? "yes" : "no", c->udp_gro ? "yes" : "no",
+                c->io_uring ? "yes" : "no", c->multishot ? "yes" : "no",
+                c->txtime ? "yes" : "no", c->busy_poll ? "yes" : "no",
+                c->packet ? "yes" : "no");
+}
+
+// Run a calibration burst, returns CPU ns per delivered packet
+double tune_trial(const struct param *pp, int tx, int rx) {
+    struct result r;
+    memset(&r, 0, sizeof(r));
+    r.idle = TUNE_IDLE;
+    struct param tp = *pp;
+    tp.res = &r;
+    tp.rate = NSEC;                    // unpaced
+    tp.count = TUNE_COUNT;
+    tp.ttl = 0;                        // this host only
+    tp.loop = 1;
+    tp.quiet = 1;
+    tp.stamp = 0;
+    tp.stats = 0;
+    tp.bidir = 0;
+    tp.ssm = 0;                        // from any, calibration sender is local
+    tp.sip = in6addr_any;
+    tp.imp.enabled = 0;
+    tp.record = tp.forward = NULL;
+    tp.txstamp = 0;
+    run_pair(&tp);
+    if (r.rxpkts == 0) { return 1e30; }
+    return ((tx ? r.txcpu + r.txsq : 0) + (rx ? r.rxcpu + r.rxsq : 0)) / (double)r.rxpkts;
+}
+
+// Keep candidate if cheaper than best, while budget lasts
+static inline void tune_try(struct param *best, double *cost, const struct param *cand,
+                int tx, int rx, uint64_t budget, int *trials) {
+    if (now_ns() >= budget) { return; }
+    double c = tune_trial(cand, tx, rx);
+    (*trials)++;
+    if (c < *cost) {
+        *best = *cand;
+        *cost = c;
+    }
+}
+
+/*
+ * Probe and calibrate for sending (tx) and/or receiving (rx), and apply
+ */
+void tune(struct param *pp, int tx, int rx) {
+    uint64_t t0 = now_ns(), budget = t0 + TUNE_BUDGET * 1000000ULL;
+    static const int batches[] = { 8, 16, 32 };
+    static const int bufs[] = { 256 * 1024, 1024 * 1024, 4096 * 1024 };
+    static const int spins[] = { 25, 50 };
+    struct caps c;
+    probe(&c);
+
+    struct param best = *pp, cand;
+    double cost = tune_trial(&best, tx, rx);
+    int i, trials = 1;
+
+    for (i = 0; i < NENGINES; i++) {
+        if (&engines[i] == best.engine || (! rx && ! engines[i].send)) { continue; }
+        if (eng_usable(pp, &engines[i]) != 0) { continue; }
+        cand = best;
+        cand.engine = &engines[i];
+        tune_try(&best, &cost, &cand, tx, rx, budget, &trials);
+    }
+    for (i = 0; best.engine->batch > 1 && i < (int)(sizeof(batches) / sizeof(batches[0])); i++) {
+        cand = best;
+        cand.batch = batches[i];
+        tune_try(&best, &cost, &cand, tx, rx, budget, &trials);
+    }
+    for (i = 0; i < (int)(sizeof(bufs) / sizeof(bufs[0])); i++) {
+        cand = best;
+        cand.sockbuf = bufs[i];
+        tune_try(&best, &cost, &cand, tx, rx, budget, &trials);
+    }
+    for (i = 0; rx && c.busy_poll && i < (int)(sizeof(spins) / sizeof(spins[0])); i++) {
+        cand = best;
+        cand.busypoll = spins[i];
+        tune_try(&best, &cost, &cand, tx, rx, budget, &trials);
+    }
+
+    pp->engine = best.engine;
+    pp->batch = best.batch;
+    pp->sockbuf = best.sockbuf;
+    pp->busypoll = best.busypoll;
+    printf("Tuned in %llu ms, %d trials, ",
+                (unsigned long long)((now_ns() - t0) / 1000000), trials);
+    if (cost < 1e30) {
+        printf("%.0f ns cpu per packet", cost);
+    } else {
+        printf("nothing delivered, defaults kept");
+    }
+    printf(": --engine %s --batch %d --sockbuf %d --busypoll %d\n",
+                pp->engine->name, pp->batch ? pp->batch : pp->engine->batch,
+                pp->sockbuf, pp->busypoll);
+    fflush(stdout);
+}
+
+#ifdef SIMULATION
+/*
+ * Simulation scenario and scheduler
+ */
+
+// Load scenario script of link impairment events
+void sim_script(const char *file) {
+    FILE *fp = fopen(file, "r");
+    if (! fp) {
+        perror("Open simulation script failed");
+        exit(EXIT_FAILURE);
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *c = strchr(line, '#');
+        if (c) { *c = '\0'; }
+        double sec;
+        char link[32];
+        int n;
+        if (sscanf(line, "%lf %31s%n", &sec, link, &n) < 2) { continue; }
+
+        struct simevent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.at = (uint64_t)(sec * NSEC);
+        ev.index = -1;
+        if (link[0] == 's' || link[0] == 'r') {
+            ev.sender = link[0] == 's';
+            ev.index = atoi(link + 1);
+        }
+        int bad = (link[0] != '*' && ev.index < 0) || sec < 0;
+
+        char *key, *save;
+        for (key = strtok_r(line + n, " \t\r\n", &save); key && ! bad;
+                        key = strtok_r(NULL, " \t\r\n", &save)) {
+            if (strcmp(key, "down") == 0) { ev.mask |= SIM_DOWN; ev.set.down = 1; continue; }
+            if (strcmp(key, "up") == 0) { ev.mask |= SIM_DOWN; ev.set.down = 0; continue; }
+            char *val = strtok_r(NULL, " \t\r\n", &save);
+            if (! val) { bad = 1; break; }
+            if (strcmp(key, "loss") == 0) { ev.mask |= SIM_LOSS; ev.set.loss = atof(val); } else
+            if (strcmp(key, "dup") == 0) { ev.mask |= SIM_DUP; ev.set.dup = atof(val); } else
+            if (strcmp(key, "delay") == 0) { ev.mask |= SIM_DELAY; ev.set.delay = atof(val); } else
+            if (strcmp(key, "jitter") == 0) { ev.mask |= SIM_JITTER; ev.set.jitter = atof(val); } else
+            { bad = 1; }
+        }
+        if (bad) {
+            fprintf(stderr, "Bad simulation script line %d: %s\n", lineno, file);
+            exit(EXIT_FAILURE);
+        }
+
+        // Keep events in time order, same time in script order
+        sim_ev = realloc(sim_ev, (sim_nev + 1) * sizeof(*sim_ev));
+        if (! sim_ev) {
+            perror("Simulation script allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        int i = sim_nev++;
+        while (i > 0 && sim_ev[i - 1].at > ev.at) {
+            sim_ev[i] = sim_ev[i - 1];
+            i--;
+        }
+        sim_ev[i] = ev;
+    }
+    fclose(fp);
+}
+
+static inline void sim_set(struct simlink *lk, const struct simevent *ev) {
+    if (ev->mask & SIM_LOSS) { lk->loss = ev->set.loss; }
+    if (ev->mask & SIM_DUP) { lk->dup = ev->set.dup; }
+    if (ev->mask & SIM_DELAY) { lk->delay = ev->set.delay; }
+    if (ev->mask & SIM_JITTER) { lk->jitter = ev->set.jitter; }
+    if (ev->mask & SIM_DOWN) { lk->down = ev->set.down; }
+}
+
+// Apply script events fallen due
+void sim_events(uint64_t now, int senders, int receivers) {
+    while (sim_evnext < sim_nev && sim_ev[sim_evnext].at <= now) {
+        struct simevent *ev = &sim_ev[sim_evnext++];
+        int i;
+        if (ev->sender) {
+            if (ev->index < senders) { sim_set(&sim_slink[ev->index], ev); }
+        } else
+        for (i = 0; i < receivers; i++) {
+            if (ev->index < 0 || ev->index == i) { sim_set(&sim_rlink[i], ev); }
+        }
+    }
+}
+
+void sim_entry(int t) {
+    sim_task[t].fn(&sim_task[t].p);
+    sim_wakeup(t, UINT64_MAX);          // finished, back to scheduler
+}
+
+/*
+ * Run senders and receivers on simulated network until duration
+ */
+void sim_run(struct param *pp) {
+    int senders = pp->senders, receivers = pp->receivers;
+    uint64_t end = (uint64_t)(pp->duration * NSEC);
+
+    rng_seed(&sim_rng, pp->imp.seed);
+    sim_ntask = senders + receivers;
+    sim_task = calloc(sim_ntask, sizeof(*sim_task));
+    sim_slink = calloc(senders, sizeof(*sim_slink));
+    sim_rlink = calloc(receivers, sizeof(*sim_rlink));
+    if (! sim_task || ! sim_slink || ! sim_rlink) {
+        perror("Simulation allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pp->script) { sim_script(pp->script); }
+
+    // Senders are 2001:db8::1:0:1 and on, receivers are 2001:db8::2:0:1 and on
+    int t;
+    for (t = 0; t < sim_ntask; t++) {
+        struct simtask *tp = &sim_task[t];
+        tp->p = *pp;
+        tp->sender = t < senders;
+        tp->index = tp->sender ? t : t - senders;
+        tp->fn = tp->sender ? send_thread : recv_thread;
+        uint32_t host = htonl(tp->index + 1);
+        inet_pton(AF_INET6, tp->sender ? "2001:db8::1:0:0" : "2001:db8::2:0:0", &tp->addr);
+        memcpy(&tp->addr.s6_addr[12], &host, sizeof(host));
+        tp->p.imp.seed = pp->imp.seed + tp->index;  // independent impairments
+
+        getcontext(&tp->ctx);
+        tp->ctx.uc_stack.ss_sp = malloc(SIM_STACK);
+        tp->ctx.uc_stack.ss_size = SIM_STACK;
+        tp->ctx.uc_link = &sim_main;
+        if (! tp->ctx.uc_stack.ss_sp) {
+            perror("Simulation stack allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        makecontext(&tp->ctx, (void (*)(void))sim_entry, 1, t);
+    }
+
+    // Receivers join first, then senders start, all at time zero
+    for (t = senders; t < sim_ntask; t++) { sim_wakeup(t, 0); }
+    for (t = 0; t < senders; t++) { sim_wakeup(t, 0); }
+
+    printf("Simulating %d senders and %d receivers for %.3f s, seed %llu\n",
+                senders, receivers, pp->duration, (unsigned long long)pp->imp.seed);
+
+    struct timespec w0, w1;
+    clock_gettime(CLOCK_MONOTONIC, &w0);
+    while (sim_nwq > 0) {
+        struct simwake w = sim_wq_pop();
+        if (w.gen != sim_task[w.task].gen) { continue; }   // superseded
+        if (w.at > end) { break; }
+        sim_now = w.at;
+        sim_events(sim_now, senders, receivers);
+        sim_cur = w.task;
+        sim_switches++;
+        swapcontext(&sim_main, &sim_task[w.task].ctx);
+        sim_cur = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &w1);
+    double wall = (w1.tv_sec - w0.tv_sec) + (w1.tv_nsec - w0.tv_nsec) / 1e9;
+
+    for (t = senders; t < sim_ntask; t++) {
+        struct simtask *tp = &sim_task[t];
+        char ipaddr[INET6_ADDRSTRLEN];
+        printf("Receiver r%d %s\n", tp->index,
+                    inet_ntop(AF_INET6, &tp->addr, ipaddr, sizeof(ipaddr)));
+        if (tp->rx) { rx_report(tp->rx); }
+    }
+    printf("Simulated %.3f s: %llu impaired %llu sent %llu delivered %llu link lost %llu dropped\n",
+                pp->duration, (unsigned long long)sim_impaired, (unsigned long long)sim_sent,
+                (unsigned long long)sim_delivered, (unsigned long long)sim_lost,
+                (unsigned long long)sim_dropped);
+
+    // Only line depending on host, others reproduce from seed
+    printf("Simulation speed: %llu switches in %.3f s, %.0f packets/s\n",
+                (unsigned long long)sim_switches, wall,
+                wall > 0 ? sim_delivered / wall : 0.0);
+    fflush(stdout);
+}
+#endif
+
+/*
  * Show usage error
  */
 void errusage(const char *fn) {
-    fprintf(stderr, "Usage: %s <send|recv|both> <mip> <port> [sip|-] [ifname]\n", fn);
+#ifdef SIMULATION
+    fprintf(stderr, "Usage: %s sim <mip> <port> [sip|-] [ifname] [options]\n", fn);
+#else
+    fprintf(stderr, "Usage: %s <send|recv|both|compare|load|streams|topology|querier|router> <mip> <port> [sip|-] [ifname] [options]\n", fn);
+#endif
+    fprintf(stderr, "Options: --rate pps --seed n --loss pct --ge p,r[,lg,lb] --dup pct\n"
+                    "         --reorder pct[,depth] --delay ms[,jitter] --corrupt pct\n"
+                    "         --send-threads n --pattern spec\n"
+                    "         -q|--quiet --stats sec --pcap file --realtime --burst us[,pps] --path\n"
+                    "         --record file --forward [addr]:port --police pps[,burst] --streams n\n"
+                    "         --topo n[,n]... --query sec[,ms[,gsec]] --vifs if[,if]...\n"
+                    "         --netns prefix[,n]\n"
+                    "         --group [mip]:port[:cls[:q]] --workers n --work us\n"
+                    "         --engine name --count n --stamp --batch n --sockbuf bytes\n"
+                    "         --busypoll us --tune --txstamp --sync port --clock name\n"
+                    "         --load mbps[,mbps]... --bulk [mip]:port[:dscp] --size bytes --dscp n\n"
+                    "         --udplite cov --pmtu port\n"
+                    "         --nodes senders,receivers --duration sec --script file\n");
+    fprintf(stderr, "Engines:");
+    int i;
+    for (i = 0; i < NENGINES; i++) { fprintf(stderr, " %s", engines[i].name); }
+    fprintf(stderr, "\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -324,15 +6865,190 @@ void errusage(const char *fn) {
  * Main, parase parameters and invoke threads
  */
 int main(int argc, char const *argv[]) {
-    if (argc < 4) { errusage(argv[0]); }
-
     struct param p;
     memset(&p, 0, sizeof(p));
+    p.engine = &engines[0];                     // plain sendto/recvfrom
+    p.ttl = HOP;                                // beyond routers
+    p.imp.seed = 1;                             // reproducible by default
+    p.imp.depth = 3;                            // reorder behind 3 packets
+    p.imp.ge_lb = 100;                          // all lost in bad state
+    p.senders = 1;                              // simulated nodes
+    p.receivers = 1;
+    p.duration = 0;                             // default of mode below
+
+    // Parse options, leaving positional parameters in argv[1] and after
+    enum { OPT_RATE = 256, OPT_SEED, OPT_LOSS, OPT_GE, OPT_DUP,
+           OPT_REORDER, OPT_DELAY, OPT_CORRUPT, OPT_STATS, OPT_PCAP,
+           OPT_REALTIME, OPT_NODES, OPT_DURATION, OPT_SCRIPT, OPT_ENGINE,
+           OPT_COUNT, OPT_STAMP, OPT_BATCH, OPT_SOCKBUF, OPT_BUSYPOLL,
+           OPT_TUNE, OPT_RECORD, OPT_FORWARD, OPT_GROUP,
+           OPT_WORKERS, OPT_WORK, OPT_SENDTHREADS, OPT_TXSTAMP, OPT_SYNC, OPT_CLOCK,
+           OPT_LOAD, OPT_BULK, OPT_SIZE, OPT_DSCP, OPT_BURST, OPT_PATTERN,
+           OPT_PATH, OPT_POLICE, OPT_STREAMS, OPT_TOPO, OPT_QUERY, OPT_VIFS,
+           OPT_NETNS, OPT_UDPLITE, OPT_PMTU };
+    static const struct option opts[] = {
+        { "rate",    required_argument, NULL, OPT_RATE },
+        { "seed",    required_argument, NULL, OPT_SEED },
+        { "loss",    required_argument, NULL, OPT_LOSS },
+        { "ge",      required_argument, NULL, OPT_GE },
+        { "dup",     required_argument, NULL, OPT_DUP },
+        { "reorder", required_argument, NULL, OPT_REORDER },
+        { "delay",   required_argument, NULL, OPT_DELAY },
+        { "corrupt", required_argument, NULL, OPT_CORRUPT },
+        { "quiet",   no_argument,       NULL, 'q' },
+        { "stats",   required_argument, NULL, OPT_STATS },
+        { "pcap",    required_argument, NULL, OPT_PCAP },
+        { "realtime", no_argument,      NULL, OPT_REALTIME },
+        { "nodes",   required_argument, NULL, OPT_NODES },
+        { "duration", required_argument, NULL, OPT_DURATION },
+        { "script",  required_argument, NULL, OPT_SCRIPT },
+        { "engine",  required_argument, NULL, OPT_ENGINE },
+        { "count",   required_argument, NULL, OPT_COUNT },
+        { "stamp",   no_argument,       NULL, OPT_STAMP },
+        { "batch",   required_argument, NULL, OPT_BATCH },
+        { "sockbuf", required_argument, NULL, OPT_SOCKBUF },
+        { "busypoll", required_argument, NULL, OPT_BUSYPOLL },
+        { "tune",    no_argument,       NULL, OPT_TUNE },
+        { "record",  required_argument, NULL, OPT_RECORD },
+        { "forward", required_argument, NULL, OPT_FORWARD },
+        { "group",   required_argument, NULL, OPT_GROUP },
+        { "workers", required_argument, NULL, OPT_WORKERS },
+        { "work",    required_argument, NULL, OPT_WORK },
+        { "send-threads", required_argument, NULL, OPT_SENDTHREADS },
+        { "txstamp", no_argument,       NULL, OPT_TXSTAMP },
+        { "sync",    required_argument, NULL, OPT_SYNC },
+        { "clock",   required_argument, NULL, OPT_CLOCK },
+        { "load",    required_argument, NULL, OPT_LOAD },
+        { "bulk",    required_argument, NULL, OPT_BULK },
+        { "size",    required_argument, NULL, OPT_SIZE },
+        { "dscp",    required_argument, NULL, OPT_DSCP },
+        { "burst",   required_argument, NULL, OPT_BURST },
+        { "pattern", required_argument, NULL, OPT_PATTERN },
+        { "path",    no_argument,       NULL, OPT_PATH },
+        { "police",  required_argument, NULL, OPT_POLICE },
+        { "streams", required_argument, NULL, OPT_STREAMS },
+        { "topo",    required_argument, NULL, OPT_TOPO },
+        { "query",   required_argument, NULL, OPT_QUERY },
+        { "vifs",    required_argument, NULL, OPT_VIFS },
+        { "netns",   required_argument, NULL, OPT_NETNS },
+        { "udplite", required_argument, NULL, OPT_UDPLITE },
+        { "pmtu",    required_argument, NULL, OPT_PMTU },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, (char * const *)argv, "q", opts, NULL)) != -1) {
+        switch (opt) {
+        case OPT_RATE:    p.rate = atof(optarg); break;
+        case OPT_SEED:    p.imp.seed = strtoull(optarg, NULL, 0); break;
+        case OPT_LOSS:    p.imp.loss = atof(optarg); break;
+        case OPT_GE:      if (sscanf(optarg, "%lf,%lf,%lf,%lf", &p.imp.ge_p, &p.imp.ge_r,
+                                &p.imp.ge_lg, &p.imp.ge_lb) < 2) { errusage(argv[0]); }
+                          break;
+        case OPT_DUP:     p.imp.dup = atof(optarg); break;
+        case OPT_REORDER: if (sscanf(optarg, "%lf,%d", &p.imp.reorder, &p.imp.depth) < 1) { errusage(argv[0]); }
+                          break;
+        case OPT_DELAY:   if (sscanf(optarg, "%lf,%lf", &p.imp.delay, &p.imp.jitter) < 1) { errusage(argv[0]); }
+                          break;
+        case OPT_CORRUPT: p.imp.corrupt = atof(optarg); break;
+        case 'q':         p.quiet = 1; break;
+        case OPT_STATS:   p.stats = atof(optarg); break;
+        case OPT_PCAP:    p.pcap = optarg; break;
+        case OPT_REALTIME: p.realtime = 1; break;
+        case OPT_NODES:   if (sscanf(optarg, "%d,%d", &p.senders, &p.receivers) != 2) { errusage(argv[0]); }
+                          break;
+        case OPT_DURATION: p.duration = atof(optarg); break;
+        case OPT_SCRIPT:  p.script = optarg; break;
+        case OPT_ENGINE:  p.engine = eng_find(optarg); break;
+        case OPT_COUNT:   p.count = atol(optarg); break;
+        case OPT_STAMP:   p.stamp = 1; break;
+        case OPT_BATCH:   p.batch = atoi(optarg); break;
+        case OPT_SOCKBUF: p.sockbuf = atoi(optarg); break;
+        case OPT_BUSYPOLL: p.busypoll = atoi(optarg); break;
+        case OPT_TUNE:    p.tune = 1; break;
+        case OPT_RECORD:  p.record = optarg; break;
+        case OPT_FORWARD: p.forward = optarg; break;
+        case OPT_GROUP:   if (p.ngroups == MAXGROUPS ||
+                                ! grp_parse(optarg, &p.group[p.ngroups++])) { errusage(argv[0]); }
+                          break;
+        case OPT_WORKERS: p.workers = atoi(optarg); break;
+        case OPT_WORK:    p.work = atof(optarg); break;
+        case OPT_SENDTHREADS: p.sendthreads = atoi(optarg); break;
+        case OPT_TXSTAMP: p.txstamp = 1; break;
+        case OPT_SYNC:    p.syncport = atoi(optarg); break;
+        case OPT_CLOCK:   p.clocksrc = optarg; break;
+        case OPT_LOAD:    if (! load_steps(optarg, &p)) { errusage(argv[0]); } break;
+        case OPT_BULK:    if (! load_parse(optarg, &p)) { errusage(argv[0]); } break;
+        case OPT_SIZE:    p.size = atoi(optarg); break;
+        case OPT_DSCP:    p.dscp = atoi(optarg); break;
+        case OPT_BURST:   sscanf(optarg, "%lf,%lf", &p.burst, &p.burstpps); break;
+        case OPT_PATTERN: if (! pat_parse(optarg, &p.pat)) { errusage(argv[0]); } break;
+        case OPT_PATH:    p.path = 1; break;
+        case OPT_POLICE:  sscanf(optarg, "%lf,%lf", &p.police, &p.policeburst); break;
+        case OPT_STREAMS: p.streams = atoi(optarg); break;
+        case OPT_TOPO:    if (! topo_steps(optarg, &p)) { errusage(argv[0]); } break;
+        case OPT_QUERY:   sscanf(optarg, "%lf,%d,%lf", &p.qint, &p.qresp, &p.qgrp); break;
+        case OPT_VIFS:    p.vifs = optarg; break;
+        case OPT_NETNS:   sscanf(optarg, "%63[^,],%d", p.netns, &p.nnetns); break;
+        case OPT_UDPLITE: p.lite = 1; p.cscov = atoi(optarg); break;
+        case OPT_PMTU:    p.pmtuport = atoi(optarg); break;
+        default:          errusage(argv[0]);
+        }
+    }
+    if (p.rate < 0 || ! imp_valid(&p.imp) || p.count < 0 || ! p.engine) { errusage(argv[0]); }
+    if (p.batch < 0 || p.batch > ENGBATCH || p.sockbuf < 0 || p.busypoll < 0) { errusage(argv[0]); }
+    if (p.senders < 0 || p.receivers < 0 || p.duration < 0) { errusage(argv[0]); }
+#ifdef SIMULATION
+    if (p.senders > SIM_MAXNODES || p.receivers > SIM_MAXNODES) { errusage(argv[0]); }
+#endif
+    if (p.size < 0 || p.size > MAXPAYLOAD || p.dscp < 0 || p.dscp > 63) { errusage(argv[0]); }
+    if (p.burst < 0 || (p.burst > 0 && p.burst < 1) || p.burstpps < 0) { errusage(argv[0]); }
+    if (p.police < 0 || p.policeburst < 0) { errusage(argv[0]); }
+    if (p.cscov < 0 || (p.cscov > 0 && p.cscov < 8) || p.cscov > 65535) { errusage(argv[0]); }
+    if (p.pmtuport < 0 || p.pmtuport > 65535 ||
+            (p.pmtuport > 0 && (p.sendthreads > 1 || p.netns[0]))) { errusage(argv[0]); }
+    if (p.streams < 0 || p.streams > MAXSTREAMS << 12) { errusage(argv[0]); }
+    if (p.qint < 0 || p.qgrp < 0 || (p.qresp != 0 && (p.qresp < 100 || p.qresp > 12700))) {
+        errusage(argv[0]);
+    }
+    if (p.workers < 0 || p.workers > MAXWORKERS || p.work < 0) { errusage(argv[0]); }
+    if (p.sendthreads < 0 || (p.sendthreads > 1 && p.count > 0 && p.count < p.sendthreads) ||
+            (p.sendthreads > 1 && p.pat.kind != PAT_NONE)) {
+        errusage(argv[0]);
+    }
+    if ((p.ngroups > 0 || p.workers > 0) && (p.pcap || p.record || p.forward)) { errusage(argv[0]); }
+    if (p.nnetns < 0 || p.nnetns > MAXNETNS || (p.netns[0] && (p.ngroups > 0 || p.workers > 0 ||
+            p.pcap || p.record || p.forward || p.sendthreads > 1 || p.syncport))) {
+        errusage(argv[0]);
+    }
+    if (p.syncport < 0 || p.syncport > 65535 || (p.syncport && p.pcap)) { errusage(argv[0]); }
+    if (p.clocksrc && strcmp(p.clocksrc, "tsc") != 0 && strcmp(p.clocksrc, "vdso") != 0) {
+        errusage(argv[0]);
+    }
+    p.imp.enabled = p.imp.loss > 0 || p.imp.ge_p > 0 || p.imp.dup > 0 ||
+                    p.imp.reorder > 0 || p.imp.delay > 0 || p.imp.jitter > 0 ||
+                    p.imp.corrupt > 0;
+    if (p.size > BUFSIZE && p.imp.enabled) { errusage(argv[0]); }     // slots hold BUFSIZE
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    if (argc < 4) { errusage(argv[0]); }
+
     p.sip = in6addr_any;                         // default is ::
     p.ifname = IFNAMEDEFAULT;                    // default string
     p.ifidx = IFIDXDEFAULT;                      // default is 0
 
-    const char *mode = argv[1];                  // mode send/recv/both
+    const char *mode = argv[1];                  // mode send/recv/both/compare
+    if (p.rate == 0) {                           // one packet per second
+        p.rate = strcmp(mode,"compare") == 0 ? COMPARE_RATE :
+                 strcmp(mode,"load") == 0 ? LOAD_RATE :
+                 strcmp(mode,"topology") == 0 ? TOPO_RATE : 1;
+    }
+    if (p.duration == 0) {                       // simulated, or per load step
+        p.duration = strcmp(mode,"load") == 0 ? LOAD_STEP :
+                     strcmp(mode,"topology") == 0 ? TOPO_STEP :
+                     strcmp(mode,"router") == 0 ? 0 : 10;
+    }
 
     inet_pton(AF_INET6, argv[2], &p.mip);        // multicast group address
     p.port = htons(atoi(argv[3]));               // udp port number
@@ -351,25 +7067,109 @@ int main(int argc, char const *argv[]) {
         p.ifidx = if_nametoindex(p.ifname);
     }
 
+#ifdef SIMULATION
+    if (strcmp(mode,"sim") == 0) {               // simulated network
+        p.loop = 1;
+        if (p.syncport) { errusage(argv[0]); }    // no side channel
+        sim_run(&p);
+        return 0;
+    }
+    errusage(argv[0]);
+#endif
+    tsc_init(! p.clocksrc || strcmp(p.clocksrc, "tsc") == 0);
+
+    pthread_t rt, st;
+    if (strcmp(mode,"recv") == 0 && p.pcap) {  // offline receive pipeline
+        pcap_replay(&p);
+        return 0;
+    } else
+    if (strcmp(mode,"compare") == 0) {           // engines side by side
+        p.loop = 1;
+        p.quiet = 1;
+        p.stamp = 1;
+        if (p.count == 0) { p.count = COMPARE_COUNT; }
+        compare(&p);
+        return 0;
+    } else
+    if (strcmp(mode,"load") == 0) {              // probes under bulk load
+        p.loop = 1;
+        p.quiet = 1;
+        p.stamp = 1;
+        if (p.bulkport == 0) {
+            p.bulkmip = p.mip;
+            p.bulkport = htons(ntohs(p.port) + 1);
+        }
+        if (p.nloads == 0) { load_steps(LOAD_STEPS, &p); }
+        load_test(&p);
+        return 0;
+    } else
+    if (strcmp(mode,"streams") == 0) {          // stream table at scale
+        if (p.streams == 0) { p.streams = STREAMS_BENCH; }
+        streams_bench(&p);
+        return 0;
+    } else
+    if (strcmp(mode,"topology") == 0) {         // socket layouts at group counts
+        if (p.ntopo == 0) { topo_steps(TOPO_GROUPS, &p); }
+        topology(&p);
+        return 0;
+    } else
+    if (strcmp(mode,"querier") == 0) {          // queries and host reports
+        if (p.qint == 0) { p.qint = QRY_INTERVAL; }
+        if (p.qresp == 0) { p.qresp = QRY_RESP; }
+        querier(&p);
+        return 0;
+    } else
+    if (strcmp(mode,"router") == 0) {           // kernel forwarding between interfaces
+        if (! p.vifs) { errusage(argv[0]); }
+        if (p.stats == 0) { p.stats = MRT_STATS; }
+        mrouter(&p);
+        return 0;
+    }
+
+    // Calibrate for what this mode runs, before it starts
+    int tx = strcmp(mode,"send") == 0 || strcmp(mode,"both") == 0;
+    int rx = strcmp(mode,"recv") == 0 || strcmp(mode,"both") == 0;
+    if (p.tune && (tx || rx)) { tune(&p, tx, rx); }
+
+    // Clock sync side channel, sender answers and receiver asks
+    pthread_t ct;
+    if (p.syncport && tx) { pthread_create(&ct, NULL, clk_server, &p); }
+    if (p.syncport && rx) { pthread_create(&ct, NULL, clk_client, &p); }
+
+    if (strcmp(mode,"recv") == 0 && p.netns[0]) { // thread per namespace
+        ns_run(&p, 0);
+        return 0;
+    } else
     if (strcmp(mode,"recv") == 0) {              // invoke receiver thread
-        pthread_t rt;
-        pthread_create(&rt, NULL, recv_thread, &p);
+        pthread_create(&rt, NULL, p.ngroups || p.workers ? group_thread : recv_thread, &p);
     } else
     if (strcmp(mode,"send") == 0) {              // invoke sender thread
         p.loop = 1;
-        pthread_t st;
+        if (p.netns[0]) {                       // sender thread per namespace
+            ns_run(&p, 1);
+            return 0;
+        }
+        if (p.sendthreads > 1) {              // threads sharing rate
+            send_threads(&p);
+            return 0;
+        }
         pthread_create(&st, NULL, send_thread, &p);
     } else
     if (strcmp(mode,"both") == 0) {              // invoke both thread
+        if (p.sendthreads > 1 || p.netns[0]) { errusage(argv[0]); }  // one source port
         p.bidir = 1;
-        pthread_t rt;
-        pthread_create(&rt, NULL, recv_thread, &p);
-        pthread_t st;
+        pthread_create(&rt, NULL, p.ngroups || p.workers ? group_thread : recv_thread, &p);
         pthread_create(&st, NULL, send_thread, &p);
     } else {
         errusage(argv[0]);
     }
-    pause();
+
+    // Run until sender has sent its count, or forever
+    if (p.count > 0 && strcmp(mode,"recv") != 0) {
+        pthread_join(st, NULL);
+    } else {
+        pause();
+    }
 
     return 0;
 }